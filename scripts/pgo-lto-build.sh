@@ -0,0 +1,85 @@
+#!/usr/bin/env bash
+#
+# Profile-guided, link-time optimized build of the vpn2 scenario.
+#
+# Run from the root of an ns-3.36.1 tree with vpn2.cc in scratch/:
+#     scripts/pgo-lto-build.sh            (the script may live anywhere)
+#
+# 1. builds the optimized profile as it is and times the benchmark workload,
+# 2. builds an instrumented copy and runs the training workload to collect
+#    the profile (gcc -fprofile-generate),
+# 3. rebuilds ns-3 statically with the profile and link-time optimization, so
+#    the optimizer sees vpn2 and the modules it uses as one program,
+# 4. times the benchmark again and prints the events/s of both builds.
+#
+# The workloads are plain vpn2 arguments and can be overridden:
+#     WORKLOAD   arguments of the timed runs
+#     TRAINING   arguments of the profiling run (defaults to WORKLOAD)
+#     RUNS       timed runs per build, the best one counts (default 3)
+#     VPN2_FLAGS extra compiler flags for both builds, e.g. -DVPN2_SMALL_OBJECT_POOL
+#     PROFILE_DIR where the profile is written (default ./pgo-profile)
+# Apply patches/*.patch before running the script; both builds use the same tree.
+# The last build is left in place, so ./ns3 run vpn2 runs the optimized binary.
+
+set -euo pipefail
+
+WORKLOAD=${WORKLOAD:-"--tracing=0 --lanSize=32 --rpcClients=24 --cbrRate=40Mbps"}
+TRAINING=${TRAINING:-$WORKLOAD}
+RUNS=${RUNS:-3}
+VPN2_FLAGS=${VPN2_FLAGS:-}
+PROFILE_DIR=$(realpath -m "${PROFILE_DIR:-pgo-profile}")
+MODULES="core;network;internet;csma;point-to-point;applications;virtual-net-device;traffic-control;bridge"
+
+if [ ! -x ./ns3 ] || [ ! -f scratch/vpn2.cc ]; then
+    echo "run from the root of an ns-3 tree that has scratch/vpn2.cc" >&2
+    exit 1
+fi
+if ! ${CXX:-c++} --version | grep -qi "free software foundation" || ! command -v gcc-ar > /dev/null; then
+    echo "the profile and LTO flags are gcc's; set CXX to g++ and install gcc-ar" >&2
+    exit 1
+fi
+
+#Configure from scratch as ./ns3 configure --build-profile=optimized does, with extra
+#compiler flags and optionally a static build archived with the LTO plugin
+configure() {
+    local flags=$1 static=$2
+    ./ns3 clean > /dev/null
+    cmake -S . -B cmake-cache -DCMAKE_BUILD_TYPE=release -DNS3_NATIVE_OPTIMIZATIONS=ON \
+        -DNS3_EXAMPLES=OFF -DNS3_TESTS=OFF -DNS3_WARNINGS_AS_ERRORS=OFF \
+        -DNS3_ENABLED_MODULES="$MODULES" -DNS3_STATIC="$static" \
+        -DCMAKE_AR="$(command -v gcc-ar)" -DCMAKE_RANLIB="$(command -v gcc-ranlib)" \
+        -DCMAKE_CXX_FLAGS="$VPN2_FLAGS $flags" -DCMAKE_EXE_LINKER_FLAGS="$flags" > /dev/null
+    ./ns3 build vpn2 > /dev/null
+}
+
+#Best events/s of RUNS runs of the workload
+measure() {
+    local best=0 rate
+    for ((run = 0; run < RUNS; run++)); do
+        rate=$(./ns3 run --no-build "vpn2 $WORKLOAD" | sed -n 's/.*(\([0-9.e+]*\) events\/s).*/\1/p' | head -n 1)
+        if [ -z "$rate" ]; then
+            echo "vpn2 printed no events/s line" >&2
+            exit 1
+        fi
+        best=$(awk -v a="$best" -v b="$rate" 'BEGIN { print (b > a) ? b : a }')
+    done
+    echo "$best"
+}
+
+echo "Building the optimized profile"
+configure "" OFF
+baseline=$(measure)
+echo "  $baseline events/s"
+
+echo "Collecting the profile"
+rm -rf "$PROFILE_DIR"
+configure "-fprofile-generate=$PROFILE_DIR -fprofile-update=prefer-atomic" ON
+./ns3 run --no-build "vpn2 $TRAINING" > /dev/null
+
+echo "Building with the profile and link-time optimization"
+configure "-fprofile-use=$PROFILE_DIR -fprofile-partial-training -Wno-missing-profile -flto=auto" ON
+optimized=$(measure)
+echo "  $optimized events/s"
+
+awk -v a="$baseline" -v b="$optimized" \
+    'BEGIN { printf "PGO and LTO: %.0f events/s against %.0f, %+.1f%%\n", b, a, 100 * (b / a - 1) }'
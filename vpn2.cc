@@ -37,9 +37,31 @@
  */
 
 #include <iostream>
+#include <iomanip>
 #include <fstream>
 #include <string>
 #include <cassert>
+#include <chrono>
+#include <vector>
+#include <map>
+#include <set>
+#include <queue>
+#include <deque>
+#include <sstream>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <array>
+#include <memory>
+#include <new>
+#include <atomic>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include "ns3/csma-module.h"
 #include "ns3/header.h"
 #include "ns3/ipv4-global-routing-helper.h"
@@ -48,6 +70,20 @@
 #include "ns3/internet-module.h"
 #include "ns3/point-to-point-module.h"
 #include "ns3/applications-module.h"
+#include "ns3/virtual-net-device-module.h"
+#include "ns3/traffic-control-module.h"
+#include "ns3/bridge-module.h"
+#ifdef NS3_MPI
+#include <mpi.h>
+#include "ns3/mpi-interface.h"
+#include "ns3/mpi-receiver.h"
+#include "ns3/point-to-point-remote-channel.h"
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cpuid.h>
+#define VPN2_X86 1
+#endif
 
 
 using namespace ns3;
@@ -68,76 +104,6172 @@ using namespace ns3;
  * two security associations (SA) with the internet (one for each direction).
  */
 
+//UDP port the gateways use to carry ESP between each other (UDP encapsulation, RFC 3948)
+static const uint16_t VPN_ESP_PORT = 4500;
+
+//Bytes of the integrity check value (ICV) that ends every ESP packet with the default
+//integrity algorithm; HMAC-SHA-256-128 and GMAC produce MAX_ICV_SIZE bytes
+static const uint32_t ESP_ICV_SIZE = 12;
+static const uint32_t MAX_ICV_SIZE = 16;
+
+//Bytes the tunnel adds to every inner packet in the default mode: outer IPv4 + UDP +
+//ESP header + ICV (see TunnelOverhead for the others)
+static const uint16_t VPN_TUNNEL_OVERHEAD = 20 + 8 + 8 + ESP_ICV_SIZE;
+
+//Bytes PointToPointNetDevice puts in front of every frame
+static const uint32_t PPP_HEADER_SIZE = 2;
+
+/*
+ * Both classes share the same (toy) cipher: every byte of the inner packet is shifted
+ * by a keystream derived from the SA key. It is not meant to be secure, only to make
+ * sure that the bytes r1 forwards differ from the ones the hosts put on the LAN.
+ */
+static void ApplyKeystream(uint8_t *buffer, uint32_t size, u_int16_t key, bool encrypt) {
+    for (uint32_t i = 0; i < size; i++) {
+        uint8_t k = static_cast<uint8_t>(key + i * 31);
+        buffer[i] = encrypt ? buffer[i] + k : buffer[i] - k;
+    }
+}
+
+/*
+ * The ICV is a keyed hash over the ESP header and the ciphertext (encrypt-then-MAC), so
+ * the receiving gateway can throw away a corrupted packet before decrypting it. Two
+ * FNV-1a lanes are run side by side; every step of FNV-1a is a bijection, so any single
+ * corrupted byte is guaranteed to change the result.
+ */
+class IcvHasher {
+    public:
+        IcvHasher(u_int16_t key)
+            : a(0xcbf29ce484222325ULL ^ key), b(0x84222325cbf29ce4ULL ^ (uint64_t(key) << 32)) {}
+
+        void Update(const uint8_t *data, uint32_t size) {
+            for (uint32_t i = 0; i < size; i++) {
+                a = (a ^ data[i]) * 0x100000001b3ULL;
+                b = (b ^ data[i]) * 0x100000001b3ULL;
+            }
+        }
+
+        void Final(uint8_t icv[ESP_ICV_SIZE]) const {
+            uint64_t mixedB = b ^ (b >> 29) ^ a;
+            for (uint32_t i = 0; i < 8; i++) {
+                icv[i] = static_cast<uint8_t>(a >> (8 * i));
+            }
+            for (uint32_t i = 8; i < ESP_ICV_SIZE; i++) {
+                icv[i] = static_cast<uint8_t>(mixedB >> (8 * (i - 8)));
+            }
+        }
+    private:
+        uint64_t a;
+        uint64_t b;
+};
+
+static void WriteBigEndian32(uint8_t *out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static uint32_t ReadBigEndian32(const uint8_t *in) {
+    return (uint32_t(in[0]) << 24) | (uint32_t(in[1]) << 16) | (uint32_t(in[2]) << 8) | in[3];
+}
+
+/*
+ * Integrity-only protection. ESP-NULL (RFC 2410) sends the inner packet in the clear
+ * with the ESP header and ICV, AH (RFC 4302) puts its header and ICV in front of it.
+ * Both use a real MAC, HMAC-SHA-256-128 (RFC 4868) or AES-128-GMAC (RFC 4543), and the
+ * Authenticator below can also use them in place of the cheap keyed hash of the default
+ * ESP mode. The kernels use SHA-NI, AES-NI and PCLMULQDQ when the CPU has them and a
+ * portable version otherwise; both give the same results (FIPS 180-4, RFC 4231, FIPS
+ * 197 and GCM test vectors).
+ */
+
+//Which of the instruction set extensions the kernels below can use are present
+struct CpuFeatures {
+    bool sha = false;
+    bool aes = false;
+    bool pclmul = false;
+    bool ssse3 = false;
+
+    static const CpuFeatures &Get(void) {
+        static const CpuFeatures features = Detect();
+        return features;
+    }
+    private:
+        static CpuFeatures Detect(void) {
+            CpuFeatures features;
+#ifdef VPN2_X86
+            unsigned int eax, ebx, ecx, edx;
+            if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+                features.aes = (ecx & bit_AES) && (ecx & bit_SSE4_1);
+                features.pclmul = (ecx & bit_PCLMUL) && (ecx & bit_SSSE3);
+                features.ssse3 = ecx & bit_SSSE3;
+                bool sse41 = ecx & bit_SSE4_1;
+                if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+                    features.sha = sse41 && (ebx & bit_SHA);
+                }
+            }
+#endif
+            return features;
+        }
+};
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t RotateRight(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void Sha256CompressScalar(uint32_t state[8], const uint8_t *data, size_t blocks) {
+    for (; blocks > 0; blocks--, data += 64) {
+        uint32_t w[64];
+        for (int t = 0; t < 16; t++) {
+            w[t] = ReadBigEndian32(data + 4 * t);
+        }
+        for (int t = 16; t < 64; t++) {
+            uint32_t s0 = RotateRight(w[t - 15], 7) ^ RotateRight(w[t - 15], 18) ^ (w[t - 15] >> 3);
+            uint32_t s1 = RotateRight(w[t - 2], 17) ^ RotateRight(w[t - 2], 19) ^ (w[t - 2] >> 10);
+            w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int t = 0; t < 64; t++) {
+            uint32_t t1 = h + (RotateRight(e, 6) ^ RotateRight(e, 11) ^ RotateRight(e, 25))
+                + ((e & f) ^ (~e & g)) + SHA256_K[t] + w[t];
+            uint32_t t2 = (RotateRight(a, 2) ^ RotateRight(a, 13) ^ RotateRight(a, 22))
+                + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#ifdef VPN2_X86
+//SHA-NI keeps the state as ABEF/CDGH and runs two rounds per sha256rnds2; every
+//iteration below does four rounds and extends the message schedule by four words
+__attribute__((target("sha,sse4.1")))
+static void Sha256CompressShaNi(uint32_t state[8], const uint8_t *data, size_t blocks) {
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i cdab = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0xb1);
+    __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state + 4)), 0x1b);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xf0);
+
+    for (; blocks > 0; blocks--, data += 64) {
+        __m128i abefSaved = abef;
+        __m128i cdghSaved = cdgh;
+        __m128i w[4];
+        for (int i = 0; i < 4; i++) {
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16 * i)), byteSwap);
+        }
+        for (int i = 0; i < 16; i++) {
+            __m128i wk = _mm_add_epi32(w[i & 3], _mm_loadu_si128(reinterpret_cast<const __m128i *>(SHA256_K + 4 * i)));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(wk, 0x0e));
+            if (i < 12) {
+                __m128i next = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+                next = _mm_add_epi32(next, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+                w[i & 3] = _mm_sha256msg2_epu32(next, w[(i + 3) & 3]);
+            }
+        }
+        abef = _mm_add_epi32(abef, abefSaved);
+        cdgh = _mm_add_epi32(cdgh, cdghSaved);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_blend_epi16(feba, dchg, 0xf0));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state + 4), _mm_alignr_epi8(dchg, feba, 8));
+}
+#endif
+
+class Sha256 {
+    public:
+        Sha256();
+        void Update(const uint8_t *data, size_t size);
+        void Final(uint8_t digest[32]);
+    private:
+        void Compress(const uint8_t *data, size_t blocks);
+
+        uint32_t m_state[8];
+        uint8_t m_buffer[64];
+        size_t m_buffered = 0;
+        uint64_t m_length = 0;
+};
+
+Sha256::Sha256()
+    : m_state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19} {}
+
+void Sha256::Compress(const uint8_t *data, size_t blocks) {
+#ifdef VPN2_X86
+    if (CpuFeatures::Get().sha) {
+        Sha256CompressShaNi(m_state, data, blocks);
+        return;
+    }
+#endif
+    Sha256CompressScalar(m_state, data, blocks);
+}
+
+void Sha256::Update(const uint8_t *data, size_t size) {
+    m_length += size;
+    if (m_buffered > 0) {
+        size_t take = std::min(size, 64 - m_buffered);
+        std::memcpy(m_buffer + m_buffered, data, take);
+        m_buffered += take;
+        data += take;
+        size -= take;
+        if (m_buffered < 64) {
+            return;
+        }
+        Compress(m_buffer, 1);
+        m_buffered = 0;
+    }
+    if (size >= 64) {
+        Compress(data, size / 64);
+        data += size & ~size_t(63);
+        size &= 63;
+    }
+    std::memcpy(m_buffer, data, size);
+    m_buffered = size;
+}
+
+void Sha256::Final(uint8_t digest[32]) {
+    uint64_t bits = m_length * 8;
+    uint8_t padding[72] = {0x80};
+    size_t padSize = (m_buffered < 56 ? 56 : 120) - m_buffered;
+    for (int i = 0; i < 8; i++) {
+        padding[padSize + i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+    }
+    Update(padding, padSize + 8);
+    for (int i = 0; i < 8; i++) {
+        WriteBigEndian32(digest + 4 * i, m_state[i]);
+    }
+}
+
+//HMAC-SHA-256 keeps the hash states after the padded key blocks, so a MAC costs
+//the blocks of the message plus two
+class HmacSha256 {
+    public:
+        HmacSha256(const uint8_t *key, size_t size);
+        void Compute(const uint8_t *first, uint32_t firstSize, const uint8_t *second, uint32_t secondSize,
+                     uint8_t mac[32]) const;
+    private:
+        Sha256 m_inner;
+        Sha256 m_outer;
+};
+
+HmacSha256::HmacSha256(const uint8_t *key, size_t size) {
+    uint8_t block[64] = {};
+    if (size > 64) {
+        Sha256 hash;
+        hash.Update(key, size);
+        hash.Final(block);
+    } else {
+        std::memcpy(block, key, size);
+    }
+    uint8_t pad[64];
+    for (int i = 0; i < 64; i++) {
+        pad[i] = block[i] ^ 0x36;
+    }
+    m_inner.Update(pad, 64);
+    for (int i = 0; i < 64; i++) {
+        pad[i] = block[i] ^ 0x5c;
+    }
+    m_outer.Update(pad, 64);
+}
+
+void HmacSha256::Compute(const uint8_t *first, uint32_t firstSize, const uint8_t *second, uint32_t secondSize,
+                         uint8_t mac[32]) const {
+    Sha256 inner = m_inner;
+    inner.Update(first, firstSize);
+    inner.Update(second, secondSize);
+    uint8_t innerDigest[32];
+    inner.Final(innerDigest);
+    Sha256 outer = m_outer;
+    outer.Update(innerDigest, sizeof(innerDigest));
+    outer.Final(mac);
+}
+
+static const uint8_t AES_SBOX[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+static inline uint8_t AesDouble(uint8_t x) {
+    return (x << 1) ^ ((x & 0x80) ? 0x1b : 0);
+}
+
+static void AesEncryptScalar(const uint8_t roundKeys[176], const uint8_t in[16], uint8_t out[16]) {
+    uint8_t s[16];
+    for (int i = 0; i < 16; i++) {
+        s[i] = in[i] ^ roundKeys[i];
+    }
+    for (int round = 1; round <= 10; round++) {
+        //SubBytes and ShiftRows; byte i of the state is row i % 4, column i / 4
+        uint8_t t[16];
+        for (int i = 0; i < 16; i++) {
+            t[i] = AES_SBOX[s[(i + 4 * (i % 4)) % 16]];
+        }
+        if (round < 10) {
+            for (int c = 0; c < 4; c++) {
+                uint8_t *col = t + 4 * c;
+                uint8_t all = col[0] ^ col[1] ^ col[2] ^ col[3];
+                uint8_t first = col[0];
+                col[0] ^= all ^ AesDouble(col[0] ^ col[1]);
+                col[1] ^= all ^ AesDouble(col[1] ^ col[2]);
+                col[2] ^= all ^ AesDouble(col[2] ^ col[3]);
+                col[3] ^= all ^ AesDouble(col[3] ^ first);
+            }
+        }
+        for (int i = 0; i < 16; i++) {
+            s[i] = t[i] ^ roundKeys[16 * round + i];
+        }
+    }
+    std::memcpy(out, s, 16);
+}
+
+#ifdef VPN2_X86
+__attribute__((target("aes,sse4.1")))
+static void AesEncryptAesNi(const uint8_t roundKeys[176], const uint8_t in[16], uint8_t out[16]) {
+    const __m128i *keys = reinterpret_cast<const __m128i *>(roundKeys);
+    __m128i block = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in)), _mm_loadu_si128(keys));
+    for (int round = 1; round < 10; round++) {
+        block = _mm_aesenc_si128(block, _mm_loadu_si128(keys + round));
+    }
+    block = _mm_aesenclast_si128(block, _mm_loadu_si128(keys + 10));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out), block);
+}
+#endif
+
+//Multiplication in GF(2^128) with GCM's bit order, one bit at a time
+static void GhashMultiplyScalar(uint8_t x[16], const uint8_t h[16]) {
+    uint64_t zHigh = 0, zLow = 0;
+    uint64_t vHigh = 0, vLow = 0;
+    for (int i = 0; i < 8; i++) {
+        vHigh = (vHigh << 8) | h[i];
+        vLow = (vLow << 8) | h[8 + i];
+    }
+    for (int i = 0; i < 128; i++) {
+        if (x[i / 8] & (0x80 >> (i % 8))) {
+            zHigh ^= vHigh;
+            zLow ^= vLow;
+        }
+        bool carry = vLow & 1;
+        vLow = (vLow >> 1) | (vHigh << 63);
+        vHigh >>= 1;
+        if (carry) {
+            vHigh ^= 0xe100000000000000ULL;
+        }
+    }
+    for (int i = 0; i < 8; i++) {
+        x[i] = static_cast<uint8_t>(zHigh >> (56 - 8 * i));
+        x[8 + i] = static_cast<uint8_t>(zLow >> (56 - 8 * i));
+    }
+}
+
+#ifdef VPN2_X86
+//Carry-less multiplication of byte-reversed operands followed by the shift and
+//reduction from Intel's "Carry-Less Multiplication and Its Usage for Computing the
+//GCM Mode" white paper
+__attribute__((target("pclmul,sse4.1")))
+static __m128i GhashMultiplyClmul(__m128i a, __m128i b) {
+    __m128i low = _mm_clmulepi64_si128(a, b, 0x00);
+    __m128i middle = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+    __m128i high = _mm_clmulepi64_si128(a, b, 0x11);
+    low = _mm_xor_si128(low, _mm_slli_si128(middle, 8));
+    high = _mm_xor_si128(high, _mm_srli_si128(middle, 8));
+
+    //Shift the 256-bit product left by one to undo the bit reflection
+    __m128i lowCarry = _mm_srli_epi32(low, 31);
+    __m128i highCarry = _mm_srli_epi32(high, 31);
+    low = _mm_slli_epi32(low, 1);
+    high = _mm_slli_epi32(high, 1);
+    __m128i crossCarry = _mm_srli_si128(lowCarry, 12);
+    highCarry = _mm_slli_si128(highCarry, 4);
+    lowCarry = _mm_slli_si128(lowCarry, 4);
+    low = _mm_or_si128(low, lowCarry);
+    high = _mm_or_si128(_mm_or_si128(high, highCarry), crossCarry);
+
+    //Reduce modulo x^128 + x^7 + x^2 + x + 1
+    __m128i a1 = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(low, 31), _mm_slli_epi32(low, 30)),
+                               _mm_slli_epi32(low, 25));
+    __m128i a2 = _mm_srli_si128(a1, 4);
+    low = _mm_xor_si128(low, _mm_slli_si128(a1, 12));
+    __m128i b1 = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(low, 1), _mm_srli_epi32(low, 2)),
+                               _mm_srli_epi32(low, 7));
+    b1 = _mm_xor_si128(b1, a2);
+    low = _mm_xor_si128(low, b1);
+    return _mm_xor_si128(high, low);
+}
+
+//Folds whole blocks into the GHASH accumulator x
+__attribute__((target("pclmul,sse4.1")))
+static void GhashBlocksClmul(uint8_t x[16], const uint8_t h[16], const uint8_t *data, size_t blocks) {
+    const __m128i byteSwap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i hash = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(x)), byteSwap);
+    __m128i key = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(h)), byteSwap);
+    for (; blocks > 0; blocks--, data += 16) {
+        __m128i block = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data)), byteSwap);
+        hash = GhashMultiplyClmul(_mm_xor_si128(hash, block), key);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(x), _mm_shuffle_epi8(hash, byteSwap));
+}
+#endif
+
+//AES-128-GMAC (RFC 4543): GCM with everything authenticated and nothing encrypted.
+//The nonce is the salt followed by the 64-bit IV, which the tunnel takes from the
+//sequence number like the implicit IV of RFC 8750
+class AesGmac {
+    public:
+        AesGmac(const uint8_t key[16], const uint8_t salt[4]);
+        void Compute(const uint8_t *first, uint32_t firstSize, const uint8_t *second, uint32_t secondSize,
+                     uint64_t iv, uint8_t tag[16]) const;
+    private:
+        void EncryptBlock(const uint8_t in[16], uint8_t out[16]) const;
+        void GhashBlocks(uint8_t x[16], const uint8_t *data, size_t blocks) const;
+
+        uint8_t m_roundKeys[176];
+        uint8_t m_h[16];
+        uint8_t m_salt[4];
+};
+
+AesGmac::AesGmac(const uint8_t key[16], const uint8_t salt[4]) {
+    std::memcpy(m_roundKeys, key, 16);
+    uint8_t rcon = 1;
+    for (int i = 16; i < 176; i += 4) {
+        uint8_t t[4] = {m_roundKeys[i - 4], m_roundKeys[i - 3], m_roundKeys[i - 2], m_roundKeys[i - 1]};
+        if (i % 16 == 0) {
+            uint8_t first = t[0];
+            t[0] = AES_SBOX[t[1]] ^ rcon;
+            t[1] = AES_SBOX[t[2]];
+            t[2] = AES_SBOX[t[3]];
+            t[3] = AES_SBOX[first];
+            rcon = AesDouble(rcon);
+        }
+        for (int j = 0; j < 4; j++) {
+            m_roundKeys[i + j] = m_roundKeys[i - 16 + j] ^ t[j];
+        }
+    }
+    std::memcpy(m_salt, salt, 4);
+    uint8_t zero[16] = {};
+    EncryptBlock(zero, m_h);
+}
+
+void AesGmac::EncryptBlock(const uint8_t in[16], uint8_t out[16]) const {
+#ifdef VPN2_X86
+    if (CpuFeatures::Get().aes) {
+        AesEncryptAesNi(m_roundKeys, in, out);
+        return;
+    }
+#endif
+    AesEncryptScalar(m_roundKeys, in, out);
+}
+
+void AesGmac::GhashBlocks(uint8_t x[16], const uint8_t *data, size_t blocks) const {
+#ifdef VPN2_X86
+    if (CpuFeatures::Get().pclmul) {
+        GhashBlocksClmul(x, m_h, data, blocks);
+        return;
+    }
+#endif
+    for (; blocks > 0; blocks--, data += 16) {
+        for (int i = 0; i < 16; i++) {
+            x[i] ^= data[i];
+        }
+        GhashMultiplyScalar(x, m_h);
+    }
+}
+
+void AesGmac::Compute(const uint8_t *first, uint32_t firstSize, const uint8_t *second, uint32_t secondSize,
+                      uint64_t iv, uint8_t tag[16]) const {
+    uint8_t x[16] = {};
+    uint8_t block[16];
+    uint32_t buffered = 0;
+    for (auto part : {std::make_pair(first, firstSize), std::make_pair(second, secondSize)}) {
+        const uint8_t *data = part.first;
+        uint32_t size = part.second;
+        if (buffered > 0) {
+            uint32_t take = std::min(size, 16 - buffered);
+            std::memcpy(block + buffered, data, take);
+            buffered += take;
+            data += take;
+            size -= take;
+            if (buffered < 16) {
+                continue;
+            }
+            GhashBlocks(x, block, 1);
+            buffered = 0;
+        }
+        GhashBlocks(x, data, size / 16);
+        buffered = size % 16;
+        std::memcpy(block, data + size - buffered, buffered);
+    }
+    if (buffered > 0) {
+        std::memset(block + buffered, 0, 16 - buffered);
+        GhashBlocks(x, block, 1);
+    }
+
+    //Length block: bits of authenticated data, then bits of ciphertext (none)
+    uint64_t bits = (uint64_t(firstSize) + secondSize) * 8;
+    uint8_t lengths[16] = {};
+    for (int i = 0; i < 8; i++) {
+        lengths[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+    }
+    GhashBlocks(x, lengths, 1);
+
+    uint8_t counter[16] = {};
+    std::memcpy(counter, m_salt, 4);
+    for (int i = 0; i < 8; i++) {
+        counter[4 + i] = static_cast<uint8_t>(iv >> (56 - 8 * i));
+    }
+    counter[15] = 1;
+    uint8_t mask[16];
+    EncryptBlock(counter, mask);
+    for (int i = 0; i < 16; i++) {
+        tag[i] = x[i] ^ mask[i];
+    }
+}
+
+enum IpsecMode { IPSEC_ESP, IPSEC_ESP_NULL, IPSEC_AH };
+enum IntegrityAlgorithm { INTEGRITY_FNV, INTEGRITY_HMAC_SHA256, INTEGRITY_GMAC };
+
+static const char *IpsecModeName(IpsecMode mode) {
+    return mode == IPSEC_AH ? "ah" : mode == IPSEC_ESP_NULL ? "esp-null" : "esp";
+}
+
+static const char *IntegrityName(IntegrityAlgorithm integrity) {
+    return integrity == INTEGRITY_GMAC ? "gmac" : integrity == INTEGRITY_HMAC_SHA256 ? "hmac-sha256" : "fnv";
+}
+
+static uint32_t IcvSize(IntegrityAlgorithm integrity) {
+    return integrity == INTEGRITY_FNV ? ESP_ICV_SIZE : MAX_ICV_SIZE;
+}
+
+//Outer IPv4 + UDP + ESP (8 bytes) or AH (12 bytes) header + ICV
+static uint16_t TunnelOverhead(IpsecMode mode, IntegrityAlgorithm integrity) {
+    return 20 + 8 + (mode == IPSEC_AH ? 12 : 8) + IcvSize(integrity);
+}
+
+//Computes and checks the ICVs of one SA. The MAC keys are derived from the SA key
+class Authenticator : public SimpleRefCount<Authenticator> {
+    public:
+        Authenticator(IntegrityAlgorithm algorithm, u_int16_t key);
+
+        uint32_t GetIcvSize(void) const;
+        //The ICV covers first followed by second; GMAC takes the sequence number as its IV
+        void Compute(const uint8_t *first, uint32_t firstSize, const uint8_t *second, uint32_t secondSize,
+                     uint32_t sequence, uint8_t *icv) const;
+        bool Verify(const uint8_t *first, uint32_t firstSize, const uint8_t *second, uint32_t secondSize,
+                    uint32_t sequence, const uint8_t *icv) const;
+    private:
+        static std::array<uint8_t, 32> DeriveKeys(u_int16_t key);
+
+        IntegrityAlgorithm m_algorithm;
+        u_int16_t m_key;
+        std::array<uint8_t, 32> m_keys;
+        HmacSha256 m_hmac;
+        AesGmac m_gmac;
+};
+
+Authenticator::Authenticator(IntegrityAlgorithm algorithm, u_int16_t key)
+    : m_algorithm(algorithm), m_key(key), m_keys(DeriveKeys(key)),
+      m_hmac(m_keys.data(), m_keys.size()), m_gmac(m_keys.data(), m_keys.data() + 16) {}
+
+std::array<uint8_t, 32> Authenticator::DeriveKeys(u_int16_t key) {
+    static const char label[] = "vpn2 integrity";
+    uint8_t keyBytes[2] = {static_cast<uint8_t>(key >> 8), static_cast<uint8_t>(key)};
+    Sha256 hash;
+    hash.Update(reinterpret_cast<const uint8_t *>(label), sizeof(label) - 1);
+    hash.Update(keyBytes, sizeof(keyBytes));
+    std::array<uint8_t, 32> keys;
+    hash.Final(keys.data());
+    return keys;
+}
+
+uint32_t Authenticator::GetIcvSize(void) const {
+    return IcvSize(m_algorithm);
+}
+
+void Authenticator::Compute(const uint8_t *first, uint32_t firstSize, const uint8_t *second, uint32_t secondSize,
+                            uint32_t sequence, uint8_t *icv) const {
+    if (m_algorithm == INTEGRITY_HMAC_SHA256) {
+        uint8_t mac[32];
+        m_hmac.Compute(first, firstSize, second, secondSize, mac);
+        std::memcpy(icv, mac, MAX_ICV_SIZE);
+    } else if (m_algorithm == INTEGRITY_GMAC) {
+        m_gmac.Compute(first, firstSize, second, secondSize, sequence, icv);
+    } else {
+        IcvHasher hasher(m_key);
+        hasher.Update(first, firstSize);
+        hasher.Update(second, secondSize);
+        hasher.Final(icv);
+    }
+}
+
+//Compares every byte, so the time taken does not depend on where a forged ICV differs
+bool Authenticator::Verify(const uint8_t *first, uint32_t firstSize, const uint8_t *second, uint32_t secondSize,
+                           uint32_t sequence, const uint8_t *icv) const {
+    uint8_t expected[MAX_ICV_SIZE];
+    Compute(first, firstSize, second, secondSize, sequence, expected);
+    uint8_t difference = 0;
+    for (uint32_t i = 0; i < GetIcvSize(); i++) {
+        difference |= expected[i] ^ icv[i];
+    }
+    return difference == 0;
+}
+
+//The ESP trailer only carries the ICV (the cipher needs no padding)
+class EspTrailer : public Trailer {
+    public:
+        EspTrailer(uint32_t icvSize = ESP_ICV_SIZE);
+        virtual ~EspTrailer();
+
+        void SetIcv(const uint8_t *icv);
+
+        static TypeId GetTypeId (void);
+        virtual TypeId GetInstanceTypeId (void) const;
+        virtual void Print (std::ostream &os) const;
+        virtual uint32_t GetSerializedSize (void) const;
+        virtual void Serialize (Buffer::Iterator start) const;
+        virtual uint32_t Deserialize (Buffer::Iterator start);
+    private:
+        uint32_t icvSize;
+        uint8_t icv[MAX_ICV_SIZE] = {};
+};
+
+EspTrailer::EspTrailer(uint32_t icvSize) : icvSize(icvSize) {}
+EspTrailer::~EspTrailer() {}
+
+void EspTrailer::SetIcv(const uint8_t *icv) {
+    std::copy(icv, icv + icvSize, this->icv);
+}
+
+TypeId EspTrailer::GetTypeId (void) {
+        static TypeId tid = TypeId ("ns3::EspTrailer")
+        .SetParent<Trailer> ()
+        .AddConstructor<EspTrailer> ()
+        ;
+        return tid;
+}
+
+TypeId EspTrailer::GetInstanceTypeId (void) const {
+    return GetTypeId();
+}
+
+void EspTrailer::Print (std::ostream &os) const {
+    os << "ICV";
+}
+
+uint32_t EspTrailer::GetSerializedSize (void) const {
+    return icvSize;
+}
+
+//Trailers are handed an iterator positioned at the end of the packet
+void EspTrailer::Serialize (Buffer::Iterator start) const {
+    start.Prev(icvSize);
+    start.Write(icv, icvSize);
+}
+
+uint32_t EspTrailer::Deserialize (Buffer::Iterator start) {
+    start.Prev(icvSize);
+    start.Read(icv, icvSize);
+    return icvSize;
+}
+
+//The Encrypt header is the ESP header (SPI and sequence number) that sits in front
+//of the ciphertext of the inner packet
 class Encrypt : public Header {
     public:
-        Encrypt();
-        virtual ~Encrypt();
+        Encrypt();
+        virtual ~Encrypt();
+
+        Ptr<Packet> EncryptData(Ptr<const Packet> data, const Authenticator &authenticator);
+        void SetKey(u_int16_t key);
+        //ESP-NULL: the inner packet is only authenticated, not encrypted
+        void SetNullCipher(bool nullCipher);
+        void SetSpi(uint32_t spi);
+        uint32_t GetSpi(void) const;
+        void SetSequence(uint32_t sequence);
+        uint32_t GetSequence(void) const;
+
+        static TypeId GetTypeId (void);
+        virtual TypeId GetInstanceTypeId (void) const;
+        virtual void Print (std::ostream &os) const;
+        virtual uint32_t GetSerializedSize (void) const;
+        virtual void Serialize (Buffer::Iterator start) const;
+        virtual uint32_t Deserialize (Buffer::Iterator start);
+    private:
+        u_int16_t key = 123;
+        uint32_t spi = 0;
+        uint32_t sequence = 0;
+        bool nullCipher = false;
+
+};
+
+//Constructor and destructor
+Encrypt::Encrypt() {}
+Encrypt::~Encrypt() {}
+
+TypeId Encrypt::GetTypeId (void) {
+        static TypeId tid = TypeId ("ns3::Encrypt")
+        .SetParent<Header> ()
+        .AddConstructor<Encrypt> ()
+        ;
+        return tid;
+}
+
+TypeId Encrypt::GetInstanceTypeId (void) const {
+    return GetTypeId();
+}
+
+void Encrypt::Print (std::ostream &os) const {
+    os << "ESP spi=" << spi << " seq=" << sequence;
+}
+
+uint32_t Encrypt::GetSerializedSize (void) const {
+    return 8;
+}
+
+void Encrypt::Serialize (Buffer::Iterator start) const {
+    start.WriteHtonU32(spi);
+    start.WriteHtonU32(sequence);
+}
+
+uint32_t Encrypt::Deserialize (Buffer::Iterator start) {
+    spi = start.ReadNtohU32();
+    sequence = start.ReadNtohU32();
+    return GetSerializedSize();
+}
+
+void Encrypt::SetKey(u_int16_t key) {
+    this->key = key;
+}
+
+void Encrypt::SetSpi(uint32_t spi) {
+    this->spi = spi;
+}
+
+void Encrypt::SetNullCipher(bool nullCipher) {
+    this->nullCipher = nullCipher;
+}
+
+uint32_t Encrypt::GetSpi(void) const {
+    return spi;
+}
+
+void Encrypt::SetSequence(uint32_t sequence) {
+    this->sequence = sequence;
+}
+
+uint32_t Encrypt::GetSequence(void) const {
+    return sequence;
+}
+
+//Returns a new packet holding this header, the ciphertext of data and the ICV over both
+Ptr<Packet> Encrypt::EncryptData(Ptr<const Packet> data, const Authenticator &authenticator) {
+    std::vector<uint8_t> securePayload(data->GetSize());
+    data->CopyData(securePayload.data(), securePayload.size());
+    if (!nullCipher) {
+        ApplyKeystream(securePayload.data(), securePayload.size(), key, true);
+    }
+
+    uint8_t header[8];
+    WriteBigEndian32(header, spi);
+    WriteBigEndian32(header + 4, sequence);
+    uint8_t icv[MAX_ICV_SIZE];
+    authenticator.Compute(header, sizeof(header), securePayload.data(), securePayload.size(), sequence, icv);
+
+    EspTrailer trailer(authenticator.GetIcvSize());
+    trailer.SetIcv(icv);
+    Ptr<Packet> packet = Create<Packet>(securePayload.data(), securePayload.size());
+    packet->AddHeader(*this);
+    packet->AddTrailer(trailer);
+    return packet;
+}
+
+//The AH header: next header (IPv4 for the tunnelled packet), length, SPI, sequence
+//number and the ICV, in front of the inner packet in the clear. The ICV covers the
+//header with the ICV field zeroed and the inner packet; the outer IPv4 header is
+//written by the UDP socket later and is left out
+class AuthenticationHeader : public Header {
+    public:
+        AuthenticationHeader();
+        virtual ~AuthenticationHeader();
+
+        Ptr<Packet> AuthenticateData(Ptr<const Packet> data, const Authenticator &authenticator);
+        void SetSpi(uint32_t spi);
+        void SetSequence(uint32_t sequence);
+
+        static TypeId GetTypeId (void);
+        virtual TypeId GetInstanceTypeId (void) const;
+        virtual void Print (std::ostream &os) const;
+        virtual uint32_t GetSerializedSize (void) const;
+        virtual void Serialize (Buffer::Iterator start) const;
+        virtual uint32_t Deserialize (Buffer::Iterator start);
+
+        static constexpr uint32_t FIXED_SIZE = 12;
+    private:
+        void WriteFixedPart(uint8_t out[FIXED_SIZE]) const;
+
+        uint32_t m_spi = 0;
+        uint32_t m_sequence = 0;
+        uint32_t m_icvSize = ESP_ICV_SIZE;
+        uint8_t m_icv[MAX_ICV_SIZE] = {};
+};
+
+AuthenticationHeader::AuthenticationHeader() {}
+AuthenticationHeader::~AuthenticationHeader() {}
+
+TypeId AuthenticationHeader::GetTypeId (void) {
+        static TypeId tid = TypeId ("ns3::AuthenticationHeader")
+        .SetParent<Header> ()
+        .AddConstructor<AuthenticationHeader> ()
+        ;
+        return tid;
+}
+
+TypeId AuthenticationHeader::GetInstanceTypeId (void) const {
+    return GetTypeId();
+}
+
+void AuthenticationHeader::Print (std::ostream &os) const {
+    os << "AH spi=" << m_spi << " seq=" << m_sequence;
+}
+
+uint32_t AuthenticationHeader::GetSerializedSize (void) const {
+    return FIXED_SIZE + m_icvSize;
+}
+
+//The length field counts 32-bit words minus two
+void AuthenticationHeader::WriteFixedPart(uint8_t out[FIXED_SIZE]) const {
+    out[0] = 4;
+    out[1] = static_cast<uint8_t>(GetSerializedSize() / 4 - 2);
+    out[2] = 0;
+    out[3] = 0;
+    WriteBigEndian32(out + 4, m_spi);
+    WriteBigEndian32(out + 8, m_sequence);
+}
+
+void AuthenticationHeader::Serialize (Buffer::Iterator start) const {
+    uint8_t fixed[FIXED_SIZE];
+    WriteFixedPart(fixed);
+    start.Write(fixed, FIXED_SIZE);
+    start.Write(m_icv, m_icvSize);
+}
+
+uint32_t AuthenticationHeader::Deserialize (Buffer::Iterator start) {
+    start.ReadU8();
+    uint32_t words = start.ReadU8() + 2;
+    start.ReadU16();
+    m_spi = start.ReadNtohU32();
+    m_sequence = start.ReadNtohU32();
+    m_icvSize = std::min(words * 4 - FIXED_SIZE, MAX_ICV_SIZE);
+    start.Read(m_icv, m_icvSize);
+    return GetSerializedSize();
+}
+
+void AuthenticationHeader::SetSpi(uint32_t spi) {
+    m_spi = spi;
+}
+
+void AuthenticationHeader::SetSequence(uint32_t sequence) {
+    m_sequence = sequence;
+}
+
+Ptr<Packet> AuthenticationHeader::AuthenticateData(Ptr<const Packet> data, const Authenticator &authenticator) {
+    m_icvSize = authenticator.GetIcvSize();
+    uint8_t header[FIXED_SIZE + MAX_ICV_SIZE] = {};
+    WriteFixedPart(header);
+
+    Ptr<Packet> packet = data->Copy();
+    std::vector<uint8_t> payload(packet->GetSize());
+    packet->CopyData(payload.data(), payload.size());
+    authenticator.Compute(header, FIXED_SIZE + m_icvSize, payload.data(), payload.size(), m_sequence, m_icv);
+    packet->AddHeader(*this);
+    return packet;
+}
+
+/*
+ * Decrypt works on the raw bytes of a received ESP or AH packet (header, ciphertext,
+ * ICV) in a buffer owned by the caller. CheckIntegrity only reads the buffer (AH zeroes
+ * the ICV field in it), so the gateway can reject corrupted packets before paying for
+ * decryption or allocating the inner packet.
+ */
+class Decrypt {
+    public:
+        Decrypt();
+        virtual ~Decrypt();
+        bool MatchesSa(const uint8_t *securePayload, uint32_t size) const;
+        bool CheckIntegrity(uint8_t *securePayload, uint32_t size) const;
+        Ptr<Packet> DecryptData (uint8_t *securePayload, uint32_t size) const;
+        void SetKey(u_int16_t key);
+        void SetSpi(uint32_t spi);
+        void SetMode(IpsecMode mode, IntegrityAlgorithm integrity);
+    private:
+        uint32_t HeaderSize(void) const;
+
+        u_int16_t key = 123;
+        uint32_t spi = 0;
+        IpsecMode mode = IPSEC_ESP;
+        IntegrityAlgorithm integrity = INTEGRITY_FNV;
+        Ptr<Authenticator> authenticator;
+};
+
+//Constructor and destructor
+Decrypt::Decrypt() : authenticator(Create<Authenticator>(integrity, key)) {}
+Decrypt::~Decrypt() {}
+
+void Decrypt::SetKey(u_int16_t key) {
+    this->key = key;
+    authenticator = Create<Authenticator>(integrity, key);
+}
+
+void Decrypt::SetSpi(uint32_t spi) {
+    this->spi = spi;
+}
+
+void Decrypt::SetMode(IpsecMode mode, IntegrityAlgorithm integrity) {
+    this->mode = mode;
+    this->integrity = integrity;
+    authenticator = Create<Authenticator>(integrity, key);
+}
+
+uint32_t Decrypt::HeaderSize(void) const {
+    return mode == IPSEC_AH ? AuthenticationHeader::FIXED_SIZE : 8;
+}
+
+//Whether the packet is long enough for the mode and belongs to the SA this Decrypt was set up for
+bool Decrypt::MatchesSa(const uint8_t *securePayload, uint32_t size) const {
+    uint32_t icvSize = authenticator->GetIcvSize();
+    if (size < HeaderSize() + icvSize) {
+        return false;
+    }
+    if (mode == IPSEC_AH) {
+        return securePayload[1] == (HeaderSize() + icvSize) / 4 - 2 && ReadBigEndian32(securePayload + 4) == spi;
+    }
+    return ReadBigEndian32(securePayload) == spi;
+}
+
+bool Decrypt::CheckIntegrity(uint8_t *securePayload, uint32_t size) const {
+    uint32_t icvSize = authenticator->GetIcvSize();
+    if (mode == IPSEC_AH) {
+        //The sender computed the ICV with the ICV field zeroed
+        uint8_t icv[MAX_ICV_SIZE];
+        std::memcpy(icv, securePayload + HeaderSize(), icvSize);
+        std::memset(securePayload + HeaderSize(), 0, icvSize);
+        return authenticator->Verify(securePayload, size, 0, 0, ReadBigEndian32(securePayload + 8), icv);
+    }
+    return authenticator->Verify(securePayload, size - icvSize, 0, 0, ReadBigEndian32(securePayload + 4),
+                                 securePayload + size - icvSize);
+}
+
+//Decrypts in place and returns the inner packet; AH and ESP-NULL only strip the headers
+Ptr<Packet> Decrypt::DecryptData(uint8_t *securePayload, uint32_t size) const {
+    uint32_t icvSize = authenticator->GetIcvSize();
+    if (mode == IPSEC_AH) {
+        uint32_t offset = HeaderSize() + icvSize;
+        return Create<Packet>(securePayload + offset, size - offset);
+    }
+    uint8_t *data = securePayload + HeaderSize();
+    uint32_t dataSize = size - HeaderSize() - icvSize;
+    if (mode == IPSEC_ESP) {
+        ApplyKeystream(data, dataSize, key, false);
+    }
+    return Create<Packet>(data, dataSize);
+}
+
+/*
+ * Per-packet cost of every protection mode outside the simulation, so the modes can
+ * be compared on this machine: protecting builds the outgoing packet like the sending
+ * gateway, verifying copies it into a buffer and checks and unwraps it like the
+ * receiving one.
+ */
+static void BenchmarkProtection(std::ostream &os) {
+    const CpuFeatures &cpu = CpuFeatures::Get();
+    os << "SHA-NI " << (cpu.sha ? "yes" : "no") << ", AES-NI " << (cpu.aes ? "yes" : "no")
+       << ", PCLMULQDQ " << (cpu.pclmul ? "yes" : "no") << std::endl;
+    os << "mode      integrity      size  protect ns  verify ns" << std::endl;
+
+    typedef std::pair<IpsecMode, IntegrityAlgorithm> Protection;
+    std::vector<Protection> protections = {
+        Protection(IPSEC_ESP, INTEGRITY_FNV), Protection(IPSEC_ESP, INTEGRITY_HMAC_SHA256),
+        Protection(IPSEC_ESP, INTEGRITY_GMAC), Protection(IPSEC_ESP_NULL, INTEGRITY_HMAC_SHA256),
+        Protection(IPSEC_ESP_NULL, INTEGRITY_GMAC), Protection(IPSEC_AH, INTEGRITY_HMAC_SHA256),
+        Protection(IPSEC_AH, INTEGRITY_GMAC),
+    };
+    const uint32_t iterations = 20000;
+    std::vector<uint8_t> buffer(65536);
+    for (const Protection &protection : protections) {
+        Authenticator authenticator(protection.second, 123);
+        Decrypt decrypt;
+        decrypt.SetKey(123);
+        decrypt.SetSpi(0x1001);
+        decrypt.SetMode(protection.first, protection.second);
+        for (uint32_t size : {64, 512, 1400}) {
+            Ptr<Packet> inner = Create<Packet>(size);
+            double protectNs = 0, verifyNs = 0;
+            for (uint32_t i = 1; i <= iterations; i++) {
+                auto start = std::chrono::steady_clock::now();
+                Ptr<Packet> securePayload;
+                if (protection.first == IPSEC_AH) {
+                    AuthenticationHeader ah;
+                    ah.SetSpi(0x1001);
+                    ah.SetSequence(i);
+                    securePayload = ah.AuthenticateData(inner, authenticator);
+                } else {
+                    Encrypt esp;
+                    esp.SetSpi(0x1001);
+                    esp.SetSequence(i);
+                    esp.SetNullCipher(protection.first == IPSEC_ESP_NULL);
+                    securePayload = esp.EncryptData(inner, authenticator);
+                }
+                auto middle = std::chrono::steady_clock::now();
+                uint32_t secureSize = securePayload->CopyData(buffer.data(), buffer.size());
+                bool ok = decrypt.MatchesSa(buffer.data(), secureSize)
+                    && decrypt.CheckIntegrity(buffer.data(), secureSize)
+                    && decrypt.DecryptData(buffer.data(), secureSize)->GetSize() == size;
+                auto end = std::chrono::steady_clock::now();
+                NS_ABORT_MSG_IF(!ok, IpsecModeName(protection.first) << " with " << IntegrityName(protection.second)
+                                << " does not verify its own packets");
+                protectNs += std::chrono::duration<double, std::nano>(middle - start).count();
+                verifyNs += std::chrono::duration<double, std::nano>(end - middle).count();
+            }
+            os << std::left << std::setw(10) << IpsecModeName(protection.first)
+               << std::setw(13) << IntegrityName(protection.second) << std::right
+               << std::setw(6) << size << std::setw(12) << std::fixed << std::setprecision(0)
+               << protectNs / iterations << std::setw(11) << verifyNs / iterations << std::endl;
+            os.unsetf(std::ios::fixed);
+            os << std::setprecision(6);
+        }
+    }
+}
+
+/*
+ * Latency histograms. LatencyHistogram is an HDR histogram: values from 1 us to 134 s
+ * with two significant digits, in a fixed array of counts where every power of two gets
+ * 128 buckets. Recording is a few shifts and an increment, no sample is stored, and two
+ * histograms merge by adding their counts, across flows as well as across forked runs
+ * (the array travels back in the ReplicationResult, see SECTION 8).
+ */
+class LatencyHistogram {
+    public:
+        void Record(Time latency, uint64_t count = 1);
+        void Merge(const LatencyHistogram &other);
+        uint64_t GetCount(void) const;
+        //The highest value equivalent to the percentile's bucket, at most GetMax
+        Time GetPercentile(double percentile) const;
+        Time GetMax(void) const;
+        //p50/p99/p99.9/max on one line
+        void Print(std::ostream &os) const;
+    private:
+        static constexpr uint32_t HALF_MAGNITUDE = 7;
+        static constexpr uint32_t HALF_COUNT = 1u << HALF_MAGNITUDE;
+        static constexpr uint64_t SUB_BUCKET_MASK = 2 * HALF_COUNT - 1;
+        static constexpr uint32_t MAGNITUDE = 27;
+        static constexpr uint64_t HIGHEST = (uint64_t(1) << MAGNITUDE) - 1;
+        static constexpr uint32_t COUNTS = (MAGNITUDE - HALF_MAGNITUDE + 1) * HALF_COUNT;
+
+        static uint32_t IndexOf(uint64_t value);
+        static uint64_t HighestEquivalent(uint32_t index);
+
+        std::array<uint64_t, COUNTS> m_counts = {};
+        uint64_t m_total = 0;
+        uint64_t m_max = 0;
+};
+
+uint32_t LatencyHistogram::IndexOf(uint64_t value) {
+    value = std::min(value, HIGHEST);
+    uint32_t bucket = 64 - __builtin_clzll(value | SUB_BUCKET_MASK) - (HALF_MAGNITUDE + 1);
+    uint32_t subBucket = value >> bucket;
+    return ((bucket + 1) << HALF_MAGNITUDE) + subBucket - HALF_COUNT;
+}
+
+uint64_t LatencyHistogram::HighestEquivalent(uint32_t index) {
+    int32_t bucket = int32_t(index >> HALF_MAGNITUDE) - 1;
+    uint64_t subBucket = (index & (HALF_COUNT - 1)) + HALF_COUNT;
+    if (bucket < 0) {
+        subBucket -= HALF_COUNT;
+        bucket = 0;
+    }
+    return (subBucket << bucket) + (uint64_t(1) << bucket) - 1;
+}
+
+void LatencyHistogram::Record(Time latency, uint64_t count) {
+    uint64_t microseconds = std::max<int64_t>(latency.GetMicroSeconds(), 0);
+    m_counts[IndexOf(microseconds)] += count;
+    m_total += count;
+    m_max = std::max(m_max, std::min(microseconds, HIGHEST));
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram &other) {
+    for (uint32_t i = 0; i < COUNTS; i++) {
+        m_counts[i] += other.m_counts[i];
+    }
+    m_total += other.m_total;
+    m_max = std::max(m_max, other.m_max);
+}
+
+uint64_t LatencyHistogram::GetCount(void) const {
+    return m_total;
+}
+
+Time LatencyHistogram::GetPercentile(double percentile) const {
+    uint64_t rank = std::max<uint64_t>(1, std::ceil(percentile / 100 * m_total));
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < COUNTS; i++) {
+        seen += m_counts[i];
+        if (seen >= rank) {
+            return MicroSeconds(std::min(HighestEquivalent(i), m_max));
+        }
+    }
+    return GetMax();
+}
+
+Time LatencyHistogram::GetMax(void) const {
+    return MicroSeconds(m_max);
+}
+
+void LatencyHistogram::Print(std::ostream &os) const {
+    os << m_total << " samples";
+    if (m_total > 0) {
+        os << ", p50 " << GetPercentile(50).GetMicroSeconds() / 1e3 << " ms"
+           << ", p99 " << GetPercentile(99).GetMicroSeconds() / 1e3 << " ms"
+           << ", p99.9 " << GetPercentile(99.9).GetMicroSeconds() / 1e3 << " ms"
+           << ", max " << GetMax().GetMicroSeconds() / 1e3 << " ms";
+    }
+    os << std::endl;
+}
+
+/*
+ * SECTION 4:
+ * The gateways. r0 and r2 each get a VirtualNetDevice (following virtual-net-device.cc)
+ * that the remote LAN is routed through. Whatever IP hands to that device is encrypted
+ * with the outbound SA and sent to the other gateway over UDP; whatever arrives on the
+ * UDP socket is decrypted with the inbound SA and handed back to IP as if it had been
+ * received on the virtual device, from where it is forwarded into the LAN.
+ *
+ * Shaping against traffic analysis (ESP modes only, AH leaves the inner packet in the
+ * clear anyway). With padding buckets every inner packet is padded with zeros up to the
+ * next bucket before it is encrypted (TFC padding, RFC 4303 2.7), and the receiver cuts
+ * it back to the length in the inner IPv4 header. With a constant rate on top, the
+ * gateway queues what IP hands it and sends exactly one packet of the largest bucket
+ * per tick: the next queued one, or a dummy packet (chaff) when the queue is empty.
+ * Chaff decrypts to zeros, an IP version of 0, which the receiver drops after the
+ * integrity check like ESP drops next header 59.
+ *
+ * Security policies. Without any, everything IP routes into the tunnel is protected
+ * with the outbound SA. With a security policy database (SPD) every packet is matched
+ * against the policies in order, first match wins, by its inner 5-tuple; what matches
+ * no policy or a DISCARD policy is dropped (RFC 4301 4.4.1). With thousands of
+ * policies that search costs more than the protection itself, so a flow cache can sit
+ * in front of it: an exact-match table from the 5-tuple to the policy that decided it,
+ * leaving one cache lookup on the fast path for every flow past its first packet.
+ *
+ * With --gatewayTiming the gateways also report the wall-clock cost per packet of
+ * protecting, verifying and resolving the policy. That takes two clock reads around
+ * each of them, so it is off by default; --ipsecBench measures protection on its own.
+ */
+
+struct SecurityAssociation {
+    uint32_t spi;
+    u_int16_t key;
+    uint32_t sequence;
+};
+
+enum PolicyAction {POLICY_PROTECT, POLICY_DISCARD};
+
+//Ports only count for TCP and UDP, and only up to the first fragment
+struct SecurityPolicy {
+    Ipv4Address source;
+    Ipv4Mask sourceMask;
+    Ipv4Address destination;
+    Ipv4Mask destinationMask;
+    uint8_t protocol;           //0 for any
+    uint16_t portLow;           //destination ports
+    uint16_t portHigh;
+    PolicyAction action;
+};
+
+struct FlowKey {
+    uint32_t source;
+    uint32_t destination;
+    uint16_t sourcePort;
+    uint16_t destinationPort;
+    uint8_t protocol;
+};
+
+/*
+ * Four-way set associative: an entry takes 16 bytes, so a set is one cache line. A
+ * full set evicts with CLOCK, a hand per set going round the four ways. Entries go in
+ * without their referenced bit, so a flow only earns its second chance with a second
+ * packet and a scan of one-packet flows cannot push the busy ones out.
+ */
+class FlowCache {
+    public:
+        FlowCache(uint32_t entries);
+
+        bool Lookup(const FlowKey &key, uint16_t &policy);
+        void Insert(const FlowKey &key, uint16_t policy);
+        void Clear(void);
+        void PrintStats(std::ostream &os) const;
+    private:
+        static constexpr uint32_t WAYS = 4;
+        static constexpr uint8_t VALID = 1;
+        static constexpr uint8_t REFERENCED = 2;
+
+        struct Entry {
+            uint32_t source;
+            uint32_t destination;
+            uint16_t sourcePort;
+            uint16_t destinationPort;
+            uint8_t protocol;
+            uint8_t flags;
+            uint16_t policy;
+        };
+        struct alignas(64) Set {
+            Entry ways[WAYS];
+        };
+
+        uint32_t SetIndex(const FlowKey &key) const;
+
+        std::vector<Set> m_sets;
+        std::vector<uint8_t> m_hands;
+        uint64_t m_hits = 0;
+        uint64_t m_misses = 0;
+        uint64_t m_evictions = 0;
+};
+
+//Rounded up to a power of two sets
+FlowCache::FlowCache(uint32_t entries) {
+    uint32_t sets = 1;
+    while (sets * WAYS < entries) {
+        sets *= 2;
+    }
+    m_sets.resize(sets);
+    m_hands.resize(sets);
+    Clear();
+}
+
+void FlowCache::Clear(void) {
+    for (Set &set : m_sets) {
+        for (Entry &entry : set.ways) {
+            entry.flags = 0;
+        }
+    }
+}
+
+//The addresses and ports folded together, then the MurmurHash3 finalizer
+uint32_t FlowCache::SetIndex(const FlowKey &key) const {
+    uint64_t hash = uint64_t(key.source) << 32 | key.destination;
+    hash ^= (uint64_t(key.sourcePort) << 16 | key.destinationPort) * 0x9E3779B97F4A7C15ull + key.protocol;
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ull;
+    hash ^= hash >> 33;
+    return hash & (m_sets.size() - 1);
+}
+
+bool FlowCache::Lookup(const FlowKey &key, uint16_t &policy) {
+    for (Entry &entry : m_sets[SetIndex(key)].ways) {
+        if ((entry.flags & VALID) && entry.source == key.source && entry.destination == key.destination
+            && entry.sourcePort == key.sourcePort && entry.destinationPort == key.destinationPort
+            && entry.protocol == key.protocol) {
+            entry.flags |= REFERENCED;
+            policy = entry.policy;
+            m_hits++;
+            return true;
+        }
+    }
+    m_misses++;
+    return false;
+}
+
+//Into a free way if there is one, otherwise over the first one the hand finds unreferenced
+void FlowCache::Insert(const FlowKey &key, uint16_t policy) {
+    uint32_t index = SetIndex(key);
+    Set &set = m_sets[index];
+    Entry *victim = 0;
+    for (Entry &entry : set.ways) {
+        if (!(entry.flags & VALID)) {
+            victim = &entry;
+            break;
+        }
+    }
+    if (!victim) {
+        uint8_t &hand = m_hands[index];
+        while (set.ways[hand].flags & REFERENCED) {
+            set.ways[hand].flags &= ~REFERENCED;
+            hand = (hand + 1) % WAYS;
+        }
+        victim = &set.ways[hand];
+        hand = (hand + 1) % WAYS;
+        m_evictions++;
+    }
+    *victim = {key.source, key.destination, key.sourcePort, key.destinationPort, key.protocol, VALID, policy};
+}
+
+void FlowCache::PrintStats(std::ostream &os) const {
+    uint64_t lookups = m_hits + m_misses;
+    os << "flow cache of " << m_sets.size() * WAYS << " entries: " << m_hits << " hits";
+    if (lookups > 0) {
+        os << " (" << 100.0 * m_hits / lookups << "%)";
+    }
+    os << ", " << m_misses << " misses, " << m_evictions << " evictions";
+}
+
+class VpnGateway {
+    public:
+        VpnGateway(Ptr<Node> router, Ipv4Address peerAddress, Ipv4Address tunnelAddress,
+                   SecurityAssociation outbound, SecurityAssociation inbound, uint16_t tunnelMtu);
+
+        void AddRemoteNetwork(Ipv4Address network, Ipv4Mask mask, Ipv4Address peerTunnelAddress);
+        void SetProtection(IpsecMode mode, IntegrityAlgorithm integrity);
+        //Buckets are inner packet sizes; a zero chaffRate pads without fixing the rate.
+        //transitRate is only used to put the overhead in proportion
+        void SetShaping(std::vector<uint32_t> buckets, DataRate chaffRate, DataRate transitRate);
+        //Policies are matched in the order they are added
+        void AddPolicy(const SecurityPolicy &policy);
+        //Entries of the flow cache in front of the policies, 0 for none
+        void SetFlowCache(uint32_t entries);
+        //Time protection, verification and policy lookups on the wall clock, per packet
+        void SetTiming(bool timing);
+        uint64_t GetBytesEncrypted(void) const;
+        uint64_t GetBytesDecrypted(void) const;
+        uint64_t GetPacketsReceived(void) const;
+        uint64_t GetIcvFailures(void) const;
+        void PrintStats(std::ostream &os) const;
+    private:
+        bool VirtualSend(Ptr<Packet> packet, const Address &source, const Address &dest,
+                         uint16_t protocolNumber);
+        bool Protect(Ptr<Packet> packet);
+        void Pad(Ptr<Packet> packet, uint32_t size);
+        void SendShaped(void);
+        void SocketRecv(Ptr<Socket> socket);
+        uint16_t FindPolicy(Ptr<const Packet> packet);
+
+        //Packets queued for the next constant-rate tick
+        static constexpr uint32_t SHAPING_QUEUE = 1000;
+        static constexpr uint16_t NO_POLICY = UINT16_MAX;
+
+        Ptr<Node> m_router;
+        IpsecMode m_mode = IPSEC_ESP;
+        IntegrityAlgorithm m_integrity = INTEGRITY_FNV;
+        Ptr<Authenticator> m_authenticator;
+        Decrypt m_decrypt;
+        std::vector<uint8_t> m_rxBuffer;
+        Ptr<VirtualNetDevice> m_tap;
+        Ptr<Socket> m_socket;
+        uint32_t m_tapInterface;
+        Ipv4Address m_peerAddress;
+        SecurityAssociation m_outbound;
+        SecurityAssociation m_inbound;
+
+        uint64_t m_packetsEncrypted = 0;
+        uint64_t m_bytesEncrypted = 0;
+        uint64_t m_packetsReceived = 0;
+        uint64_t m_packetsDecrypted = 0;
+        uint64_t m_bytesDecrypted = 0;
+        uint64_t m_packetsDropped = 0;
+        uint64_t m_icvFailures = 0;
+        //Wall-clock time spent protecting and verifying, for the per-packet cost; two
+        //clock reads a packet, so only with SetTiming
+        bool m_timing = false;
+        double m_protectNanoseconds = 0;
+        double m_verifyNanoseconds = 0;
+        Time m_firstDecrypt;
+        Time m_lastDecrypt;
+
+        std::vector<uint32_t> m_buckets;
+        DataRate m_chaffRate;
+        DataRate m_transitRate;
+        Time m_tick;
+        std::deque<std::pair<Ptr<Packet>, Time> > m_shapingQueue;
+        LatencyHistogram m_shapingDelay;
+        uint64_t m_paddingBytes = 0;
+        uint64_t m_chaffPackets = 0;
+        uint64_t m_chaffBytes = 0;
+        uint64_t m_shapingDrops = 0;
+        uint64_t m_chaffReceived = 0;
+
+        std::vector<SecurityPolicy> m_policies;
+        std::unique_ptr<FlowCache> m_flowCache;
+        double m_policyNanoseconds = 0;
+        uint64_t m_policyLookups = 0;
+        uint64_t m_policyDrops = 0;
+};
+
+VpnGateway::VpnGateway(Ptr<Node> router, Ipv4Address peerAddress, Ipv4Address tunnelAddress,
+                       SecurityAssociation outbound, SecurityAssociation inbound, uint16_t tunnelMtu)
+    : m_router(router), m_rxBuffer(65536), m_peerAddress(peerAddress), m_outbound(outbound), m_inbound(inbound) {
+    m_authenticator = Create<Authenticator>(m_integrity, outbound.key);
+    m_decrypt.SetKey(inbound.key);
+    m_decrypt.SetSpi(inbound.spi);
+
+    m_socket = Socket::CreateSocket(router, TypeId::LookupByName("ns3::UdpSocketFactory"));
+    m_socket->Bind(InetSocketAddress(Ipv4Address::GetAny(), VPN_ESP_PORT));
+    m_socket->SetRecvCallback(MakeCallback(&VpnGateway::SocketRecv, this));
+
+    m_tap = CreateObject<VirtualNetDevice>();
+    m_tap->SetAddress(Mac48Address::Allocate());
+    m_tap->SetMtu(tunnelMtu);
+    m_tap->SetSendCallback(MakeCallback(&VpnGateway::VirtualSend, this));
+    router->AddDevice(m_tap);
+
+    Ptr<Ipv4> ipv4 = router->GetObject<Ipv4>();
+    m_tapInterface = ipv4->AddInterface(m_tap);
+    ipv4->AddAddress(m_tapInterface, Ipv4InterfaceAddress(tunnelAddress, Ipv4Mask("255.255.255.0")));
+    ipv4->SetUp(m_tapInterface);
+}
+
+//Static routes take priority over the global routes, so traffic for the remote
+//LAN goes into the tunnel instead of straight across r1
+void VpnGateway::AddRemoteNetwork(Ipv4Address network, Ipv4Mask mask, Ipv4Address peerTunnelAddress) {
+    Ipv4StaticRoutingHelper staticRouting;
+    Ptr<Ipv4StaticRouting> table = staticRouting.GetStaticRouting(m_router->GetObject<Ipv4>());
+    table->AddNetworkRouteTo(network, mask, peerTunnelAddress, m_tapInterface);
+}
+
+//Both gateways have to use the same protection, the SAs carry no algorithm
+void VpnGateway::SetProtection(IpsecMode mode, IntegrityAlgorithm integrity) {
+    m_mode = mode;
+    m_integrity = integrity;
+    m_authenticator = Create<Authenticator>(integrity, m_outbound.key);
+    m_decrypt.SetMode(mode, integrity);
+}
+
+void VpnGateway::SetShaping(std::vector<uint32_t> buckets, DataRate chaffRate, DataRate transitRate) {
+    NS_ABORT_MSG_IF(m_mode == IPSEC_AH, "AH cannot hide the size of the packets it carries");
+    NS_ABORT_MSG_IF(buckets.empty(), "Shaping needs at least one padding bucket");
+    std::sort(buckets.begin(), buckets.end());
+    m_buckets = buckets;
+    m_chaffRate = chaffRate;
+    m_transitRate = transitRate;
+    if (chaffRate.GetBitRate() > 0) {
+        m_tick = chaffRate.CalculateBytesTxTime(m_buckets.back());
+        Simulator::Schedule(m_tick, &VpnGateway::SendShaped, this);
+    }
+}
+
+void VpnGateway::AddPolicy(const SecurityPolicy &policy) {
+    NS_ABORT_MSG_IF(m_policies.size() == NO_POLICY, "Too many security policies");
+    m_policies.push_back(policy);
+    m_policies.back().source = policy.source.CombineMask(policy.sourceMask);
+    m_policies.back().destination = policy.destination.CombineMask(policy.destinationMask);
+    //The cached decisions may no longer be the first match
+    if (m_flowCache) {
+        m_flowCache->Clear();
+    }
+}
+
+void VpnGateway::SetFlowCache(uint32_t entries) {
+    m_flowCache.reset(entries > 0 ? new FlowCache(entries) : 0);
+}
+
+//The first policy matching the inner 5-tuple, from the flow cache where it has it
+uint16_t VpnGateway::FindPolicy(Ptr<const Packet> packet) {
+    uint8_t header[64];
+    uint32_t size = packet->CopyData(header, sizeof(header));
+    FlowKey key = {};
+    if (size >= 20) {
+        uint32_t headerLength = (header[0] & 0x0f) * 4;
+        bool firstFragment = ((header[6] & 0x1f) | header[7]) == 0;
+        key.protocol = header[9];
+        key.source = ReadBigEndian32(header + 12);
+        key.destination = ReadBigEndian32(header + 16);
+        if ((key.protocol == 6 || key.protocol == 17) && firstFragment && headerLength + 4 <= size) {
+            key.sourcePort = (header[headerLength] << 8) | header[headerLength + 1];
+            key.destinationPort = (header[headerLength + 2] << 8) | header[headerLength + 3];
+        }
+    }
+    uint16_t found = NO_POLICY;
+    if (m_flowCache && m_flowCache->Lookup(key, found)) {
+        return found;
+    }
+    for (uint32_t i = 0; i < m_policies.size(); i++) {
+        const SecurityPolicy &policy = m_policies[i];
+        if ((key.source & policy.sourceMask.Get()) == policy.source.Get()
+            && (key.destination & policy.destinationMask.Get()) == policy.destination.Get()
+            && (policy.protocol == 0 || policy.protocol == key.protocol)
+            && key.destinationPort >= policy.portLow && key.destinationPort <= policy.portHigh) {
+            found = i;
+            break;
+        }
+    }
+    if (m_flowCache) {
+        m_flowCache->Insert(key, found);
+    }
+    return found;
+}
+
+//Zeros up to size, encrypted along with the packet
+void VpnGateway::Pad(Ptr<Packet> packet, uint32_t size) {
+    if (packet->GetSize() < size) {
+        m_paddingBytes += size - packet->GetSize();
+        packet->AddPaddingAtEnd(size - packet->GetSize());
+    }
+}
+
+bool VpnGateway::VirtualSend(Ptr<Packet> packet, const Address &source, const Address &dest,
+                             uint16_t protocolNumber) {
+    if (!m_policies.empty()) {
+        std::chrono::steady_clock::time_point start;
+        if (m_timing) {
+            start = std::chrono::steady_clock::now();
+        }
+        uint16_t policy = FindPolicy(packet);
+        if (m_timing) {
+            m_policyNanoseconds += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        }
+        m_policyLookups++;
+        if (policy == NO_POLICY || m_policies[policy].action == POLICY_DISCARD) {
+            m_policyDrops++;
+            return false;
+        }
+    }
+    //A GSO super-packet arrives here whole, so it is protected in one go. Only what is
+    //protected counts as encrypted, at its size before padding; queued packets when
+    //they leave the shaping queue
+    if (!m_tick.IsZero()) {
+        if (m_shapingQueue.size() >= SHAPING_QUEUE) {
+            m_shapingDrops++;
+            return false;
+        }
+        m_shapingQueue.push_back(std::make_pair(packet, Simulator::Now()));
+        return true;
+    }
+    m_packetsEncrypted++;
+    m_bytesEncrypted += packet->GetSize();
+    if (!m_buckets.empty()) {
+        //Packets above the largest bucket (GSO super-packets) go as they are
+        auto bucket = std::lower_bound(m_buckets.begin(), m_buckets.end(), packet->GetSize());
+        if (bucket != m_buckets.end()) {
+            Pad(packet, *bucket);
+        }
+    }
+    return Protect(packet);
+}
+
+//One packet of the largest bucket per tick, whether there is anything to send or not
+void VpnGateway::SendShaped(void) {
+    Ptr<Packet> packet;
+    if (m_shapingQueue.empty()) {
+        packet = Create<Packet>(m_buckets.back());
+        m_chaffPackets++;
+        m_chaffBytes += packet->GetSize();
+    } else {
+        packet = m_shapingQueue.front().first;
+        m_shapingDelay.Record(Simulator::Now() - m_shapingQueue.front().second);
+        m_shapingQueue.pop_front();
+        m_packetsEncrypted++;
+        m_bytesEncrypted += packet->GetSize();
+        Pad(packet, m_buckets.back());
+    }
+    Protect(packet);
+    Simulator::Schedule(m_tick, &VpnGateway::SendShaped, this);
+}
+
+void VpnGateway::SetTiming(bool timing) {
+    m_timing = timing;
+}
+
+bool VpnGateway::Protect(Ptr<Packet> packet) {
+    std::chrono::steady_clock::time_point start;
+    if (m_timing) {
+        start = std::chrono::steady_clock::now();
+    }
+    Ptr<Packet> securePayload;
+    if (m_mode == IPSEC_AH) {
+        AuthenticationHeader ah;
+        ah.SetSpi(m_outbound.spi);
+        ah.SetSequence(++m_outbound.sequence);
+        securePayload = ah.AuthenticateData(packet, *m_authenticator);
+    } else {
+        Encrypt esp;
+        esp.SetKey(m_outbound.key);
+        esp.SetSpi(m_outbound.spi);
+        esp.SetSequence(++m_outbound.sequence);
+        esp.SetNullCipher(m_mode == IPSEC_ESP_NULL);
+        securePayload = esp.EncryptData(packet, *m_authenticator);
+    }
+    if (m_timing) {
+        m_protectNanoseconds += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    }
+    return m_socket->SendTo(securePayload, 0, InetSocketAddress(m_peerAddress, VPN_ESP_PORT)) >= 0;
+}
+
+void VpnGateway::SocketRecv(Ptr<Socket> socket) {
+    Ptr<Packet> packet;
+    while ((packet = socket->Recv())) {
+        //Everything up to the integrity check works in m_rxBuffer, so packets that
+        //fail it are dropped without any allocation
+        m_packetsReceived++;
+        uint32_t size = packet->GetSize();
+        if (size > m_rxBuffer.size()) {
+            m_packetsDropped++;
+            continue;
+        }
+        packet->CopyData(m_rxBuffer.data(), size);
+        if (!m_decrypt.MatchesSa(m_rxBuffer.data(), size)) {
+            m_packetsDropped++;
+            continue;
+        }
+        std::chrono::steady_clock::time_point start;
+        if (m_timing) {
+            start = std::chrono::steady_clock::now();
+        }
+        bool intact = m_decrypt.CheckIntegrity(m_rxBuffer.data(), size);
+        if (m_timing) {
+            m_verifyNanoseconds += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        }
+        if (!intact) {
+            m_icvFailures++;
+            continue;
+        }
+
+        Ptr<Packet> data = m_decrypt.DecryptData(m_rxBuffer.data(), size);
+        //Chaff is dropped here; padding is whatever follows the inner IPv4 packet
+        uint8_t inner[4];
+        if (data->CopyData(inner, sizeof(inner)) < sizeof(inner) || inner[0] >> 4 != 4) {
+            m_chaffReceived++;
+            continue;
+        }
+        uint32_t innerLength = (inner[2] << 8) | inner[3];
+        if (innerLength < data->GetSize()) {
+            data->RemoveAtEnd(data->GetSize() - innerLength);
+        }
+        if (m_packetsDecrypted == 0) {
+            m_firstDecrypt = Simulator::Now();
+        }
+        m_lastDecrypt = Simulator::Now();
+        m_packetsDecrypted++;
+        m_bytesDecrypted += data->GetSize();
+        m_tap->Receive(data, 0x0800, m_tap->GetAddress(), m_tap->GetAddress(), NetDevice::PACKET_HOST);
+    }
+}
+
+uint64_t VpnGateway::GetBytesEncrypted(void) const {
+    return m_bytesEncrypted;
+}
+
+uint64_t VpnGateway::GetBytesDecrypted(void) const {
+    return m_bytesDecrypted;
+}
+
+uint64_t VpnGateway::GetPacketsReceived(void) const {
+    return m_packetsReceived;
+}
+
+uint64_t VpnGateway::GetIcvFailures(void) const {
+    return m_icvFailures;
+}
+
+void VpnGateway::PrintStats(std::ostream &os) const {
+    os << "  encrypted " << m_packetsEncrypted << " packets (" << m_bytesEncrypted << " bytes)"
+       << ", decrypted " << m_packetsDecrypted << " packets (" << m_bytesDecrypted << " bytes)"
+       << ", dropped " << m_packetsDropped << std::endl;
+    os << "  ICV failures " << m_icvFailures;
+    if (m_packetsReceived > 0) {
+        os << " (" << 100.0 * m_icvFailures / m_packetsReceived << "% of received)";
+    }
+    if (m_lastDecrypt > m_firstDecrypt) {
+        os << ", goodput " << m_bytesDecrypted * 8 / (m_lastDecrypt - m_firstDecrypt).GetSeconds() / 1e6 << " Mbps";
+    }
+    os << std::endl;
+    os << "  " << IpsecModeName(m_mode) << " with " << IntegrityName(m_integrity);
+    if (m_timing && m_packetsEncrypted > 0) {
+        os << ": protect " << m_protectNanoseconds / m_packetsEncrypted << " ns/packet";
+    }
+    if (m_timing && m_packetsReceived > 0) {
+        os << ", verify " << m_verifyNanoseconds / m_packetsReceived << " ns/packet";
+    }
+    os << std::endl;
+    if (!m_policies.empty()) {
+        os << "  SPD of " << m_policies.size() << " policies: ";
+        if (m_timing && m_policyLookups > 0) {
+            os << m_policyNanoseconds / m_policyLookups << " ns/packet to resolve, ";
+        }
+        os << m_policyDrops << " packets discarded";
+        if (m_flowCache) {
+            os << ", ";
+            m_flowCache->PrintStats(os);
+        }
+        os << std::endl;
+    }
+    if (m_buckets.empty()) {
+        return;
+    }
+    //Chaff costs its tunnel overhead on the wire as well
+    double seconds = Simulator::Now().GetSeconds();
+    uint64_t extraBytes = m_paddingBytes + m_chaffBytes + m_chaffPackets * TunnelOverhead(m_mode, m_integrity);
+    double extraMbps = seconds > 0 ? extraBytes * 8 / seconds / 1e6 : 0;
+    os << "  shaping: " << m_paddingBytes << " padding bytes";
+    if (m_bytesEncrypted > 0) {
+        os << " (" << 100.0 * m_paddingBytes / m_bytesEncrypted << "% of the payload)";
+    }
+    os << ", " << m_chaffPackets << " chaff packets (" << m_chaffBytes << " bytes), "
+       << extraMbps << " Mbps extra = " << 100 * extraMbps * 1e6 / m_transitRate.GetBitRate()
+       << "% of the transit rate" << std::endl;
+    if (!m_tick.IsZero()) {
+        os << "  queueing delay at a constant " << m_chaffRate << ": ";
+        m_shapingDelay.Print(os);
+        os << "  " << m_shapingDrops << " dropped from the shaping queue, " << m_chaffReceived
+           << " chaff packets received" << std::endl;
+    }
+}
+
+/*
+ * SECTION 5:
+ * Segmentation offload on the transit links. Hosts in --gso mode hand r0 super-packets
+ * of up to --gsoSize bytes, which travel through IP routing and the gateway as a single
+ * packet. Only the point-to-point device cuts them into frames of at most WireMtu bytes,
+ * so the wire still sees one serialization delay per real frame. The device at the other
+ * end of the link coalesces the frames back into the super-packet (GRO) before handing it
+ * up, so r1 and r2 route and decrypt it once as well.
+ *
+ * Every frame carries SegmentOverhead bytes of padding standing in for the IP/UDP/ESP
+ * headers that a real segment would repeat, which keeps the wire timing honest.
+ */
+
+class GsoSegmentTag : public Tag {
+    public:
+        GsoSegmentTag();
+        GsoSegmentTag(uint32_t superId, uint16_t index, uint16_t count);
+
+        uint32_t GetSuperId(void) const;
+        uint16_t GetIndex(void) const;
+        uint16_t GetCount(void) const;
+
+        static TypeId GetTypeId (void);
+        virtual TypeId GetInstanceTypeId (void) const;
+        virtual uint32_t GetSerializedSize (void) const;
+        virtual void Serialize (TagBuffer i) const;
+        virtual void Deserialize (TagBuffer i);
+        virtual void Print (std::ostream &os) const;
+    private:
+        uint32_t superId = 0;
+        uint16_t index = 0;
+        uint16_t count = 0;
+};
+
+GsoSegmentTag::GsoSegmentTag() {}
+
+GsoSegmentTag::GsoSegmentTag(uint32_t superId, uint16_t index, uint16_t count)
+    : superId(superId), index(index), count(count) {}
+
+uint32_t GsoSegmentTag::GetSuperId(void) const {
+    return superId;
+}
+
+uint16_t GsoSegmentTag::GetIndex(void) const {
+    return index;
+}
+
+uint16_t GsoSegmentTag::GetCount(void) const {
+    return count;
+}
+
+TypeId GsoSegmentTag::GetTypeId (void) {
+        static TypeId tid = TypeId ("ns3::GsoSegmentTag")
+        .SetParent<Tag> ()
+        .AddConstructor<GsoSegmentTag> ()
+        ;
+        return tid;
+}
+
+TypeId GsoSegmentTag::GetInstanceTypeId (void) const {
+    return GetTypeId();
+}
+
+uint32_t GsoSegmentTag::GetSerializedSize (void) const {
+    return 8;
+}
+
+void GsoSegmentTag::Serialize (TagBuffer i) const {
+    i.WriteU32(superId);
+    i.WriteU16(index);
+    i.WriteU16(count);
+}
+
+void GsoSegmentTag::Deserialize (TagBuffer i) {
+    superId = i.ReadU32();
+    index = i.ReadU16();
+    count = i.ReadU16();
+}
+
+void GsoSegmentTag::Print (std::ostream &os) const {
+    os << "super=" << superId << " segment=" << index << "/" << count;
+}
+
+/*
+ * Packet trains. A CBR source in --trains mode sends one packet standing for Count
+ * back-to-back copies of itself, Spacing apart. While the train is alone on a transit
+ * link the device puts it on the wire as one frame padded to the length of the whole
+ * train, which costs one transmit and one receive event instead of Count of each. The
+ * device falls back to sending the copies one by one ("expanding" the train) when
+ *   - the copies would not be back-to-back on this link (Spacing longer than a frame),
+ *   - another flow used the link within the span of the train (contention),
+ *   - the queue has no room for every copy or the far end drops packets (loss), or
+ *   - ExpandTrains is set because a trace sink wants to see every packet.
+ * Expanding after an aggregated hop delays the copies by up to one train span.
+ */
+
+class PacketTrainTag : public Tag {
+    public:
+        PacketTrainTag();
+        PacketTrainTag(uint32_t flowId, uint16_t count, Time spacing);
+
+        uint32_t GetFlowId(void) const;
+        uint16_t GetCount(void) const;
+        Time GetSpacing(void) const;
+        void SetSpacing(Time spacing);
+        uint32_t GetPadding(void) const;
+        void SetPadding(uint32_t padding);
+
+        static TypeId GetTypeId (void);
+        virtual TypeId GetInstanceTypeId (void) const;
+        virtual uint32_t GetSerializedSize (void) const;
+        virtual void Serialize (TagBuffer i) const;
+        virtual void Deserialize (TagBuffer i);
+        virtual void Print (std::ostream &os) const;
+    private:
+        uint32_t flowId = 0;
+        uint16_t count = 1;
+        uint64_t spacing = 0;   //nanoseconds
+        uint32_t padding = 0;   //bytes added while the train is aggregated on a link
+};
+
+PacketTrainTag::PacketTrainTag() {}
+
+PacketTrainTag::PacketTrainTag(uint32_t flowId, uint16_t count, Time spacing)
+    : flowId(flowId), count(count), spacing(spacing.GetNanoSeconds()) {}
+
+uint32_t PacketTrainTag::GetFlowId(void) const {
+    return flowId;
+}
+
+uint16_t PacketTrainTag::GetCount(void) const {
+    return count;
+}
+
+Time PacketTrainTag::GetSpacing(void) const {
+    return NanoSeconds(spacing);
+}
+
+void PacketTrainTag::SetSpacing(Time spacing) {
+    this->spacing = spacing.GetNanoSeconds();
+}
+
+uint32_t PacketTrainTag::GetPadding(void) const {
+    return padding;
+}
+
+void PacketTrainTag::SetPadding(uint32_t padding) {
+    this->padding = padding;
+}
+
+TypeId PacketTrainTag::GetTypeId (void) {
+        static TypeId tid = TypeId ("ns3::PacketTrainTag")
+        .SetParent<Tag> ()
+        .AddConstructor<PacketTrainTag> ()
+        ;
+        return tid;
+}
+
+TypeId PacketTrainTag::GetInstanceTypeId (void) const {
+    return GetTypeId();
+}
+
+uint32_t PacketTrainTag::GetSerializedSize (void) const {
+    return 18;
+}
+
+void PacketTrainTag::Serialize (TagBuffer i) const {
+    i.WriteU32(flowId);
+    i.WriteU16(count);
+    i.WriteU64(spacing);
+    i.WriteU32(padding);
+}
+
+void PacketTrainTag::Deserialize (TagBuffer i) {
+    flowId = i.ReadU32();
+    count = i.ReadU16();
+    spacing = i.ReadU64();
+    padding = i.ReadU32();
+}
+
+void PacketTrainTag::Print (std::ostream &os) const {
+    os << "flow=" << flowId << " train=" << count << "x" << GetSpacing().As(Time::US);
+}
+
+/*
+ * Cross traffic on r1. The rest of the Internet is modelled as a fluid: an ON/OFF
+ * source that pours OnRate worth of bytes into the transit queue while it is ON. The
+ * fluid backlog is only brought up to date when a discrete packet arrives, so the
+ * background load costs no events at all. A VPN packet waits behind the fluid bytes
+ * in front of it and, while the buffer is overflowing, is dropped with the same
+ * probability as the fluid that overflows with it.
+ */
+
+class FluidCrossTraffic : public Object {
+    public:
+        FluidCrossTraffic();
+        virtual ~FluidCrossTraffic();
+
+        static TypeId GetTypeId (void);
+        void SetCapacity(DataRate capacity);
+        int64_t AssignStreams(int64_t stream);
+
+        //Accounts for a discrete packet of the given size arriving behind
+        //queuedBytes of discrete packets. Returns false if it is dropped, otherwise
+        //sets when it may enter the device queue
+        bool Admit(uint32_t size, uint32_t queuedBytes, Time &release);
+        void PrintStats(std::ostream &os) const;
+    private:
+        void Advance(Time now);
+
+        DataRate m_onRate;
+        Time m_meanOnTime;
+        Time m_meanOffTime;
+        uint32_t m_bufferSize;
+        double m_capacity = 0;            //bytes per second
+        Ptr<ExponentialRandomVariable> m_onOff;
+        Ptr<UniformRandomVariable> m_drop;
+
+        bool m_on = false;
+        Time m_nextSwitch;
+        Time m_lastUpdate;
+        Time m_lastRelease;
+        double m_backlog = 0;             //bytes
+
+        double m_bytesOffered = 0;
+        double m_bytesLost = 0;
+        uint64_t m_packetsDelayed = 0;
+        uint64_t m_packetsDropped = 0;
+        Time m_totalDelay;
+};
+
+FluidCrossTraffic::FluidCrossTraffic() {
+    m_onOff = CreateObject<ExponentialRandomVariable>();
+    m_drop = CreateObject<UniformRandomVariable>();
+}
+
+FluidCrossTraffic::~FluidCrossTraffic() {}
+
+TypeId FluidCrossTraffic::GetTypeId (void) {
+        static TypeId tid = TypeId ("ns3::FluidCrossTraffic")
+        .SetParent<Object> ()
+        .AddConstructor<FluidCrossTraffic> ()
+        .AddAttribute ("OnRate", "Rate of the background traffic while it is ON",
+                       DataRateValue (DataRate ("30Mbps")),
+                       MakeDataRateAccessor (&FluidCrossTraffic::m_onRate),
+                       MakeDataRateChecker ())
+        .AddAttribute ("MeanOnTime", "Mean length of an ON period",
+                       TimeValue (MilliSeconds (100)),
+                       MakeTimeAccessor (&FluidCrossTraffic::m_meanOnTime),
+                       MakeTimeChecker ())
+        .AddAttribute ("MeanOffTime", "Mean length of an OFF period",
+                       TimeValue (MilliSeconds (100)),
+                       MakeTimeAccessor (&FluidCrossTraffic::m_meanOffTime),
+                       MakeTimeChecker ())
+        .AddAttribute ("BufferSize", "Bytes the transit queue holds before it overflows",
+                       UintegerValue (150000),
+                       MakeUintegerAccessor (&FluidCrossTraffic::m_bufferSize),
+                       MakeUintegerChecker<uint32_t> ())
+        ;
+        return tid;
+}
+
+void FluidCrossTraffic::SetCapacity(DataRate capacity) {
+    m_capacity = capacity.GetBitRate() / 8.0;
+}
+
+int64_t FluidCrossTraffic::AssignStreams(int64_t stream) {
+    m_onOff->SetStream(stream);
+    m_drop->SetStream(stream + 1);
+    return 2;
+}
+
+//Integrates the fluid queue from the last update to now, one ON or OFF period at a time
+void FluidCrossTraffic::Advance(Time now) {
+    double onRate = m_onRate.GetBitRate() / 8.0;
+    while (m_lastUpdate < now) {
+        Time end = std::min(now, m_nextSwitch);
+        double dt = (end - m_lastUpdate).GetSeconds();
+        double inflow = m_on ? onRate * dt : 0;
+        m_bytesOffered += inflow;
+        m_backlog += inflow - m_capacity * dt;
+        if (m_backlog < 0) {
+            m_backlog = 0;
+        } else if (m_backlog > m_bufferSize) {
+            m_bytesLost += m_backlog - m_bufferSize;
+            m_backlog = m_bufferSize;
+        }
+        m_lastUpdate = end;
+
+        if (end == m_nextSwitch) {
+            m_on = !m_on;
+            Time mean = m_on ? m_meanOnTime : m_meanOffTime;
+            m_nextSwitch = end + Seconds(m_onOff->GetValue(mean.GetSeconds(), 0));
+        }
+    }
+}
+
+bool FluidCrossTraffic::Admit(uint32_t size, uint32_t queuedBytes, Time &release) {
+    Time now = Simulator::Now();
+    Advance(now);
+
+    double onRate = m_onRate.GetBitRate() / 8.0;
+    if (m_on && m_backlog >= m_bufferSize && onRate > m_capacity
+        && m_drop->GetValue() < 1 - m_capacity / onRate) {
+        m_packetsDropped++;
+        return false;
+    }
+
+    //The discrete packets already in the device queue are part of the backlog too,
+    //the device accounts for waiting behind those itself
+    double ahead = std::max(0.0, m_backlog - queuedBytes);
+    m_backlog = std::min<double>(m_backlog + size, m_bufferSize);
+
+    release = std::max(now + Seconds(ahead / m_capacity), m_lastRelease);
+    m_lastRelease = release;
+    if (release > now) {
+        m_packetsDelayed++;
+        m_totalDelay += release - now;
+    }
+    return true;
+}
+
+void FluidCrossTraffic::PrintStats(std::ostream &os) const {
+    os << "  cross traffic offered " << uint64_t(m_bytesOffered) << " bytes, lost " << uint64_t(m_bytesLost)
+       << "; VPN packets delayed " << m_packetsDelayed;
+    if (m_packetsDelayed > 0) {
+        os << " (mean " << NanoSeconds(m_totalDelay.GetNanoSeconds() / m_packetsDelayed).As(Time::MS) << ")";
+    }
+    os << ", dropped " << m_packetsDropped << std::endl;
+}
+
+/*
+ * Error models for the transit links, in addition to ns-3's RateErrorModel.
+ * GilbertElliottErrorModel produces bursts of errors: a two-state Markov chain that
+ * moves between a good and a bad state once per packet, with a loss probability for
+ * each state. TraceErrorModel replays a recorded pattern, one 0 (ok) or 1 (error) per
+ * packet, starting over when it runs out.
+ */
+
+class GilbertElliottErrorModel : public ErrorModel {
+    public:
+        GilbertElliottErrorModel();
+        virtual ~GilbertElliottErrorModel();
+
+        static TypeId GetTypeId (void);
+        int64_t AssignStreams(int64_t stream);
+    private:
+        virtual bool DoCorrupt(Ptr<Packet> packet);
+        virtual void DoReset(void);
+
+        double m_goodToBad;
+        double m_badToGood;
+        double m_goodLoss;
+        double m_badLoss;
+        bool m_bad = false;
+        Ptr<UniformRandomVariable> m_random;
+};
+
+GilbertElliottErrorModel::GilbertElliottErrorModel() {
+    m_random = CreateObject<UniformRandomVariable>();
+}
+
+GilbertElliottErrorModel::~GilbertElliottErrorModel() {}
+
+TypeId GilbertElliottErrorModel::GetTypeId (void) {
+        static TypeId tid = TypeId ("ns3::GilbertElliottErrorModel")
+        .SetParent<ErrorModel> ()
+        .AddConstructor<GilbertElliottErrorModel> ()
+        .AddAttribute ("GoodToBad", "Probability of moving from the good to the bad state per packet",
+                       DoubleValue (0.01),
+                       MakeDoubleAccessor (&GilbertElliottErrorModel::m_goodToBad),
+                       MakeDoubleChecker<double> (0, 1))
+        .AddAttribute ("BadToGood", "Probability of moving from the bad to the good state per packet",
+                       DoubleValue (0.3),
+                       MakeDoubleAccessor (&GilbertElliottErrorModel::m_badToGood),
+                       MakeDoubleChecker<double> (0, 1))
+        .AddAttribute ("GoodLoss", "Error probability in the good state",
+                       DoubleValue (0),
+                       MakeDoubleAccessor (&GilbertElliottErrorModel::m_goodLoss),
+                       MakeDoubleChecker<double> (0, 1))
+        .AddAttribute ("BadLoss", "Error probability in the bad state",
+                       DoubleValue (0.5),
+                       MakeDoubleAccessor (&GilbertElliottErrorModel::m_badLoss),
+                       MakeDoubleChecker<double> (0, 1))
+        ;
+        return tid;
+}
+
+int64_t GilbertElliottErrorModel::AssignStreams(int64_t stream) {
+    m_random->SetStream(stream);
+    return 1;
+}
+
+bool GilbertElliottErrorModel::DoCorrupt(Ptr<Packet> packet) {
+    m_bad = m_random->GetValue() < (m_bad ? 1 - m_badToGood : m_goodToBad);
+    return m_random->GetValue() < (m_bad ? m_badLoss : m_goodLoss);
+}
+
+void GilbertElliottErrorModel::DoReset(void) {
+    m_bad = false;
+}
+
+class TraceErrorModel : public ErrorModel {
+    public:
+        TraceErrorModel();
+        virtual ~TraceErrorModel();
+
+        static TypeId GetTypeId (void);
+        void LoadTrace(const std::string &fileName);
+    private:
+        virtual bool DoCorrupt(Ptr<Packet> packet);
+        virtual void DoReset(void);
+
+        std::vector<bool> m_pattern;
+        std::size_t m_next = 0;
+};
+
+TraceErrorModel::TraceErrorModel() {}
+TraceErrorModel::~TraceErrorModel() {}
+
+TypeId TraceErrorModel::GetTypeId (void) {
+        static TypeId tid = TypeId ("ns3::TraceErrorModel")
+        .SetParent<ErrorModel> ()
+        .AddConstructor<TraceErrorModel> ()
+        ;
+        return tid;
+}
+
+//The file holds whitespace separated 0s and 1s, anything after a # on a line is ignored
+void TraceErrorModel::LoadTrace(const std::string &fileName) {
+    std::ifstream file(fileName);
+    NS_ABORT_MSG_IF(!file, "Cannot open error trace " << fileName);
+    m_pattern.clear();
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream entries(line.substr(0, line.find('#')));
+        int entry;
+        while (entries >> entry) {
+            m_pattern.push_back(entry != 0);
+        }
+    }
+    NS_ABORT_MSG_IF(m_pattern.empty(), "Error trace " << fileName << " has no entries");
+    m_next = 0;
+}
+
+bool TraceErrorModel::DoCorrupt(Ptr<Packet> packet) {
+    if (m_pattern.empty()) {
+        return false;
+    }
+    bool corrupt = m_pattern[m_next];
+    m_next = (m_next + 1) % m_pattern.size();
+    return corrupt;
+}
+
+void TraceErrorModel::DoReset(void) {
+    m_next = 0;
+}
+
+class OffloadPointToPointNetDevice : public PointToPointNetDevice {
+    public:
+        OffloadPointToPointNetDevice();
+        virtual ~OffloadPointToPointNetDevice();
+
+        static TypeId GetTypeId (void);
+        virtual bool Send (Ptr<Packet> packet, const Address &dest, uint16_t protocolNumber);
+        virtual void SetReceiveCallback (NetDevice::ReceiveCallback cb);
+
+        void SetCrossTraffic(Ptr<FluidCrossTraffic> crossTraffic);
+        //Frames the model picks are delivered with one payload byte flipped instead
+        //of being dropped like with the ReceiveErrorModel attribute
+        void SetCorruptionModel(Ptr<ErrorModel> corruptionModel);
+        int64_t AssignStreams(int64_t stream);
+        void PrintStats(std::ostream &os) const;
+    private:
+        Ptr<const Packet> Corrupt(Ptr<const Packet> packet);
+        bool SendThroughCrossTraffic(Ptr<Packet> packet, const Address &dest, uint16_t protocolNumber);
+        bool SendSegmented(Ptr<Packet> packet, const Address &dest, uint16_t protocolNumber);
+        bool SendTrain(Ptr<Packet> packet, const Address &dest, uint16_t protocolNumber,
+                       PacketTrainTag train);
+        bool ExpandTrain(Ptr<Packet> packet, const Address &dest, uint16_t protocolNumber,
+                         const PacketTrainTag &train);
+        bool NoteFlow(uint32_t flowId, Time window);
+        bool PeerIsLossy(void) const;
+        DataRate GetWireRate(void);
+        bool GroReceive(Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol,
+                        const Address &from);
+
+        uint32_t m_wireMtu;
+        uint32_t m_segmentOverhead;
+        bool m_expandTrains;
+        NetDevice::ReceiveCallback m_upperRx;
+        Ptr<FluidCrossTraffic> m_crossTraffic;
+        Ptr<ErrorModel> m_corruptionModel;
+        Ptr<UniformRandomVariable> m_corruptPosition;
+
+        DataRate m_wireRate;
+        bool m_wireRateKnown = false;
+        std::map<uint32_t, Time> m_flowLastSend;
+
+        uint32_t m_nextSuperId = 0;
+        Ptr<Packet> m_reassembly;
+        uint32_t m_reassemblyId = 0;
+        //Super-packet last counted as lost, so its remaining segments are not counted again
+        bool m_lostCounted = false;
+        uint32_t m_lostId = 0;
+        uint16_t m_reassemblyNext = 0;
+
+        uint64_t m_superPacketsSent = 0;
+        uint64_t m_superPacketsDropped = 0;
+        uint64_t m_segmentsSent = 0;
+        uint64_t m_superPacketsReceived = 0;
+        uint64_t m_superPacketsLost = 0;
+        uint64_t m_trainsAggregated = 0;
+        uint64_t m_trainsExpanded = 0;
+        uint64_t m_trainsReceived = 0;
+        uint64_t m_framesCorrupted = 0;
+        uint64_t m_framesDiscarded = 0;
+};
+
+//Registered up front, main sets the SegmentOverhead default before any device exists
+NS_OBJECT_ENSURE_REGISTERED (OffloadPointToPointNetDevice);
+
+OffloadPointToPointNetDevice::OffloadPointToPointNetDevice() {
+    m_corruptPosition = CreateObject<UniformRandomVariable>();
+}
+OffloadPointToPointNetDevice::~OffloadPointToPointNetDevice() {}
+
+TypeId OffloadPointToPointNetDevice::GetTypeId (void) {
+        static TypeId tid = TypeId ("ns3::OffloadPointToPointNetDevice")
+        .SetParent<PointToPointNetDevice> ()
+        .AddConstructor<OffloadPointToPointNetDevice> ()
+        .AddAttribute ("WireMtu",
+                       "Largest frame put on the wire, bigger packets are segmented",
+                       UintegerValue (1500),
+                       MakeUintegerAccessor (&OffloadPointToPointNetDevice::m_wireMtu),
+                       MakeUintegerChecker<uint32_t> (64))
+        .AddAttribute ("SegmentOverhead",
+                       "Header bytes every segment of a super-packet repeats on the wire",
+                       UintegerValue (VPN_TUNNEL_OVERHEAD),
+                       MakeUintegerAccessor (&OffloadPointToPointNetDevice::m_segmentOverhead),
+                       MakeUintegerChecker<uint32_t> ())
+        .AddAttribute ("ExpandTrains",
+                       "Always send packet trains as individual packets (set when tracing)",
+                       BooleanValue (false),
+                       MakeBooleanAccessor (&OffloadPointToPointNetDevice::m_expandTrains),
+                       MakeBooleanChecker ())
+        ;
+        return tid;
+}
+
+bool OffloadPointToPointNetDevice::Send (Ptr<Packet> packet, const Address &dest, uint16_t protocolNumber) {
+    PacketTrainTag train;
+    if (packet->PeekPacketTag(train) && train.GetCount() > 1) {
+        return SendTrain(packet, dest, protocolNumber, train);
+    }
+    NoteFlow(0, Seconds(0));
+    return SendThroughCrossTraffic(packet, dest, protocolNumber);
+}
+
+void OffloadPointToPointNetDevice::SetCrossTraffic(Ptr<FluidCrossTraffic> crossTraffic) {
+    m_crossTraffic = crossTraffic;
+    m_crossTraffic->SetCapacity(GetWireRate());
+}
+
+void OffloadPointToPointNetDevice::SetCorruptionModel(Ptr<ErrorModel> corruptionModel) {
+    m_corruptionModel = corruptionModel;
+}
+
+int64_t OffloadPointToPointNetDevice::AssignStreams(int64_t stream) {
+    m_corruptPosition->SetStream(stream);
+    return 1;
+}
+
+bool OffloadPointToPointNetDevice::SendThroughCrossTraffic (Ptr<Packet> packet, const Address &dest,
+                                                            uint16_t protocolNumber) {
+    if (!m_crossTraffic) {
+        return SendSegmented(packet, dest, protocolNumber);
+    }
+
+    Time release;
+    if (!m_crossTraffic->Admit(packet->GetSize(), GetQueue()->GetNBytes(), release)) {
+        return false;
+    }
+    if (release > Simulator::Now()) {
+        Simulator::Schedule(release - Simulator::Now(), &OffloadPointToPointNetDevice::SendSegmented, this,
+                            packet, dest, protocolNumber);
+        return true;
+    }
+    return SendSegmented(packet, dest, protocolNumber);
+}
+
+bool OffloadPointToPointNetDevice::SendSegmented (Ptr<Packet> packet, const Address &dest, uint16_t protocolNumber) {
+    uint32_t size = packet->GetSize();
+    if (size <= m_wireMtu) {
+        return PointToPointNetDevice::Send(packet, dest, protocolNumber);
+    }
+
+    uint32_t chunk = m_wireMtu - m_segmentOverhead;
+    uint16_t count = (size + chunk - 1) / chunk;
+
+    //All segments or none: a partial super-packet would still take the link but could
+    //never be reassembled
+    Ptr<Queue<Packet> > queue = GetQueue();
+    QueueSize limit = queue->GetMaxSize();
+    bool fits = limit.GetUnit() == QueueSizeUnit::BYTES
+        ? queue->GetNBytes() + size + count * (m_segmentOverhead + PPP_HEADER_SIZE) <= limit.GetValue()
+        : queue->GetNPackets() + count <= limit.GetValue();
+    if (!fits) {
+        m_superPacketsDropped++;
+        return false;
+    }
+
+    uint32_t superId = m_nextSuperId++;
+    m_superPacketsSent++;
+    //With room for all of them, a segment can only fail on a link that is down, like the rest
+    bool sent = true;
+    for (uint16_t i = 0; i < count; i++) {
+        uint32_t offset = i * chunk;
+        Ptr<Packet> segment = packet->CreateFragment(offset, std::min(chunk, size - offset));
+        segment->AddPaddingAtEnd(m_segmentOverhead);
+        segment->AddPacketTag(GsoSegmentTag(superId, i, count));
+        m_segmentsSent++;
+        sent = PointToPointNetDevice::Send(segment, dest, protocolNumber) && sent;
+    }
+    return sent;
+}
+
+bool OffloadPointToPointNetDevice::SendTrain (Ptr<Packet> packet, const Address &dest, uint16_t protocolNumber,
+                                              PacketTrainTag train) {
+    uint32_t size = packet->GetSize();
+    uint16_t count = train.GetCount();
+    Time frameTime = GetWireRate().CalculateBytesTxTime(size + PPP_HEADER_SIZE);
+    Time span = NanoSeconds(frameTime.GetNanoSeconds() * count);
+    bool contended = NoteFlow(train.GetFlowId(), span);
+
+    uint32_t padding = (count - 1) * (size + PPP_HEADER_SIZE);
+    Ptr<Queue<Packet> > queue = GetQueue();
+    QueueSize limit = queue->GetMaxSize();
+    bool fits = limit.GetUnit() == QueueSizeUnit::BYTES
+        ? queue->GetNBytes() + size + padding <= limit.GetValue()
+        : queue->GetNPackets() + count <= limit.GetValue();
+
+    //Fluid cross traffic counts as contention: it has to be able to slip in between the copies
+    contended = contended || m_crossTraffic;
+    if (m_expandTrains || train.GetSpacing() > frameTime || contended || !fits || PeerIsLossy()) {
+        return ExpandTrain(packet, dest, protocolNumber, train);
+    }
+
+    //From here on the copies leave this link one frame time apart
+    packet->RemovePacketTag(train);
+    train.SetSpacing(frameTime);
+    train.SetPadding(padding);
+    packet->AddPaddingAtEnd(padding);
+    packet->AddPacketTag(train);
+    m_trainsAggregated++;
+    return PointToPointNetDevice::Send(packet, dest, protocolNumber);
+}
+
+bool OffloadPointToPointNetDevice::ExpandTrain (Ptr<Packet> packet, const Address &dest, uint16_t protocolNumber,
+                                                const PacketTrainTag &train) {
+    PacketTrainTag removed;
+    packet->RemovePacketTag(removed);
+    m_trainsExpanded++;
+
+    int64_t spacing = train.GetSpacing().GetNanoSeconds();
+    for (uint16_t i = 1; i < train.GetCount(); i++) {
+        Simulator::Schedule(NanoSeconds(spacing * i), &OffloadPointToPointNetDevice::SendThroughCrossTraffic, this,
+                            packet->Copy(), dest, protocolNumber);
+    }
+    return SendThroughCrossTraffic(packet, dest, protocolNumber);
+}
+
+//Records that flowId is using the link now and returns whether any other flow
+//used it within the last window
+bool OffloadPointToPointNetDevice::NoteFlow (uint32_t flowId, Time window) {
+    Time now = Simulator::Now();
+    bool contended = false;
+    for (auto &flow : m_flowLastSend) {
+        if (flow.first != flowId && now - flow.second < window) {
+            contended = true;
+        }
+    }
+    m_flowLastSend[flowId] = now;
+    return contended;
+}
+
+bool OffloadPointToPointNetDevice::PeerIsLossy (void) const {
+    Ptr<Channel> channel = GetChannel();
+    for (std::size_t i = 0; i < channel->GetNDevices(); i++) {
+        Ptr<NetDevice> peer = channel->GetDevice(i);
+        if (peer == this) {
+            continue;
+        }
+        PointerValue errorModel;
+        peer->GetAttribute("ReceiveErrorModel", errorModel);
+        Ptr<OffloadPointToPointNetDevice> offloadPeer = DynamicCast<OffloadPointToPointNetDevice>(peer);
+        if (errorModel.Get<ErrorModel>() || (offloadPeer && offloadPeer->m_corruptionModel)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+DataRate OffloadPointToPointNetDevice::GetWireRate (void) {
+    if (!m_wireRateKnown) {
+        DataRateValue rate;
+        GetAttribute("DataRate", rate);
+        m_wireRate = rate.Get();
+        m_wireRateKnown = true;
+    }
+    return m_wireRate;
+}
+
+//Node::AddDevice installs its receive handler here; keep it and put the GRO step in front
+void OffloadPointToPointNetDevice::SetReceiveCallback (NetDevice::ReceiveCallback cb) {
+    m_upperRx = cb;
+    PointToPointNetDevice::SetReceiveCallback(MakeCallback(&OffloadPointToPointNetDevice::GroReceive, this));
+}
+
+//Flips one byte behind the outer IPv4 and UDP headers, so a tunnelled packet still
+//reaches the gateway and has to be caught by the ICV check. The padding that stands in
+//for the headers of a GSO segment is left alone. Returns 0 if there is nothing to flip
+Ptr<const Packet> OffloadPointToPointNetDevice::Corrupt(Ptr<const Packet> packet) {
+    static constexpr uint32_t OUTER_HEADERS = 20 + 8;
+    uint32_t begin = OUTER_HEADERS;
+    uint32_t end = packet->GetSize();
+    GsoSegmentTag segment;
+    if (packet->PeekPacketTag(segment)) {
+        begin = segment.GetIndex() == 0 ? OUTER_HEADERS : 0;
+        end = end > m_segmentOverhead ? end - m_segmentOverhead : 0;
+    }
+    if (end <= begin) {
+        return 0;
+    }
+
+    uint32_t offset = m_corruptPosition->GetInteger(begin, end - 1);
+    uint8_t byte;
+    Ptr<Packet> tail = packet->CreateFragment(offset, packet->GetSize() - offset);
+    tail->CopyData(&byte, 1);
+    tail->RemoveAtStart(1);
+    byte ^= 0xff;
+
+    //The head keeps the packet tags (GSO segment, train), AddAtEnd does not copy them
+    Ptr<Packet> corrupted = packet->CreateFragment(0, offset);
+    corrupted->AddAtEnd(Create<Packet>(&byte, 1));
+    corrupted->AddAtEnd(tail);
+    return corrupted;
+}
+
+bool OffloadPointToPointNetDevice::GroReceive(Ptr<NetDevice> device, Ptr<const Packet> packet,
+                                              uint16_t protocol, const Address &from) {
+    if (m_corruptionModel && m_corruptionModel->IsCorrupt(ConstCast<Packet>(packet))) {
+        packet = Corrupt(packet);
+        if (!packet) {
+            m_framesDiscarded++;
+            return true;
+        }
+        m_framesCorrupted++;
+    }
+
+    PacketTrainTag train;
+    if (packet->PeekPacketTag(train) && train.GetPadding() > 0) {
+        Ptr<Packet> aggregate = packet->Copy();
+        aggregate->RemovePacketTag(train);
+        aggregate->RemoveAtEnd(train.GetPadding());
+        train.SetPadding(0);
+        aggregate->AddPacketTag(train);
+        m_trainsReceived++;
+        return m_upperRx(device, aggregate, protocol, from);
+    }
+
+    GsoSegmentTag tag;
+    if (!packet->PeekPacketTag(tag)) {
+        return m_upperRx(device, packet, protocol, from);
+    }
+
+    Ptr<Packet> segment = packet->Copy();
+    segment->RemovePacketTag(tag);
+    segment->RemoveAtEnd(m_segmentOverhead);
+
+    //A point-to-point link does not reorder, so a gap means a segment was lost
+    //and the whole super-packet goes with it
+    if (tag.GetIndex() == 0) {
+        if (m_reassembly) {
+            m_superPacketsLost++;
+        }
+        m_reassembly = segment;
+        m_reassemblyId = tag.GetSuperId();
+    } else if (m_reassembly && m_reassemblyId == tag.GetSuperId() && tag.GetIndex() == m_reassemblyNext) {
+        m_reassembly->AddAtEnd(segment);
+    } else {
+        if (m_reassembly) {
+            m_superPacketsLost++;
+            m_lostCounted = true;
+            m_lostId = m_reassemblyId;
+            m_reassembly = 0;
+        }
+        //Also a super-packet whose first segment never arrived
+        if (!m_lostCounted || m_lostId != tag.GetSuperId()) {
+            m_superPacketsLost++;
+            m_lostCounted = true;
+            m_lostId = tag.GetSuperId();
+        }
+        return true;
+    }
+
+    m_reassemblyNext = tag.GetIndex() + 1;
+    if (m_reassemblyNext < tag.GetCount()) {
+        return true;
+    }
+
+    Ptr<Packet> superPacket = m_reassembly;
+    m_reassembly = 0;
+    m_superPacketsReceived++;
+    return m_upperRx(device, superPacket, protocol, from);
+}
+
+void OffloadPointToPointNetDevice::PrintStats(std::ostream &os) const {
+    os << "  super-packets sent " << m_superPacketsSent << " as " << m_segmentsSent << " segments"
+       << ", dropped at a full queue " << m_superPacketsDropped
+       << ", super-packets received " << m_superPacketsReceived << ", lost " << m_superPacketsLost << std::endl;
+    os << "  trains aggregated " << m_trainsAggregated << ", expanded " << m_trainsExpanded
+       << ", received aggregated " << m_trainsReceived << std::endl;
+    if (m_corruptionModel) {
+        os << "  frames corrupted " << m_framesCorrupted << ", discarded " << m_framesDiscarded << std::endl;
+    }
+    if (m_crossTraffic) {
+        m_crossTraffic->PrintStats(os);
+    }
+}
+
+//Builds one transit link the way PointToPointHelper::Install does, but with
+//OffloadPointToPointNetDevice on both ends
+static NetDeviceContainer InstallTransitLink(Ptr<Node> a, Ptr<Node> b, std::string dataRate,
+                                             Time delay, uint16_t mtu, QueueSize queueSize) {
+    //Between two ranks (see SECTION 16) the channel hands the frames to MPI, and the
+    //device at the other end gets them from its MpiReceiver
+    bool remote = a->GetSystemId() != b->GetSystemId();
+    Ptr<PointToPointChannel> channel;
+#ifdef NS3_MPI
+    if (remote) {
+        channel = CreateObject<PointToPointRemoteChannel>();
+    }
+#endif
+    NS_ABORT_MSG_IF(remote && !channel, "Transit link between two ranks without MPI");
+    if (!channel) {
+        channel = CreateObject<PointToPointChannel>();
+    }
+    channel->SetAttribute("Delay", TimeValue(delay));
+
+    NetDeviceContainer devices;
+    for (Ptr<Node> node : {a, b}) {
+        Ptr<OffloadPointToPointNetDevice> device = CreateObject<OffloadPointToPointNetDevice>();
+        device->SetAddress(Mac48Address::Allocate());
+        device->SetAttribute("DataRate", StringValue(dataRate));
+        device->SetMtu(mtu);
+        node->AddDevice(device);
+
+        Ptr<Queue<Packet> > queue = CreateObject<DropTailQueue<Packet> >();
+        queue->SetMaxSize(queueSize);
+        device->SetQueue(queue);
+        device->Attach(channel);
+#ifdef NS3_MPI
+        if (remote) {
+            Ptr<MpiReceiver> receiver = CreateObject<MpiReceiver>();
+            receiver->SetReceiveCallback(MakeCallback(&PointToPointNetDevice::Receive,
+                                                      Ptr<PointToPointNetDevice>(device)));
+            device->AggregateObject(receiver);
+        }
+#endif
+
+        Ptr<NetDeviceQueueInterface> queueInterface = CreateObject<NetDeviceQueueInterface>();
+        queueInterface->GetTxQueue(0)->ConnectQueueTraces(queue);
+        device->AggregateObject(queueInterface);
+        devices.Add(device);
+    }
+    return devices;
+}
+
+/*
+ * SECTION 6:
+ * Constant bit rate load across the transit links, sent from r0 to r2. In --trains
+ * mode TrainSource hands the stack one packet per TrainLength packets (see
+ * PacketTrainTag) and TrainSink counts every packet a train stands for. Every packet
+ * carries a SeqTsHeader, so TrainSink also records the one-way latency.
+ *
+ * Request/response load through the tunnel: RpcClients on the hosts of LAN #2 call an
+ * RpcServer on n0, with request and response sizes drawn from random variables, in
+ * closed loop with a fixed number of outstanding requests or in open loop.
+ */
+
+//Round trips of a request/response application with Tx and Rx traces, such as
+//UdpEchoClient. The replies are matched to the requests in order
+class RoundTripProbe {
+    public:
+        void Watch(Ptr<Application> client);
+        const LatencyHistogram &GetHistogram(void) const;
+    private:
+        void Tx(Ptr<const Packet> packet);
+        void Rx(Ptr<const Packet> packet);
+
+        std::deque<Time> m_sent;
+        LatencyHistogram m_histogram;
+};
+
+void RoundTripProbe::Watch(Ptr<Application> client) {
+    client->TraceConnectWithoutContext("Tx", MakeCallback(&RoundTripProbe::Tx, this));
+    client->TraceConnectWithoutContext("Rx", MakeCallback(&RoundTripProbe::Rx, this));
+}
+
+const LatencyHistogram &RoundTripProbe::GetHistogram(void) const {
+    return m_histogram;
+}
+
+void RoundTripProbe::Tx(Ptr<const Packet> packet) {
+    m_sent.push_back(Simulator::Now());
+}
+
+void RoundTripProbe::Rx(Ptr<const Packet> packet) {
+    if (!m_sent.empty()) {
+        m_histogram.Record(Simulator::Now() - m_sent.front());
+        m_sent.pop_front();
+    }
+}
+
+class TrainSource : public Application {
+    public:
+        TrainSource();
+        virtual ~TrainSource();
+
+        static TypeId GetTypeId (void);
+        uint64_t GetPacketsSent(void) const;
+    private:
+        virtual void StartApplication (void);
+        virtual void StopApplication (void);
+        void SendTrain(void);
+
+        Address m_peer;
+        uint32_t m_packetSize;
+        DataRate m_rate;
+        uint16_t m_trainLength;
+        uint32_t m_flowId;
+        Ptr<Socket> m_socket;
+        EventId m_sendEvent;
+        uint64_t m_packetsSent = 0;
+};
+
+TrainSource::TrainSource() {}
+TrainSource::~TrainSource() {}
+
+TypeId TrainSource::GetTypeId (void) {
+        static TypeId tid = TypeId ("ns3::TrainSource")
+        .SetParent<Application> ()
+        .AddConstructor<TrainSource> ()
+        .AddAttribute ("Remote", "Address the packets are sent to",
+                       AddressValue (),
+                       MakeAddressAccessor (&TrainSource::m_peer),
+                       MakeAddressChecker ())
+        .AddAttribute ("PacketSize", "Size of every packet in bytes, including the SeqTsHeader",
+                       UintegerValue (1024),
+                       MakeUintegerAccessor (&TrainSource::m_packetSize),
+                       MakeUintegerChecker<uint32_t> (12))
+        .AddAttribute ("DataRate", "Constant rate the packets are sent at",
+                       DataRateValue (DataRate ("10Mbps")),
+                       MakeDataRateAccessor (&TrainSource::m_rate),
+                       MakeDataRateChecker ())
+        .AddAttribute ("TrainLength", "Packets represented by every packet handed to the stack",
+                       UintegerValue (1),
+                       MakeUintegerAccessor (&TrainSource::m_trainLength),
+                       MakeUintegerChecker<uint16_t> (1))
+        .AddAttribute ("FlowId", "Identifies the flow to the transit devices",
+                       UintegerValue (1),
+                       MakeUintegerAccessor (&TrainSource::m_flowId),
+                       MakeUintegerChecker<uint32_t> (1))
+        ;
+        return tid;
+}
+
+uint64_t TrainSource::GetPacketsSent(void) const {
+    return m_packetsSent;
+}
+
+void TrainSource::StartApplication (void) {
+    m_socket = Socket::CreateSocket(GetNode(), TypeId::LookupByName("ns3::UdpSocketFactory"));
+    m_socket->Bind();
+    m_socket->Connect(m_peer);
+    SendTrain();
+}
+
+void TrainSource::StopApplication (void) {
+    Simulator::Cancel(m_sendEvent);
+    if (m_socket) {
+        m_socket->Close();
+    }
+}
+
+void TrainSource::SendTrain(void) {
+    Time spacing = m_rate.CalculateBytesTxTime(m_packetSize);
+    SeqTsHeader timestamp;
+    timestamp.SetSeq(m_packetsSent);
+    Ptr<Packet> packet = Create<Packet>(m_packetSize - timestamp.GetSerializedSize());
+    packet->AddHeader(timestamp);
+    if (m_trainLength > 1) {
+        packet->AddPacketTag(PacketTrainTag(m_flowId, m_trainLength, spacing));
+    }
+    m_socket->Send(packet);
+    m_packetsSent += m_trainLength;
+    m_sendEvent = Simulator::Schedule(NanoSeconds(spacing.GetNanoSeconds() * m_trainLength),
+                                      &TrainSource::SendTrain, this);
+}
+
+class TrainSink : public Application {
+    public:
+        TrainSink();
+        virtual ~TrainSink();
+
+        static TypeId GetTypeId (void);
+        uint64_t GetPacketsReceived(void) const;
+        uint64_t GetBytesReceived(void) const;
+        const LatencyHistogram &GetLatency(void) const;
+    private:
+        virtual void StartApplication (void);
+        virtual void StopApplication (void);
+        void HandleRead(Ptr<Socket> socket);
+
+        uint16_t m_port;
+        LatencyHistogram m_latency;
+        Ptr<Socket> m_socket;
+        uint64_t m_packetsReceived = 0;
+        uint64_t m_bytesReceived = 0;
+};
+
+TrainSink::TrainSink() {}
+TrainSink::~TrainSink() {}
+
+TypeId TrainSink::GetTypeId (void) {
+        static TypeId tid = TypeId ("ns3::TrainSink")
+        .SetParent<Application> ()
+        .AddConstructor<TrainSink> ()
+        .AddAttribute ("Port", "UDP port to listen on",
+                       UintegerValue (6000),
+                       MakeUintegerAccessor (&TrainSink::m_port),
+                       MakeUintegerChecker<uint16_t> ())
+        ;
+        return tid;
+}
+
+uint64_t TrainSink::GetPacketsReceived(void) const {
+    return m_packetsReceived;
+}
+
+uint64_t TrainSink::GetBytesReceived(void) const {
+    return m_bytesReceived;
+}
+
+const LatencyHistogram &TrainSink::GetLatency(void) const {
+    return m_latency;
+}
+
+void TrainSink::StartApplication (void) {
+    m_socket = Socket::CreateSocket(GetNode(), TypeId::LookupByName("ns3::UdpSocketFactory"));
+    m_socket->Bind(InetSocketAddress(Ipv4Address::GetAny(), m_port));
+    m_socket->SetRecvCallback(MakeCallback(&TrainSink::HandleRead, this));
+}
+
+void TrainSink::StopApplication (void) {
+    if (m_socket) {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void TrainSink::HandleRead(Ptr<Socket> socket) {
+    Ptr<Packet> packet;
+    while ((packet = socket->Recv())) {
+        PacketTrainTag train;
+        uint32_t count = packet->PeekPacketTag(train) ? train.GetCount() : 1;
+        m_packetsReceived += count;
+        m_bytesReceived += uint64_t(count) * packet->GetSize();
+        //The rest of a train left right behind its first packet and is counted with it
+        SeqTsHeader timestamp;
+        if (packet->PeekHeader(timestamp) == timestamp.GetSerializedSize()) {
+            m_latency.Record(Simulator::Now() - timestamp.GetTs(), count);
+        }
+    }
+}
+
+//Leads every RPC request and response. The server sends the header back unchanged, so
+//the client gets its send time back and keeps no table of outstanding requests
+class RpcHeader : public Header {
+    public:
+        RpcHeader();
+        virtual ~RpcHeader();
+
+        static TypeId GetTypeId (void);
+        virtual TypeId GetInstanceTypeId (void) const;
+        virtual void Print (std::ostream &os) const;
+        virtual uint32_t GetSerializedSize (void) const;
+        virtual void Serialize (Buffer::Iterator start) const;
+        virtual uint32_t Deserialize (Buffer::Iterator start);
+
+        static constexpr uint32_t SIZE = 20;
+        //Requests sent in open loop use no slot
+        static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+        uint32_t id = 0;
+        uint32_t slot = NO_SLOT;
+        uint32_t responseSize = SIZE;
+        Time sent;
+};
+
+RpcHeader::RpcHeader() {}
+RpcHeader::~RpcHeader() {}
+
+TypeId RpcHeader::GetTypeId (void) {
+        static TypeId tid = TypeId ("ns3::RpcHeader")
+        .SetParent<Header> ()
+        .AddConstructor<RpcHeader> ()
+        ;
+        return tid;
+}
+
+TypeId RpcHeader::GetInstanceTypeId (void) const {
+    return GetTypeId();
+}
+
+void RpcHeader::Print (std::ostream &os) const {
+    os << "RPC id=" << id << " slot=" << slot << " response=" << responseSize;
+}
+
+uint32_t RpcHeader::GetSerializedSize (void) const {
+    return SIZE;
+}
+
+void RpcHeader::Serialize (Buffer::Iterator start) const {
+    start.WriteHtonU32(id);
+    start.WriteHtonU32(slot);
+    start.WriteHtonU32(responseSize);
+    start.WriteHtonU64(sent.GetNanoSeconds());
+}
+
+uint32_t RpcHeader::Deserialize (Buffer::Iterator start) {
+    id = start.ReadNtohU32();
+    slot = start.ReadNtohU32();
+    responseSize = start.ReadNtohU32();
+    sent = NanoSeconds(start.ReadNtohU64());
+    return SIZE;
+}
+
+//Answers every request with a response of the size the request asks for. The request
+//packet itself is turned into the response and sent back, nothing is copied or logged
+class RpcServer : public Application {
+    public:
+        RpcServer();
+        virtual ~RpcServer();
+
+        static TypeId GetTypeId (void);
+        uint64_t GetRequests(void) const;
+    private:
+        virtual void StartApplication (void);
+        virtual void StopApplication (void);
+        void HandleRead(Ptr<Socket> socket);
+
+        uint16_t m_port;
+        Ptr<Socket> m_socket;
+        uint64_t m_requests = 0;
+};
+
+RpcServer::RpcServer() {}
+RpcServer::~RpcServer() {}
+
+TypeId RpcServer::GetTypeId (void) {
+        static TypeId tid = TypeId ("ns3::RpcServer")
+        .SetParent<Application> ()
+        .AddConstructor<RpcServer> ()
+        .AddAttribute ("Port", "UDP port to listen on",
+                       UintegerValue (7000),
+                       MakeUintegerAccessor (&RpcServer::m_port),
+                       MakeUintegerChecker<uint16_t> ())
+        ;
+        return tid;
+}
+
+uint64_t RpcServer::GetRequests(void) const {
+    return m_requests;
+}
+
+void RpcServer::StartApplication (void) {
+    m_socket = Socket::CreateSocket(GetNode(), TypeId::LookupByName("ns3::UdpSocketFactory"));
+    m_socket->Bind(InetSocketAddress(Ipv4Address::GetAny(), m_port));
+    m_socket->SetRecvCallback(MakeCallback(&RpcServer::HandleRead, this));
+}
+
+void RpcServer::StopApplication (void) {
+    if (m_socket) {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void RpcServer::HandleRead(Ptr<Socket> socket) {
+    Ptr<Packet> packet;
+    Address from;
+    RpcHeader header;
+    while ((packet = socket->RecvFrom(from))) {
+        if (packet->GetSize() < RpcHeader::SIZE) {
+            continue;
+        }
+        m_requests++;
+        packet->RemoveAllPacketTags();
+        packet->RemoveAllByteTags();
+        packet->RemoveHeader(header);
+        uint32_t payload = std::max(header.responseSize, RpcHeader::SIZE) - RpcHeader::SIZE;
+        if (packet->GetSize() > payload) {
+            packet->RemoveAtEnd(packet->GetSize() - payload);
+        } else {
+            packet->AddPaddingAtEnd(payload - packet->GetSize());
+        }
+        packet->AddHeader(header);
+        socket->SendTo(packet, 0, from);
+    }
+}
+
+/*
+ * Sends requests to an RpcServer and records their round trips. In closed loop (Rate 0)
+ * Concurrency requests are outstanding at any time, each in its own slot, and every
+ * response sends the next request on its slot. Requests that are not answered within
+ * Timeout are counted as lost and their slot moves on. In open loop the requests leave
+ * as a Poisson process of Rate requests per second, whatever happens to the responses.
+ */
+class RpcClient : public Application {
+    public:
+        RpcClient();
+        virtual ~RpcClient();
+
+        static TypeId GetTypeId (void);
+        int64_t AssignStreams(int64_t stream);
+        uint64_t GetRequestsSent(void) const;
+        uint64_t GetResponsesReceived(void) const;
+        uint64_t GetRequestsLost(void) const;
+        const LatencyHistogram &GetLatency(void) const;
+    private:
+        virtual void StartApplication (void);
+        virtual void StopApplication (void);
+        void Send(uint32_t slot);
+        void SendOpenLoop(void);
+        void CheckTimeouts(void);
+        void HandleRead(Ptr<Socket> socket);
+
+        //Sizes are drawn including the RpcHeader
+        static uint32_t DrawSize(Ptr<RandomVariableStream> size);
+
+        Address m_peer;
+        uint32_t m_concurrency;
+        double m_rate;
+        Time m_timeout;
+        Ptr<RandomVariableStream> m_requestSize;
+        Ptr<RandomVariableStream> m_responseSize;
+        Ptr<ExponentialRandomVariable> m_interarrival;
+        Ptr<Socket> m_socket;
+        EventId m_sendEvent;
+        EventId m_timeoutEvent;
+        bool m_running = false;
+
+        //Id and send time of the request outstanding on every slot
+        std::vector<uint32_t> m_slotIds;
+        std::vector<Time> m_slotSent;
+        uint32_t m_nextId = 0;
+        uint64_t m_requestsSent = 0;
+        uint64_t m_responsesReceived = 0;
+        uint64_t m_requestsLost = 0;
+        LatencyHistogram m_latency;
+};
+
+RpcClient::RpcClient() {
+    m_interarrival = CreateObject<ExponentialRandomVariable>();
+}
+RpcClient::~RpcClient() {}
+
+TypeId RpcClient::GetTypeId (void) {
+        static TypeId tid = TypeId ("ns3::RpcClient")
+        .SetParent<Application> ()
+        .AddConstructor<RpcClient> ()
+        .AddAttribute ("Remote", "Address of the RpcServer",
+                       AddressValue (),
+                       MakeAddressAccessor (&RpcClient::m_peer),
+                       MakeAddressChecker ())
+        .AddAttribute ("Concurrency", "Requests outstanding at any time in closed loop",
+                       UintegerValue (1),
+                       MakeUintegerAccessor (&RpcClient::m_concurrency),
+                       MakeUintegerChecker<uint32_t> (1))
+        .AddAttribute ("Rate", "Requests per second in open loop, 0 for closed loop",
+                       DoubleValue (0),
+                       MakeDoubleAccessor (&RpcClient::m_rate),
+                       MakeDoubleChecker<double> (0))
+        .AddAttribute ("Timeout", "Time after which an unanswered request counts as lost",
+                       TimeValue (Seconds (1)),
+                       MakeTimeAccessor (&RpcClient::m_timeout),
+                       MakeTimeChecker ())
+        .AddAttribute ("RequestSize", "Size of the requests in bytes",
+                       StringValue ("ns3::ConstantRandomVariable[Constant=200]"),
+                       MakePointerAccessor (&RpcClient::m_requestSize),
+                       MakePointerChecker<RandomVariableStream> ())
+        .AddAttribute ("ResponseSize", "Size of the responses in bytes",
+                       StringValue ("ns3::ConstantRandomVariable[Constant=1000]"),
+                       MakePointerAccessor (&RpcClient::m_responseSize),
+                       MakePointerChecker<RandomVariableStream> ())
+        ;
+        return tid;
+}
+
+int64_t RpcClient::AssignStreams(int64_t stream) {
+    m_requestSize->SetStream(stream);
+    m_responseSize->SetStream(stream + 1);
+    m_interarrival->SetStream(stream + 2);
+    return 3;
+}
+
+uint64_t RpcClient::GetRequestsSent(void) const {
+    return m_requestsSent;
+}
+
+uint64_t RpcClient::GetResponsesReceived(void) const {
+    return m_responsesReceived;
+}
+
+//Open loop only knows what is still missing at the end
+uint64_t RpcClient::GetRequestsLost(void) const {
+    return m_rate > 0 ? m_requestsSent - m_responsesReceived : m_requestsLost;
+}
+
+const LatencyHistogram &RpcClient::GetLatency(void) const {
+    return m_latency;
+}
+
+//Large enough for the header, small enough for one UDP datagram
+uint32_t RpcClient::DrawSize(Ptr<RandomVariableStream> size) {
+    return std::min(std::max(size->GetInteger(), RpcHeader::SIZE), 65000u);
+}
+
+void RpcClient::StartApplication (void) {
+    m_socket = Socket::CreateSocket(GetNode(), TypeId::LookupByName("ns3::UdpSocketFactory"));
+    m_socket->Bind();
+    m_socket->Connect(m_peer);
+    m_socket->SetRecvCallback(MakeCallback(&RpcClient::HandleRead, this));
+    m_running = true;
+    if (m_rate > 0) {
+        m_interarrival->SetAttribute("Mean", DoubleValue(1 / m_rate));
+        SendOpenLoop();
+    } else {
+        m_slotIds.assign(m_concurrency, 0);
+        m_slotSent.assign(m_concurrency, Time());
+        for (uint32_t slot = 0; slot < m_concurrency; slot++) {
+            Send(slot);
+        }
+        m_timeoutEvent = Simulator::Schedule(m_timeout, &RpcClient::CheckTimeouts, this);
+    }
+}
+
+void RpcClient::StopApplication (void) {
+    m_running = false;
+    Simulator::Cancel(m_sendEvent);
+    Simulator::Cancel(m_timeoutEvent);
+    if (m_socket) {
+        m_socket->Close();
+        m_socket->SetRecvCallback(MakeNullCallback<void, Ptr<Socket> >());
+    }
+}
+
+void RpcClient::Send(uint32_t slot) {
+    RpcHeader header;
+    header.id = m_nextId++;
+    header.slot = slot;
+    header.responseSize = DrawSize(m_responseSize);
+    header.sent = Simulator::Now();
+    if (slot != RpcHeader::NO_SLOT) {
+        m_slotIds[slot] = header.id;
+        m_slotSent[slot] = header.sent;
+    }
+    Ptr<Packet> packet = Create<Packet>(DrawSize(m_requestSize) - RpcHeader::SIZE);
+    packet->AddHeader(header);
+    m_socket->Send(packet);
+    m_requestsSent++;
+}
+
+void RpcClient::SendOpenLoop(void) {
+    Send(RpcHeader::NO_SLOT);
+    m_sendEvent = Simulator::Schedule(Seconds(m_interarrival->GetValue()), &RpcClient::SendOpenLoop, this);
+}
+
+//One sweep per Timeout instead of a timer per request
+void RpcClient::CheckTimeouts(void) {
+    Time now = Simulator::Now();
+    for (uint32_t slot = 0; slot < m_concurrency; slot++) {
+        if (now - m_slotSent[slot] >= m_timeout) {
+            m_requestsLost++;
+            Send(slot);
+        }
+    }
+    m_timeoutEvent = Simulator::Schedule(m_timeout, &RpcClient::CheckTimeouts, this);
+}
+
+void RpcClient::HandleRead(Ptr<Socket> socket) {
+    Ptr<Packet> packet;
+    RpcHeader header;
+    while ((packet = socket->Recv())) {
+        if (packet->PeekHeader(header) != RpcHeader::SIZE) {
+            continue;
+        }
+        //A late response to a request whose slot has moved on was already counted as lost
+        if (header.slot != RpcHeader::NO_SLOT
+            && (header.slot >= m_slotIds.size() || m_slotIds[header.slot] != header.id)) {
+            continue;
+        }
+        m_responsesReceived++;
+        m_latency.Record(Simulator::Now() - header.sent);
+        if (header.slot != RpcHeader::NO_SLOT && m_running) {
+            Send(header.slot);
+        }
+    }
+}
+
+/*
+ * SECTION 7:
+ * Failures in the transit path. TransitRouteManager keeps its own small graph of the
+ * transit routers and installs static routes (which win over the global routes) for
+ * every transit subnet and gateway endpoint. For every destination it remembers which
+ * links its shortest-path tree uses, so when a link or router goes down only the
+ * destinations whose tree crossed it are recomputed, and only routes whose next hop
+ * actually changed are rewritten. When a link comes back only the destinations it
+ * could shorten are recomputed. Either happens DetectionDelay after the event, which
+ * stands in for the time a routing protocol would need to notice.
+ */
+
+class TransitRouteManager {
+    public:
+        TransitRouteManager(Time detectionDelay);
+
+        uint32_t AddRouter(Ptr<Node> node);
+        uint32_t AddLink(NetDeviceContainer link);
+        void AddDestination(uint32_t router, Ipv4Address network, Ipv4Mask mask);
+        void Start(void);
+
+        void ScheduleLinkFailure(uint32_t link, Time down, Time up);
+        void ScheduleRouterFailure(uint32_t router, Time down, Time up);
+        void PrintStats(std::ostream &os) const;
+    private:
+        static constexpr uint32_t UNREACHABLE = UINT32_MAX;
+        static constexpr int32_t NO_LINK = -1;
+
+        struct Router {
+            Ptr<Node> node;
+            std::vector<uint32_t> links;
+            bool up;
+        };
+        struct Link {
+            uint32_t a, b;
+            uint32_t interfaceA, interfaceB;
+            Ipv4Address addressA, addressB;
+            uint32_t metric;
+            bool up;
+            uint32_t failures;  //failures of the link itself in progress; a router coming back leaves it down
+        };
+        struct Destination {
+            Ipv4Address network;
+            Ipv4Mask mask;
+            int32_t link;       //subnet of this transit link, or NO_LINK
+            uint32_t router;    //router the prefix lives on if it is not a link subnet
+            std::vector<uint32_t> distance;
+            std::vector<int32_t> nextLink;
+        };
+
+        uint32_t FindRouter(Ptr<Node> node) const;
+        std::vector<uint32_t> Attached(const Destination &destination) const;
+        void SetInterfaces(uint32_t link, bool up);
+        void LinkDown(uint32_t link);
+        void LinkRepaired(uint32_t link);
+        void LinkUp(uint32_t link);
+        void RouterDown(uint32_t router);
+        void RouterUp(uint32_t router);
+        void Update(std::set<uint32_t> affected, std::string cause);
+        void Recompute(uint32_t destination);
+        void InstallRoute(uint32_t router, const Destination &destination, int32_t link);
+
+        Time m_detectionDelay;
+        std::vector<Router> m_routers;
+        std::vector<Link> m_links;
+        std::vector<Destination> m_destinations;
+        std::vector<std::set<uint32_t> > m_linkUsers;
+
+        uint64_t m_routesChanged = 0;
+        std::vector<std::string> m_updates;
+};
+
+TransitRouteManager::TransitRouteManager(Time detectionDelay)
+    : m_detectionDelay(detectionDelay) {}
+
+uint32_t TransitRouteManager::AddRouter(Ptr<Node> node) {
+    m_routers.push_back({node, {}, true});
+    return m_routers.size() - 1;
+}
+
+uint32_t TransitRouteManager::FindRouter(Ptr<Node> node) const {
+    for (uint32_t i = 0; i < m_routers.size(); i++) {
+        if (m_routers[i].node == node) {
+            return i;
+        }
+    }
+    NS_FATAL_ERROR("Node " << node->GetId() << " is not a transit router");
+    return 0;
+}
+
+//Every transit link also makes its own subnet a destination
+uint32_t TransitRouteManager::AddLink(NetDeviceContainer link) {
+    Link l;
+    l.a = FindRouter(link.Get(0)->GetNode());
+    l.b = FindRouter(link.Get(1)->GetNode());
+    Ptr<Ipv4> ipv4A = link.Get(0)->GetNode()->GetObject<Ipv4>();
+    Ptr<Ipv4> ipv4B = link.Get(1)->GetNode()->GetObject<Ipv4>();
+    l.interfaceA = ipv4A->GetInterfaceForDevice(link.Get(0));
+    l.interfaceB = ipv4B->GetInterfaceForDevice(link.Get(1));
+    l.addressA = ipv4A->GetAddress(l.interfaceA, 0).GetLocal();
+    l.addressB = ipv4B->GetAddress(l.interfaceB, 0).GetLocal();
+    l.metric = ipv4A->GetMetric(l.interfaceA);
+    l.up = true;
+    l.failures = 0;
+    m_links.push_back(l);
+    m_linkUsers.push_back(std::set<uint32_t>());
+
+    uint32_t index = m_links.size() - 1;
+    m_routers[l.a].links.push_back(index);
+    m_routers[l.b].links.push_back(index);
+
+    Ipv4Mask mask = ipv4A->GetAddress(l.interfaceA, 0).GetMask();
+    m_destinations.push_back({l.addressA.CombineMask(mask), mask, int32_t(index), 0, {}, {}});
+    return index;
+}
+
+void TransitRouteManager::AddDestination(uint32_t router, Ipv4Address network, Ipv4Mask mask) {
+    m_destinations.push_back({network, mask, NO_LINK, router, {}, {}});
+}
+
+void TransitRouteManager::Start(void) {
+    for (Destination &destination : m_destinations) {
+        destination.distance.assign(m_routers.size(), UNREACHABLE);
+        destination.nextLink.assign(m_routers.size(), NO_LINK);
+    }
+    std::set<uint32_t> all;
+    for (uint32_t d = 0; d < m_destinations.size(); d++) {
+        all.insert(d);
+    }
+    Update(all, "initial routes");
+}
+
+std::vector<uint32_t> TransitRouteManager::Attached(const Destination &destination) const {
+    if (destination.link != NO_LINK) {
+        const Link &link = m_links[destination.link];
+        return link.up ? std::vector<uint32_t>{link.a, link.b} : std::vector<uint32_t>();
+    }
+    return m_routers[destination.router].up ? std::vector<uint32_t>{destination.router} : std::vector<uint32_t>();
+}
+
+void TransitRouteManager::ScheduleLinkFailure(uint32_t link, Time down, Time up) {
+    Simulator::Schedule(down, &TransitRouteManager::LinkDown, this, link);
+    if (up > down) {
+        Simulator::Schedule(up, &TransitRouteManager::LinkRepaired, this, link);
+    }
+}
+
+void TransitRouteManager::ScheduleRouterFailure(uint32_t router, Time down, Time up) {
+    Simulator::Schedule(down, &TransitRouteManager::RouterDown, this, router);
+    if (up > down) {
+        Simulator::Schedule(up, &TransitRouteManager::RouterUp, this, router);
+    }
+}
+
+//The interfaces go down at once, the routes only follow after the detection delay
+void TransitRouteManager::SetInterfaces(uint32_t link, bool up) {
+    const Link &l = m_links[link];
+    Ptr<Ipv4> ipv4A = m_routers[l.a].node->GetObject<Ipv4>();
+    Ptr<Ipv4> ipv4B = m_routers[l.b].node->GetObject<Ipv4>();
+    if (up) {
+        ipv4A->SetUp(l.interfaceA);
+        ipv4B->SetUp(l.interfaceB);
+    } else {
+        ipv4A->SetDown(l.interfaceA);
+        ipv4B->SetDown(l.interfaceB);
+    }
+}
+
+void TransitRouteManager::LinkDown(uint32_t link) {
+    SetInterfaces(link, false);
+    m_links[link].up = false;
+    m_links[link].failures++;
+
+    std::set<uint32_t> affected = m_linkUsers[link];
+    for (uint32_t d = 0; d < m_destinations.size(); d++) {
+        if (m_destinations[d].link == int32_t(link)) {
+            affected.insert(d);
+        }
+    }
+    std::ostringstream cause;
+    cause << "link " << link << " down";
+    Simulator::Schedule(m_detectionDelay, &TransitRouteManager::Update, this, affected, cause.str());
+}
+
+//End of one failure of the link; it stays down while another one lasts
+void TransitRouteManager::LinkRepaired(uint32_t link) {
+    m_links[link].failures--;
+    LinkUp(link);
+}
+
+//A link that comes back can only help destinations that are reachable from
+//exactly one of its ends or whose distances at its ends differ by more than its metric
+void TransitRouteManager::LinkUp(uint32_t link) {
+    Link &l = m_links[link];
+    if (l.up || l.failures > 0 || !m_routers[l.a].up || !m_routers[l.b].up) {
+        return;
+    }
+    SetInterfaces(link, true);
+    l.up = true;
+
+    std::set<uint32_t> affected;
+    for (uint32_t d = 0; d < m_destinations.size(); d++) {
+        const Destination &destination = m_destinations[d];
+        uint32_t distanceA = destination.distance[l.a];
+        uint32_t distanceB = destination.distance[l.b];
+        bool shorter = distanceA != UNREACHABLE && distanceB != UNREACHABLE
+            && std::max(distanceA, distanceB) - std::min(distanceA, distanceB) > l.metric;
+        if (destination.link == int32_t(link) || (distanceA == UNREACHABLE) != (distanceB == UNREACHABLE) || shorter) {
+            affected.insert(d);
+        }
+    }
+    std::ostringstream cause;
+    cause << "link " << link << " up";
+    Simulator::Schedule(m_detectionDelay, &TransitRouteManager::Update, this, affected, cause.str());
+}
+
+void TransitRouteManager::RouterDown(uint32_t router) {
+    m_routers[router].up = false;
+    std::set<uint32_t> affected;
+    for (uint32_t link : m_routers[router].links) {
+        SetInterfaces(link, false);
+        m_links[link].up = false;
+        affected.insert(m_linkUsers[link].begin(), m_linkUsers[link].end());
+    }
+    for (uint32_t d = 0; d < m_destinations.size(); d++) {
+        const Destination &destination = m_destinations[d];
+        bool onRouter = destination.link == NO_LINK ? destination.router == router
+            : m_links[destination.link].a == router || m_links[destination.link].b == router;
+        if (onRouter) {
+            affected.insert(d);
+        }
+    }
+    std::ostringstream cause;
+    cause << "router " << router << " down";
+    Simulator::Schedule(m_detectionDelay, &TransitRouteManager::Update, this, affected, cause.str());
+}
+
+void TransitRouteManager::RouterUp(uint32_t router) {
+    m_routers[router].up = true;
+    //Links that failed on their own, or lead to a router still down, stay down
+    for (uint32_t link : m_routers[router].links) {
+        LinkUp(link);
+    }
+    for (uint32_t d = 0; d < m_destinations.size(); d++) {
+        if (m_destinations[d].link == NO_LINK && m_destinations[d].router == router) {
+            std::ostringstream cause;
+            cause << "router " << router << " up";
+            Simulator::Schedule(m_detectionDelay, &TransitRouteManager::Update, this, std::set<uint32_t>{d}, cause.str());
+        }
+    }
+}
+
+void TransitRouteManager::Update(std::set<uint32_t> affected, std::string cause) {
+    uint64_t changedBefore = m_routesChanged;
+    auto wallStart = std::chrono::steady_clock::now();
+    for (uint32_t d : affected) {
+        Recompute(d);
+    }
+    double micros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - wallStart).count();
+
+    std::ostringstream line;
+    line << Simulator::Now().As(Time::S) << " " << cause << ": recomputed " << affected.size() << " of "
+         << m_destinations.size() << " destinations, changed " << m_routesChanged - changedBefore
+         << " routes in " << micros << " us";
+    m_updates.push_back(line.str());
+}
+
+//Dijkstra from the routers the destination is attached to, over the links that are up
+void TransitRouteManager::Recompute(uint32_t d) {
+    Destination &destination = m_destinations[d];
+    std::vector<uint32_t> distance(m_routers.size(), UNREACHABLE);
+    std::vector<int32_t> nextLink(m_routers.size(), NO_LINK);
+
+    typedef std::pair<uint32_t, uint32_t> Item;
+    std::priority_queue<Item, std::vector<Item>, std::greater<Item> > frontier;
+    for (uint32_t router : Attached(destination)) {
+        distance[router] = 0;
+        frontier.push(Item(0, router));
+    }
+    while (!frontier.empty()) {
+        Item top = frontier.top();
+        frontier.pop();
+        if (top.first > distance[top.second]) {
+            continue;
+        }
+        for (uint32_t link : m_routers[top.second].links) {
+            const Link &l = m_links[link];
+            if (!l.up) {
+                continue;
+            }
+            uint32_t other = l.a == top.second ? l.b : l.a;
+            uint32_t candidate = top.first + l.metric;
+            if (candidate < distance[other]) {
+                distance[other] = candidate;
+                nextLink[other] = link;
+                frontier.push(Item(candidate, other));
+            }
+        }
+    }
+
+    for (uint32_t router = 0; router < m_routers.size(); router++) {
+        if (nextLink[router] == destination.nextLink[router]) {
+            continue;
+        }
+        if (destination.nextLink[router] != NO_LINK) {
+            m_linkUsers[destination.nextLink[router]].erase(d);
+        }
+        if (nextLink[router] != NO_LINK) {
+            m_linkUsers[nextLink[router]].insert(d);
+        }
+        InstallRoute(router, destination, nextLink[router]);
+    }
+    destination.distance = distance;
+    destination.nextLink = nextLink;
+}
+
+void TransitRouteManager::InstallRoute(uint32_t router, const Destination &destination, int32_t link) {
+    Ipv4StaticRoutingHelper staticRouting;
+    Ptr<Ipv4StaticRouting> table = staticRouting.GetStaticRouting(m_routers[router].node->GetObject<Ipv4>());
+
+    //Routes through an interface that went down are already gone from the table
+    for (uint32_t i = 0; i < table->GetNRoutes(); i++) {
+        Ipv4RoutingTableEntry route = table->GetRoute(i);
+        if (route.IsGateway() && route.GetDest() == destination.network
+            && route.GetDestNetworkMask() == destination.mask) {
+            table->RemoveRoute(i);
+            break;
+        }
+    }
+    if (link != NO_LINK) {
+        const Link &l = m_links[link];
+        bool fromA = l.a == router;
+        table->AddNetworkRouteTo(destination.network, destination.mask,
+                                 fromA ? l.addressB : l.addressA, fromA ? l.interfaceA : l.interfaceB);
+    }
+    m_routesChanged++;
+}
+
+void TransitRouteManager::PrintStats(std::ostream &os) const {
+    for (const std::string &update : m_updates) {
+        os << "  " << update << std::endl;
+    }
+}
+
+/*
+ * TunnelMonitor samples how many bytes the gateways decrypt every Interval and works
+ * out, for every failure, how long the tunnel carried nothing (outage) and how long it
+ * took to get back to 90% of the throughput it had in the second before the failure.
+ */
+
+class TunnelMonitor {
+    public:
+        TunnelMonitor(std::vector<const VpnGateway *> gateways, Time interval);
+
+        void Start(Time at);
+        void AddEvent(std::string name, Time at);
+        void Report(std::ostream &os) const;
+    private:
+        void Sample(void);
+
+        std::vector<const VpnGateway *> m_gateways;
+        Time m_interval;
+        Time m_start;
+        uint64_t m_lastBytes = 0;
+        std::vector<uint64_t> m_samples;
+        std::vector<std::pair<std::string, Time> > m_events;
+};
+
+TunnelMonitor::TunnelMonitor(std::vector<const VpnGateway *> gateways, Time interval)
+    : m_gateways(gateways), m_interval(interval) {}
+
+void TunnelMonitor::Start(Time at) {
+    m_start = at;
+    Simulator::Schedule(at, &TunnelMonitor::Sample, this);
+}
+
+void TunnelMonitor::AddEvent(std::string name, Time at) {
+    m_events.push_back(std::make_pair(name, at));
+}
+
+void TunnelMonitor::Sample(void) {
+    uint64_t bytes = 0;
+    for (const VpnGateway *gateway : m_gateways) {
+        bytes += gateway->GetBytesDecrypted();
+    }
+    m_samples.push_back(bytes - m_lastBytes);
+    m_lastBytes = bytes;
+    Simulator::Schedule(m_interval, &TunnelMonitor::Sample, this);
+}
+
+void TunnelMonitor::Report(std::ostream &os) const {
+    int64_t window = std::max<int64_t>(1, Seconds(1).GetNanoSeconds() / m_interval.GetNanoSeconds());
+    for (const auto &event : m_events) {
+        int64_t at = (event.second - m_start).GetNanoSeconds() / m_interval.GetNanoSeconds() + 1;
+        if (at < 1 || at >= int64_t(m_samples.size())) {
+            continue;
+        }
+        double baseline = 0;
+        int64_t first = std::max<int64_t>(1, at - window);
+        for (int64_t i = first; i < at; i++) {
+            baseline += m_samples[i];
+        }
+        baseline /= at - first;
+
+        int64_t restored = at;
+        while (restored < int64_t(m_samples.size()) && m_samples[restored] == 0) {
+            restored++;
+        }
+        int64_t recovered = restored;
+        for (; recovered < int64_t(m_samples.size()); recovered++) {
+            double recent = 0;
+            int64_t from = std::max(restored, recovered - 4);
+            for (int64_t i = from; i <= recovered; i++) {
+                recent += m_samples[i];
+            }
+            if (recent / (recovered - from + 1) >= 0.9 * baseline) {
+                break;
+            }
+        }
+
+        os << "  " << event.first << " at " << event.second.As(Time::S) << ": outage "
+           << NanoSeconds(m_interval.GetNanoSeconds() * (restored - at)).As(Time::MS) << ", ";
+        if (recovered < int64_t(m_samples.size())) {
+            os << "full throughput after " << (m_start + NanoSeconds(m_interval.GetNanoSeconds() * (recovered + 1)) - event.second).As(Time::MS);
+        } else {
+            os << "throughput did not recover";
+        }
+        os << std::endl;
+    }
+}
+
+/*
+ * SECTION 8:
+ * Replications that share one setup. main builds the whole scenario (nodes, stacks,
+ * addresses, routing tables, applications) once and RunReplications forks a child per
+ * run, which gets all of it copy-on-write. A child moves to its own RngRun and re-assigns
+ * the random streams, which re-seeds every random variable created during setup;
+ * everything created while running draws from the new run anyway. The child sends its
+ * ReplicationResult back through a pipe.
+ */
+
+struct ReplicationResult {
+    uint32_t run;
+    double wallSeconds;
+    uint64_t events;
+    uint64_t bulkBytes;
+    uint64_t cbrSent;
+    uint64_t cbrReceived;
+    uint64_t tunnelPackets;
+    uint64_t tunnelBytes;
+    uint64_t icvFailures;
+    LatencyHistogram roundTrip;
+    LatencyHistogram oneWay;
+};
+
+//The child writes its result in one go and exits before the parent reads it
+static_assert(sizeof(ReplicationResult) < 65536, "ReplicationResult no longer fits in a pipe buffer");
+
+static void PrintReplicationSummary(const std::vector<ReplicationResult> &results, std::ostream &os) {
+    typedef std::pair<const char *, std::function<double(const ReplicationResult &)> > Metric;
+    std::vector<Metric> metrics = {
+        Metric("wall seconds", [](const ReplicationResult &r) { return r.wallSeconds; }),
+        Metric("events", [](const ReplicationResult &r) { return double(r.events); }),
+        Metric("bulk bytes", [](const ReplicationResult &r) { return double(r.bulkBytes); }),
+        Metric("CBR delivered", [](const ReplicationResult &r) {
+            return r.cbrSent > 0 ? double(r.cbrReceived) / r.cbrSent : 0; }),
+        Metric("tunnel bytes", [](const ReplicationResult &r) { return double(r.tunnelBytes); }),
+        Metric("ICV failure rate", [](const ReplicationResult &r) {
+            return r.tunnelPackets > 0 ? double(r.icvFailures) / r.tunnelPackets : 0; }),
+    };
+    for (const Metric &metric : metrics) {
+        double sum = 0, sumSquares = 0;
+        double low = INFINITY, high = -INFINITY;
+        for (const ReplicationResult &result : results) {
+            double value = metric.second(result);
+            sum += value;
+            sumSquares += value * value;
+            low = std::min(low, value);
+            high = std::max(high, value);
+        }
+        double mean = sum / results.size();
+        double variance = results.size() > 1
+            ? (sumSquares - sum * mean) / (results.size() - 1) : 0;
+        os << "  " << metric.first << ": mean " << mean << ", stddev " << std::sqrt(std::max(variance, 0.0))
+           << ", min " << low << ", max " << high << std::endl;
+    }
+    LatencyHistogram roundTrip, oneWay;
+    for (const ReplicationResult &result : results) {
+        roundTrip.Merge(result.roundTrip);
+        oneWay.Merge(result.oneWay);
+    }
+    if (roundTrip.GetCount() > 0) {
+        os << "  round trip over all runs: ";
+        roundTrip.Print(os);
+    }
+    if (oneWay.GetCount() > 0) {
+        os << "  one-way CBR latency over all runs: ";
+        oneWay.Print(os);
+    }
+}
+
+//Runs the scheduled simulation in runs children, at most jobs at a time. The children
+//use RngRun base + 1 ... base + runs, where base is the run given on the command line
+static void RunReplications(uint32_t runs, uint32_t jobs, std::function<void()> reseed,
+                            std::function<ReplicationResult()> collect, std::ostream &os) {
+    uint32_t baseRun = RngSeedManager::GetRun();
+    std::map<pid_t, std::pair<int, uint32_t> > active;
+    std::vector<ReplicationResult> results;
+    uint32_t next = 0;
+    auto wallStart = std::chrono::steady_clock::now();
+
+    while (next < runs || !active.empty()) {
+        while (next < runs && active.size() < jobs) {
+            uint32_t run = baseRun + 1 + next++;
+            int fds[2];
+            NS_ABORT_MSG_IF(pipe(fds) != 0, "Cannot create a pipe for run " << run);
+            //Anything still buffered would otherwise be printed again by the child
+            os.flush();
+            std::cout.flush();
+            pid_t pid = fork();
+            NS_ABORT_MSG_IF(pid < 0, "Cannot fork run " << run);
+            if (pid == 0) {
+                close(fds[0]);
+                RngSeedManager::SetRun(run);
+                reseed();
+                auto runStart = std::chrono::steady_clock::now();
+                Simulator::Run();
+                ReplicationResult result = collect();
+                result.run = run;
+                result.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - runStart).count();
+                //The result fits in the pipe buffer (see the static_assert), so this does not block
+                bool sent = write(fds[1], &result, sizeof(result)) == sizeof(result);
+                _exit(sent ? 0 : 1);
+            }
+            close(fds[1]);
+            active[pid] = std::make_pair(fds[0], run);
+        }
+
+        int status;
+        pid_t pid = wait(&status);
+        NS_ABORT_MSG_IF(pid < 0, "Lost track of the replication children");
+        auto child = active.find(pid);
+        if (child == active.end()) {
+            continue;
+        }
+        ReplicationResult result;
+        bool received = read(child->second.first, &result, sizeof(result)) == sizeof(result);
+        close(child->second.first);
+        if (received && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            os << "  run " << result.run << ": " << result.events << " events in " << result.wallSeconds
+               << " s, " << result.tunnelBytes << " tunnel bytes" << std::endl;
+            results.push_back(result);
+        } else {
+            os << "  run " << child->second.second << " failed" << std::endl;
+        }
+        active.erase(child);
+    }
+
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    os << results.size() << " of " << runs << " runs finished in " << wallSeconds << " s with "
+       << jobs << " parallel jobs" << std::endl;
+    if (!results.empty()) {
+        PrintReplicationSummary(results, os);
+    }
+}
+
+/*
+ * SECTION 9:
+ * Topology snapshots. Nodes, devices and channels are ns-3 objects wired together by
+ * pointers and callbacks and cannot be restored from bytes, so they are still created
+ * (directly, see SECTION 1). What a snapshot keeps is the state that is expensive to
+ * compute on top of them: the interface addresses, every route global routing found
+ * (one SPF per node, the part that grows quadratically with the LAN size) and the SA
+ * table. The image is a few flat arrays of fixed-size records, read with a single read
+ * into buffers sized up front.
+ */
+
+class TopologySnapshot {
+    public:
+        //scenario describes the options that shape the topology; an image is only
+        //loaded into a scenario with the same description
+        TopologySnapshot(std::string scenario);
+
+        void AddSecurityAssociation(const SecurityAssociation &sa);
+        const std::vector<SecurityAssociation> &GetSecurityAssociations(void) const;
+
+        //Records the addresses and global routes of every node
+        void Capture(void);
+        void Save(const std::string &fileName) const;
+        void Load(const std::string &fileName);
+        //Adds the interfaces, addresses and routes of the image to the nodes
+        void Apply(void) const;
+        void PrintStats(std::ostream &os) const;
+    private:
+        struct AddressRecord {
+            uint32_t node;
+            uint32_t interface;
+            uint32_t device;
+            uint32_t metric;
+            uint32_t address;
+            uint32_t mask;
+        };
+        struct RouteRecord {
+            uint32_t node;
+            uint32_t destination;
+            uint32_t mask;
+            uint32_t gateway;
+            uint32_t interface;
+        };
+
+        static Ptr<Ipv4GlobalRouting> GetGlobalRouting(Ptr<Node> node);
+
+        static constexpr uint32_t VERSION = 1;
+        std::string m_scenario;
+        uint32_t m_nodes = 0;
+        std::vector<AddressRecord> m_addresses;
+        std::vector<RouteRecord> m_routes;
+        std::vector<SecurityAssociation> m_securityAssociations;
+        double m_milliseconds = 0;
+        uint64_t m_fileBytes = 0;
+};
+
+TopologySnapshot::TopologySnapshot(std::string scenario) : m_scenario(scenario) {}
+
+void TopologySnapshot::AddSecurityAssociation(const SecurityAssociation &sa) {
+    m_securityAssociations.push_back(sa);
+}
+
+const std::vector<SecurityAssociation> &TopologySnapshot::GetSecurityAssociations(void) const {
+    return m_securityAssociations;
+}
+
+Ptr<Ipv4GlobalRouting> TopologySnapshot::GetGlobalRouting(Ptr<Node> node) {
+    Ptr<Ipv4ListRouting> list = DynamicCast<Ipv4ListRouting>(node->GetObject<Ipv4>()->GetRoutingProtocol());
+    if (!list) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < list->GetNRoutingProtocols(); i++) {
+        int16_t priority;
+        Ptr<Ipv4GlobalRouting> global = DynamicCast<Ipv4GlobalRouting>(list->GetRoutingProtocol(i, priority));
+        if (global) {
+            return global;
+        }
+    }
+    return 0;
+}
+
+void TopologySnapshot::Capture(void) {
+    auto wallStart = std::chrono::steady_clock::now();
+    m_nodes = NodeList::GetNNodes();
+    m_addresses.clear();
+    m_routes.clear();
+    for (uint32_t n = 0; n < m_nodes; n++) {
+        Ptr<Node> node = NodeList::GetNode(n);
+        Ptr<Ipv4> ipv4 = node->GetObject<Ipv4>();
+        if (!ipv4) {
+            continue;
+        }
+        for (uint32_t i = 0; i < ipv4->GetNInterfaces(); i++) {
+            for (uint32_t a = 0; a < ipv4->GetNAddresses(i); a++) {
+                Ipv4InterfaceAddress address = ipv4->GetAddress(i, a);
+                m_addresses.push_back({n, i, ipv4->GetNetDevice(i)->GetIfIndex(), ipv4->GetMetric(i),
+                                       address.GetLocal().Get(), address.GetMask().Get()});
+            }
+        }
+        Ptr<Ipv4GlobalRouting> global = GetGlobalRouting(node);
+        for (uint32_t r = 0; global && r < global->GetNRoutes(); r++) {
+            Ipv4RoutingTableEntry *route = global->GetRoute(r);
+            m_routes.push_back({n, route->GetDest().Get(), route->GetDestNetworkMask().Get(),
+                                route->GetGateway().Get(), route->GetInterface()});
+        }
+    }
+    m_milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wallStart).count();
+}
+
+void TopologySnapshot::Save(const std::string &fileName) const {
+    std::ofstream file(fileName, std::ios::binary);
+    NS_ABORT_MSG_IF(!file, "Cannot write snapshot " << fileName);
+    uint32_t header[] = {VERSION, uint32_t(m_scenario.size()), m_nodes, uint32_t(m_addresses.size()),
+                         uint32_t(m_routes.size()), uint32_t(m_securityAssociations.size())};
+    file.write("VPN2SNAP", 8);
+    file.write(reinterpret_cast<const char *>(header), sizeof(header));
+    file.write(m_scenario.data(), m_scenario.size());
+    file.write(reinterpret_cast<const char *>(m_addresses.data()), m_addresses.size() * sizeof(AddressRecord));
+    file.write(reinterpret_cast<const char *>(m_routes.data()), m_routes.size() * sizeof(RouteRecord));
+    file.write(reinterpret_cast<const char *>(m_securityAssociations.data()),
+               m_securityAssociations.size() * sizeof(SecurityAssociation));
+    NS_ABORT_MSG_IF(!file, "Cannot write snapshot " << fileName);
+}
+
+void TopologySnapshot::Load(const std::string &fileName) {
+    auto wallStart = std::chrono::steady_clock::now();
+    std::ifstream file(fileName, std::ios::binary | std::ios::ate);
+    NS_ABORT_MSG_IF(!file, "Cannot read snapshot " << fileName);
+    std::vector<char> image(file.tellg());
+    file.seekg(0);
+    file.read(image.data(), image.size());
+    m_fileBytes = image.size();
+
+    uint32_t header[6];
+    NS_ABORT_MSG_IF(image.size() < 8 + sizeof(header) || std::string(image.data(), 8) != "VPN2SNAP",
+                    fileName << " is not a topology snapshot");
+    std::memcpy(header, image.data() + 8, sizeof(header));
+    NS_ABORT_MSG_IF(header[0] != VERSION, fileName << " has snapshot version " << header[0]);
+    std::size_t offset = 8 + sizeof(header);
+    std::size_t expected = offset + header[1] + header[3] * sizeof(AddressRecord)
+        + header[4] * sizeof(RouteRecord) + header[5] * sizeof(SecurityAssociation);
+    NS_ABORT_MSG_IF(image.size() != expected, fileName << " is truncated");
+
+    std::string scenario(image.data() + offset, header[1]);
+    NS_ABORT_MSG_IF(scenario != m_scenario, fileName << " was saved for " << scenario
+                    << ", not for " << m_scenario);
+    offset += header[1];
+    m_nodes = header[2];
+    NS_ABORT_MSG_IF(m_nodes != NodeList::GetNNodes(), fileName << " has " << m_nodes << " nodes, the scenario "
+                    << NodeList::GetNNodes());
+
+    m_addresses.resize(header[3]);
+    std::memcpy(m_addresses.data(), image.data() + offset, m_addresses.size() * sizeof(AddressRecord));
+    offset += m_addresses.size() * sizeof(AddressRecord);
+    m_routes.resize(header[4]);
+    std::memcpy(m_routes.data(), image.data() + offset, m_routes.size() * sizeof(RouteRecord));
+    offset += m_routes.size() * sizeof(RouteRecord);
+    m_securityAssociations.resize(header[5]);
+    std::memcpy(m_securityAssociations.data(), image.data() + offset,
+                m_securityAssociations.size() * sizeof(SecurityAssociation));
+    m_milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wallStart).count();
+}
+
+//Does what Ipv4AddressHelper::Assign and PopulateRoutingTables would have done
+void TopologySnapshot::Apply(void) const {
+    for (const AddressRecord &record : m_addresses) {
+        Ptr<Node> node = NodeList::GetNode(record.node);
+        Ptr<Ipv4> ipv4 = node->GetObject<Ipv4>();
+        Ptr<NetDevice> device = node->GetDevice(record.device);
+        int32_t interface = ipv4->GetInterfaceForDevice(device);
+        if (interface == -1) {
+            interface = ipv4->AddInterface(device);
+        }
+        NS_ABORT_MSG_IF(uint32_t(interface) != record.interface, "Snapshot does not match node " << record.node);
+
+        Ipv4InterfaceAddress address(Ipv4Address(record.address), Ipv4Mask(record.mask));
+        bool present = false;
+        for (uint32_t a = 0; a < ipv4->GetNAddresses(interface); a++) {
+            present = present || ipv4->GetAddress(interface, a).GetLocal() == address.GetLocal();
+        }
+        if (!present) {
+            ipv4->AddAddress(interface, address);
+        }
+        ipv4->SetMetric(interface, record.metric);
+        ipv4->SetUp(interface);
+
+        Ptr<TrafficControlLayer> trafficControl = node->GetObject<TrafficControlLayer>();
+        Ptr<NetDeviceQueueInterface> queueInterface = device->GetObject<NetDeviceQueueInterface>();
+        if (trafficControl && queueInterface && !DynamicCast<LoopbackNetDevice>(device)
+            && !trafficControl->GetRootQueueDiscOnDevice(device)) {
+            TrafficControlHelper::Default(queueInterface->GetNTxQueues()).Install(device);
+        }
+    }
+
+    for (const RouteRecord &record : m_routes) {
+        Ptr<Ipv4GlobalRouting> global = GetGlobalRouting(NodeList::GetNode(record.node));
+        Ipv4Address destination(record.destination);
+        Ipv4Address gateway(record.gateway);
+        if (record.mask == 0xffffffff) {
+            if (gateway == Ipv4Address::GetZero()) {
+                global->AddHostRouteTo(destination, record.interface);
+            } else {
+                global->AddHostRouteTo(destination, gateway, record.interface);
+            }
+        } else if (gateway == Ipv4Address::GetZero()) {
+            global->AddNetworkRouteTo(destination, Ipv4Mask(record.mask), record.interface);
+        } else {
+            global->AddNetworkRouteTo(destination, Ipv4Mask(record.mask), gateway, record.interface);
+        }
+    }
+}
+
+void TopologySnapshot::PrintStats(std::ostream &os) const {
+    os << "  " << m_nodes << " nodes, " << m_addresses.size() << " addresses, " << m_routes.size()
+       << " routes, " << m_securityAssociations.size() << " SAs";
+    if (m_fileBytes > 0) {
+        os << ", " << m_fileBytes << " bytes";
+    }
+    os << " in " << m_milliseconds << " ms" << std::endl;
+}
+
+/*
+ * SECTION 10:
+ * The LANs. By default a LAN is a single CsmaChannel, a hub that delivers every frame
+ * to every member. InstallSwitchedLan builds a switched LAN instead: every member gets
+ * its own two-device CSMA link to a switch node, and a BridgeNetDevice there learns
+ * which port each MAC address sits behind. Once it has, a unicast frame only crosses
+ * the sender's and the receiver's links, so the cost of a frame no longer grows with
+ * the LAN size, and every port has its own queue.
+ *
+ * Neighbor tables. Left alone, every host ARPs for its router and the router ARPs back
+ * before the first packet of each flow, which with large LANs means a burst of
+ * broadcasts at the start of the run. PopulateArpCaches writes permanent entries into
+ * the ARP caches of a LAN instead: between the router and every host, or between every
+ * pair of members, after which no member ever has to send a request. ArpMonitor counts
+ * the ARP frames that still go over a LAN.
+ */
+
+//Returns the members' devices in the order of members, like CsmaHelper::Install.
+//The switch ports are added to switchPorts
+static NetDeviceContainer InstallSwitchedLan(CsmaHelper &csma, NodeContainer members, Ptr<Node> lanSwitch,
+                                             NetDeviceContainer &switchPorts) {
+    NetDeviceContainer memberDevices;
+    NetDeviceContainer ports;
+    for (uint32_t i = 0; i < members.GetN(); i++) {
+        NetDeviceContainer link = csma.Install(NodeContainer(members.Get(i), lanSwitch));
+        memberDevices.Add(link.Get(0));
+        ports.Add(link.Get(1));
+    }
+    BridgeHelper bridge;
+    bridge.Install(lanSwitch, ports);
+    switchPorts.Add(ports);
+    return memberDevices;
+}
+
+//Returns the number of entries written; the full mesh needs one per ordered pair of members
+static uint64_t PopulateArpCaches(NetDeviceContainer lan, Ptr<NetDevice> router, bool fullMesh) {
+    struct Member {
+        Ptr<ArpCache> cache;
+        Ipv4Address address;
+        Address mac;
+        bool router;
+    };
+    std::vector<Member> members;
+    members.reserve(lan.GetN());
+    for (uint32_t i = 0; i < lan.GetN(); i++) {
+        Ptr<NetDevice> device = lan.Get(i);
+        Ptr<Ipv4L3Protocol> ipv4 = device->GetNode()->GetObject<Ipv4L3Protocol>();
+        int32_t index = ipv4->GetInterfaceForDevice(device);
+        NS_ABORT_MSG_IF(index < 0, "PopulateArpCaches needs the addresses assigned first");
+        Ptr<Ipv4Interface> interface = ipv4->GetInterface(index);
+        members.push_back({interface->GetArpCache(), interface->GetAddress(0).GetLocal(),
+                           device->GetAddress(), device == router});
+    }
+
+    uint64_t entries = 0;
+    for (const Member &owner : members) {
+        for (const Member &neighbor : members) {
+            if (&owner == &neighbor || !(fullMesh || owner.router || neighbor.router)) {
+                continue;
+            }
+            ArpCache::Entry *entry = owner.cache->Lookup(neighbor.address);
+            if (!entry) {
+                entry = owner.cache->Add(neighbor.address);
+            }
+            entry->SetMacAddress(neighbor.mac);
+            entry->MarkPermanent();
+            entries++;
+        }
+    }
+    return entries;
+}
+
+class ArpMonitor {
+    public:
+        //Counts the ARP frames device sends or sees on its channel
+        void Watch(Ptr<NetDevice> device);
+        uint64_t GetFrames(void) const;
+    private:
+        void Sniff(Ptr<const Packet> packet);
+
+        uint64_t m_frames = 0;
+};
+
+void ArpMonitor::Watch(Ptr<NetDevice> device) {
+    device->TraceConnectWithoutContext("PromiscSniffer", MakeCallback(&ArpMonitor::Sniff, this));
+}
+
+uint64_t ArpMonitor::GetFrames(void) const {
+    return m_frames;
+}
+
+void ArpMonitor::Sniff(Ptr<const Packet> packet) {
+    EthernetHeader ethernet;
+    if (packet->PeekHeader(ethernet) && ethernet.GetLengthType() == ArpL3Protocol::PROT_NUMBER) {
+        m_frames++;
+    }
+}
+
+/*
+ * SECTION 11:
+ * Memory accounting. Built with -DVPN2_MEMORY_ACCOUNTING, the program replaces the
+ * global operator new and delete, and every allocation is charged to the subsystem
+ * that is being built or run at the time: main switches the current tag as it goes
+ * through the setup (nodes, devices, Internet stacks, addresses and routing tables,
+ * VPN gateways with their SA state, applications), and during the run everything lands
+ * on the packets tag except what the scheduler allocates for the event queue, which
+ * AccountedMapScheduler charges to the events tag. The tag is stored in front of each
+ * block, so a block is credited back to the same subsystem whenever it is freed.
+ *
+ * --memoryReport prints live and peak bytes per subsystem next to the RSS around
+ * Simulator::Destroy, and at the times given with --memoryReportAt. Without the build
+ * flag the allocators are left alone and the reports only show the RSS. Like the rest
+ * of ns-3 the counters assume a single thread.
+ *
+ * Built with -DVPN2_SMALL_OBJECT_POOL (alone or together with the accounting), blocks
+ * of up to 256 bytes come from a pool instead of malloc: the event closures every hop
+ * schedules, the callbacks bound into them, packets, tags and the nodes of the event
+ * map. The pool has 16 size classes, 16 bytes apart, carved from 64 KiB slabs of one
+ * address range reserved up front, so a pointer tells by its address whether it is
+ * pooled and its slab tells its class. A freed block goes on the free list of its
+ * class, and the next allocation of that size, typically the next event, takes it
+ * back. The free lists are per thread, so threads never share a list; only handing out
+ * a new slab is shared, and atomic. A block freed by another thread than the one that
+ * allocated it simply moves to that thread's list. Each thread counts into a slot of
+ * its own that outlives it, and the memory report adds up the slots of all threads.
+ */
+
+enum MemoryTag {
+    MEM_OTHER, MEM_NODES, MEM_DEVICES, MEM_STACKS, MEM_ROUTING, MEM_VPN, MEM_APPLICATIONS,
+    MEM_PACKETS, MEM_EVENTS, MEM_TAGS
+};
+
+static const char *MemoryTagName(MemoryTag tag) {
+    static const char *names[MEM_TAGS] = {
+        "other", "nodes", "devices", "internet stacks", "addresses/routing", "vpn gateways/SAs",
+        "applications", "packets (run time)", "event queue"
+    };
+    return names[tag];
+}
+
+struct MemoryCounters {
+    uint64_t liveBytes;
+    uint64_t peakBytes;
+    uint64_t liveBlocks;
+    uint64_t allocations;
+};
+
+//Plain zero-initialized globals, so they work for allocations made before main
+static MemoryCounters g_memory[MEM_TAGS];
+static MemoryTag g_memoryTag = MEM_OTHER;
+
+static void SetMemoryTag(MemoryTag tag) {
+    g_memoryTag = tag;
+}
+
+//Charges everything allocated while it exists to tag
+class MemoryScope {
+    public:
+        MemoryScope(MemoryTag tag) : m_previous(g_memoryTag) {
+            g_memoryTag = tag;
+        }
+        ~MemoryScope() {
+            g_memoryTag = m_previous;
+        }
+    private:
+        MemoryTag m_previous;
+};
+
+#ifdef VPN2_SMALL_OBJECT_POOL
+static constexpr std::size_t POOL_CLASS_BYTES = 16;
+static constexpr uint32_t POOL_CLASSES = 16;
+static constexpr std::size_t POOL_SLAB_BYTES = 64 * 1024;
+static constexpr std::size_t POOL_RESERVE_BYTES = std::size_t(16) << 30;
+static constexpr std::size_t POOL_SLABS = POOL_RESERVE_BYTES / POOL_SLAB_BYTES;
+
+struct PoolFreeBlock {
+    PoolFreeBlock *next;
+};
+
+//Atomic so the report can read them while other threads count
+struct PoolCounters {
+    std::atomic<uint64_t> carved;      //new blocks from a slab
+    std::atomic<uint64_t> reused;      //blocks from a free list
+    std::atomic<uint64_t> malloced;    //too large for the pool, or the pool is full
+    std::atomic<uint64_t> slabs;
+};
+
+//Zero-initialized thread-local storage, so it needs no constructor before main
+struct PoolCache {
+    PoolFreeBlock *free[POOL_CLASSES];
+    char *carve[POOL_CLASSES];
+    char *carveEnd[POOL_CLASSES];
+    PoolCounters *counters;
+    bool sharedCounters;
+};
+
+//Threads beyond the last slot all count into it
+static constexpr uint32_t POOL_THREADS = 256;
+
+static thread_local PoolCache t_pool;
+//Written before the first block of the slab is handed out, read when a block is freed
+static std::atomic<uint8_t> g_poolSlabClass[POOL_SLABS];
+static std::atomic<std::size_t> g_poolSlabs(0);
+static PoolCounters g_poolCounters[POOL_THREADS];
+static std::atomic<uint32_t> g_poolThreads(0);
+
+//A slot of its own lets a thread count with a plain load and store instead of a locked add
+static void PoolCount(PoolCache &cache, std::atomic<uint64_t> PoolCounters::*counter) {
+    if (!cache.counters) {
+        uint32_t slot = g_poolThreads.fetch_add(1, std::memory_order_relaxed);
+        cache.counters = &g_poolCounters[std::min(slot, POOL_THREADS - 1)];
+        cache.sharedCounters = slot >= POOL_THREADS - 1;
+    }
+    std::atomic<uint64_t> &value = cache.counters->*counter;
+    if (cache.sharedCounters) {
+        value.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        value.store(value.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+}
+
+//Address space only; pages are backed as the slabs are used. Null if it cannot be had
+static char *PoolBase(void) {
+    static char *base = [] {
+        void *region = mmap(nullptr, POOL_RESERVE_BYTES, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        return region == MAP_FAILED ? nullptr : static_cast<char *>(region);
+    }();
+    return base;
+}
+
+static void *PoolAllocate(std::size_t size) {
+    PoolCache &cache = t_pool;
+    char *base = PoolBase();
+    if (size <= POOL_CLASSES * POOL_CLASS_BYTES && base) {
+        uint32_t sizeClass = size == 0 ? 0 : (size - 1) / POOL_CLASS_BYTES;
+        if (PoolFreeBlock *block = cache.free[sizeClass]) {
+            cache.free[sizeClass] = block->next;
+            PoolCount(cache, &PoolCounters::reused);
+            return block;
+        }
+        std::size_t blockBytes = (sizeClass + 1) * POOL_CLASS_BYTES;
+        if (cache.carve[sizeClass] == cache.carveEnd[sizeClass]) {
+            std::size_t slab = g_poolSlabs.fetch_add(1, std::memory_order_relaxed);
+            if (slab < POOL_SLABS) {
+                g_poolSlabClass[slab].store(sizeClass, std::memory_order_release);
+                cache.carve[sizeClass] = base + slab * POOL_SLAB_BYTES;
+                cache.carveEnd[sizeClass] = cache.carve[sizeClass] + POOL_SLAB_BYTES - POOL_SLAB_BYTES % blockBytes;
+                PoolCount(cache, &PoolCounters::slabs);
+            }
+        }
+        if (cache.carve[sizeClass] != cache.carveEnd[sizeClass]) {
+            void *block = cache.carve[sizeClass];
+            cache.carve[sizeClass] += blockBytes;
+            PoolCount(cache, &PoolCounters::carved);
+            return block;
+        }
+    }
+    PoolCount(cache, &PoolCounters::malloced);
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+static void PoolFree(void *pointer) {
+    char *base = PoolBase();
+    char *at = static_cast<char *>(pointer);
+    if (base && at >= base && at < base + POOL_RESERVE_BYTES) {
+        PoolCache &cache = t_pool;
+        uint32_t sizeClass = g_poolSlabClass[(at - base) / POOL_SLAB_BYTES].load(std::memory_order_acquire);
+        PoolFreeBlock *block = static_cast<PoolFreeBlock *>(pointer);
+        block->next = cache.free[sizeClass];
+        cache.free[sizeClass] = block;
+        return;
+    }
+    std::free(pointer);
+}
+#endif
+
+#if defined(VPN2_MEMORY_ACCOUNTING) || defined(VPN2_SMALL_OBJECT_POOL)
+static void *RawAllocate(std::size_t size) {
+#ifdef VPN2_SMALL_OBJECT_POOL
+    return PoolAllocate(size);
+#else
+    return std::malloc(size);
+#endif
+}
+
+static void RawFree(void *pointer) {
+#ifdef VPN2_SMALL_OBJECT_POOL
+    PoolFree(pointer);
+#else
+    std::free(pointer);
+#endif
+}
+#endif
+
+#ifdef VPN2_MEMORY_ACCOUNTING
+//Keeps the 16-byte alignment that malloc gives the block
+struct alignas(16) AllocationHeader {
+    uint64_t size;
+    uint32_t tag;
+};
+
+static void *AccountedAllocate(std::size_t size) {
+    AllocationHeader *header = static_cast<AllocationHeader *>(RawAllocate(sizeof(AllocationHeader) + size));
+    if (!header) {
+        return nullptr;
+    }
+    header->size = size;
+    header->tag = g_memoryTag;
+    MemoryCounters &counters = g_memory[g_memoryTag];
+    counters.liveBytes += size;
+    counters.peakBytes = std::max(counters.peakBytes, counters.liveBytes);
+    counters.liveBlocks++;
+    counters.allocations++;
+    return header + 1;
+}
+
+static void AccountedFree(void *pointer) {
+    if (!pointer) {
+        return;
+    }
+    AllocationHeader *header = static_cast<AllocationHeader *>(pointer) - 1;
+    MemoryCounters &counters = g_memory[header->tag];
+    counters.liveBytes -= header->size;
+    counters.liveBlocks--;
+    RawFree(header);
+}
+#endif
+
+#if defined(VPN2_MEMORY_ACCOUNTING) || defined(VPN2_SMALL_OBJECT_POOL)
+static void *ReplacedNew(std::size_t size, bool nothrow) {
+#ifdef VPN2_MEMORY_ACCOUNTING
+    void *pointer = AccountedAllocate(size);
+#else
+    void *pointer = RawAllocate(size);
+#endif
+    if (!pointer && !nothrow) {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+static void ReplacedDelete(void *pointer) {
+#ifdef VPN2_MEMORY_ACCOUNTING
+    AccountedFree(pointer);
+#else
+    if (pointer) {
+        RawFree(pointer);
+    }
+#endif
+}
+
+void *operator new(std::size_t size) {
+    return ReplacedNew(size, false);
+}
+
+void *operator new[](std::size_t size) {
+    return ReplacedNew(size, false);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    return ReplacedNew(size, true);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return ReplacedNew(size, true);
+}
+
+void operator delete(void *pointer) noexcept {
+    ReplacedDelete(pointer);
+}
+
+void operator delete[](void *pointer) noexcept {
+    ReplacedDelete(pointer);
+}
+
+void operator delete(void *pointer, std::size_t) noexcept {
+    ReplacedDelete(pointer);
+}
+
+void operator delete[](void *pointer, std::size_t) noexcept {
+    ReplacedDelete(pointer);
+}
+
+void operator delete(void *pointer, const std::nothrow_t &) noexcept {
+    ReplacedDelete(pointer);
+}
+
+void operator delete[](void *pointer, const std::nothrow_t &) noexcept {
+    ReplacedDelete(pointer);
+}
+#endif
+
+//The default scheduler, except that the nodes of its event map are charged to MEM_EVENTS
+class AccountedMapScheduler : public MapScheduler {
+    public:
+        static TypeId GetTypeId (void);
+        virtual void Insert (const Scheduler::Event &ev);
+};
+
+TypeId AccountedMapScheduler::GetTypeId (void) {
+        static TypeId tid = TypeId ("ns3::AccountedMapScheduler")
+        .SetParent<MapScheduler> ()
+        .AddConstructor<AccountedMapScheduler> ()
+        ;
+        return tid;
+}
+
+void AccountedMapScheduler::Insert (const Scheduler::Event &ev) {
+    MemoryScope scope(MEM_EVENTS);
+    MapScheduler::Insert(ev);
+}
+
+//Resident set size from /proc, 0 where there is none
+static uint64_t ResidentBytes(void) {
+    std::ifstream statm("/proc/self/statm");
+    uint64_t pages = 0, resident = 0;
+    if (!(statm >> pages >> resident)) {
+        return 0;
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void PrintMemoryReport(std::ostream &os, std::string when) {
+    os << "Memory " << when << ": RSS " << ResidentBytes() / 1024 << " KiB" << std::endl;
+#ifdef VPN2_MEMORY_ACCOUNTING
+    uint64_t liveBytes = 0, liveBlocks = 0;
+    for (uint32_t tag = 0; tag < MEM_TAGS; tag++) {
+        const MemoryCounters &counters = g_memory[tag];
+        os << "  " << std::left << std::setw(20) << MemoryTagName(static_cast<MemoryTag>(tag)) << std::right
+           << std::setw(12) << counters.liveBytes / 1024 << " KiB live in " << std::setw(9) << counters.liveBlocks
+           << " blocks, peak " << std::setw(9) << counters.peakBytes / 1024 << " KiB, "
+           << counters.allocations << " allocations" << std::endl;
+        liveBytes += counters.liveBytes;
+        liveBlocks += counters.liveBlocks;
+    }
+    //Every block also costs the header and malloc's own bookkeeping
+    os << "  " << std::left << std::setw(20) << "total" << std::right << std::setw(12) << liveBytes / 1024
+       << " KiB live in " << std::setw(9) << liveBlocks << " blocks" << std::endl;
+#else
+    os << "  (per-subsystem figures need a build with -DVPN2_MEMORY_ACCOUNTING)" << std::endl;
+#endif
+#ifdef VPN2_SMALL_OBJECT_POOL
+    //Without the pool every one of these allocations would have gone to malloc
+    uint64_t carved = 0, reused = 0, malloced = 0, slabs = 0;
+    uint32_t threads = std::min(g_poolThreads.load(std::memory_order_relaxed), POOL_THREADS);
+    for (uint32_t thread = 0; thread < threads; thread++) {
+        carved += g_poolCounters[thread].carved.load(std::memory_order_relaxed);
+        reused += g_poolCounters[thread].reused.load(std::memory_order_relaxed);
+        malloced += g_poolCounters[thread].malloced.load(std::memory_order_relaxed);
+        slabs += g_poolCounters[thread].slabs.load(std::memory_order_relaxed);
+    }
+    uint64_t allocations = carved + reused + malloced;
+    os << "  small-object pool: " << carved + reused << " of " << allocations << " allocations ("
+       << 100.0 * (carved + reused) / std::max<uint64_t>(allocations, 1) << "%) from the pool, "
+       << reused << " of them reused, " << malloced << " from malloc; " << slabs
+       << " slabs (" << slabs * POOL_SLAB_BYTES / 1024 << " KiB) over " << threads << " threads" << std::endl;
+#endif
+}
+
+//Scheduled by --memoryReportAt
+static void PrintMemoryReportNow(void) {
+    std::ostringstream when;
+    when << "at " << Simulator::Now().GetSeconds() << " s";
+    PrintMemoryReport(std::cout, when.str());
+}
+
+/*
+ * SECTION 12:
+ * Time series of the queues and links. TimeSeriesSampler wakes up every --sampleInterval
+ * and records, for every point-to-point and CSMA device, the packets and bytes in the
+ * device queue, the packets in the queue disc in front of it and the share of the link
+ * rate the device sent since the last sample, and for every gateway the tunnel
+ * throughput in each direction. The gateways protect packets synchronously, so they
+ * have no queue of their own to sample. One row per sample goes into a ring buffer
+ * allocated up front; once it is full the oldest rows are overwritten. The rows are
+ * written out as CSV in one go after the run, so nothing touches the disk while the
+ * simulation is running.
+ */
+
+class TimeSeriesSampler {
+    public:
+        TimeSeriesSampler(Time interval, uint32_t capacity);
+
+        //Both have to be called before Start
+        void AddDevice(std::string name, Ptr<NetDevice> device);
+        void AddGateway(std::string name, const VpnGateway *gateway);
+        void Start(Time at);
+        void Write(std::string fileName) const;
+        void PrintStats(std::ostream &os) const;
+    private:
+        //Counts what one device sent since the last sample
+        class DeviceProbe {
+            public:
+                void TxEnd(Ptr<const Packet> packet);
+
+                Ptr<NetDevice> device;
+                Ptr<Queue<Packet> > queue;
+                Ptr<QueueDisc> queueDisc;
+                double bitRate = 0;
+                uint64_t txBytes = 0;
+        };
+
+        struct GatewayProbe {
+            const VpnGateway *gateway;
+            uint64_t bytesOut;
+            uint64_t bytesIn;
+        };
+
+        void Sample(void);
+
+        Time m_interval;
+        uint32_t m_capacity;
+        std::vector<std::string> m_columns;
+        std::vector<std::unique_ptr<DeviceProbe> > m_devices;
+        std::vector<GatewayProbe> m_gateways;
+        std::vector<double> m_times;
+        std::vector<float> m_values;
+        uint64_t m_rows = 0;
+};
+
+void TimeSeriesSampler::DeviceProbe::TxEnd(Ptr<const Packet> packet) {
+    txBytes += packet->GetSize();
+}
+
+TimeSeriesSampler::TimeSeriesSampler(Time interval, uint32_t capacity)
+    : m_interval(interval), m_capacity(std::max<uint32_t>(capacity, 1)) {}
+
+void TimeSeriesSampler::AddDevice(std::string name, Ptr<NetDevice> device) {
+    std::unique_ptr<DeviceProbe> probe(new DeviceProbe);
+    probe->device = device;
+    DataRateValue rate;
+    if (Ptr<PointToPointNetDevice> p2p = DynamicCast<PointToPointNetDevice>(device)) {
+        probe->queue = p2p->GetQueue();
+        p2p->GetAttribute("DataRate", rate);
+    } else if (Ptr<CsmaNetDevice> csma = DynamicCast<CsmaNetDevice>(device)) {
+        probe->queue = csma->GetQueue();
+        csma->GetChannel()->GetAttribute("DataRate", rate);
+    } else {
+        NS_FATAL_ERROR("TimeSeriesSampler only samples point-to-point and CSMA devices");
+    }
+    probe->bitRate = rate.Get().GetBitRate();
+    device->TraceConnectWithoutContext("PhyTxEnd", MakeCallback(&DeviceProbe::TxEnd, probe.get()));
+
+    m_columns.push_back(name + " queue packets");
+    m_columns.push_back(name + " queue bytes");
+    m_columns.push_back(name + " qdisc packets");
+    m_columns.push_back(name + " utilization");
+    m_devices.push_back(std::move(probe));
+}
+
+void TimeSeriesSampler::AddGateway(std::string name, const VpnGateway *gateway) {
+    m_gateways.push_back({gateway, 0, 0});
+    m_columns.push_back(name + " tunnel out Mbps");
+    m_columns.push_back(name + " tunnel in Mbps");
+}
+
+//The queue discs only exist once the Internet stacks are installed, so they are looked up here
+void TimeSeriesSampler::Start(Time at) {
+    for (auto &probe : m_devices) {
+        Ptr<TrafficControlLayer> trafficControl = probe->device->GetNode()->GetObject<TrafficControlLayer>();
+        if (trafficControl) {
+            probe->queueDisc = trafficControl->GetRootQueueDiscOnDevice(probe->device);
+        }
+    }
+    m_times.assign(m_capacity, 0);
+    m_values.assign(static_cast<size_t>(m_capacity) * m_columns.size(), 0);
+    Simulator::Schedule(at, &TimeSeriesSampler::Sample, this);
+}
+
+void TimeSeriesSampler::Sample(void) {
+    uint32_t row = m_rows % m_capacity;
+    m_times[row] = Simulator::Now().GetSeconds();
+    float *values = m_values.data() + static_cast<size_t>(row) * m_columns.size();
+    double seconds = m_interval.GetSeconds();
+    for (auto &probe : m_devices) {
+        *values++ = probe->queue ? probe->queue->GetNPackets() : 0;
+        *values++ = probe->queue ? probe->queue->GetNBytes() : 0;
+        *values++ = probe->queueDisc ? probe->queueDisc->GetNPackets() : 0;
+        *values++ = probe->txBytes * 8 / (probe->bitRate * seconds);
+        probe->txBytes = 0;
+    }
+    for (GatewayProbe &probe : m_gateways) {
+        uint64_t bytesOut = probe.gateway->GetBytesEncrypted();
+        uint64_t bytesIn = probe.gateway->GetBytesDecrypted();
+        *values++ = (bytesOut - probe.bytesOut) * 8 / seconds / 1e6;
+        *values++ = (bytesIn - probe.bytesIn) * 8 / seconds / 1e6;
+        probe.bytesOut = bytesOut;
+        probe.bytesIn = bytesIn;
+    }
+    m_rows++;
+    Simulator::Schedule(m_interval, &TimeSeriesSampler::Sample, this);
+}
+
+//Oldest row first
+void TimeSeriesSampler::Write(std::string fileName) const {
+    std::ofstream out(fileName);
+    NS_ABORT_MSG_IF(!out, "Cannot write " << fileName);
+    out << "time";
+    for (const std::string &column : m_columns) {
+        out << "," << column;
+    }
+    out << "\n";
+    uint64_t first = m_rows > m_capacity ? m_rows - m_capacity : 0;
+    for (uint64_t i = first; i < m_rows; i++) {
+        uint32_t row = i % m_capacity;
+        out << m_times[row];
+        const float *values = m_values.data() + static_cast<size_t>(row) * m_columns.size();
+        for (size_t column = 0; column < m_columns.size(); column++) {
+            out << "," << values[column];
+        }
+        out << "\n";
+    }
+}
+
+void TimeSeriesSampler::PrintStats(std::ostream &os) const {
+    os << "  " << m_rows << " samples of " << m_columns.size() << " series every " << m_interval.GetMilliSeconds()
+       << " ms, " << (m_times.size() * sizeof(double) + m_values.size() * sizeof(float)) / 1024 << " KiB of buffer";
+    if (m_rows > m_capacity) {
+        os << ", the oldest " << m_rows - m_capacity << " overwritten";
+    }
+    os << std::endl;
+}
+
+/*
+ * SECTION 13:
+ * Replaying captured traffic. CaptureFile maps a pcap or pcapng file into memory and
+ * walks its records in place: every record is handed out as a pointer into the
+ * mapping, nothing is read into buffers, and the pages behind the records already
+ * replayed are given back to the kernel, so a capture of many gigabytes never has to
+ * fit in RAM. CaptureReplay turns the IPv4 packets of a capture into UDP datagrams
+ * between the hosts of the two LANs: every captured address is pinned to a simulated
+ * host the first time it is seen, with the two ends of a conversation on opposite
+ * LANs where possible, and every packet leaves at its recorded time (divided by the
+ * speed-up) with its original payload size. Only one record is pending at any time.
+ *
+ * Lengths in a capture are not trusted: a record that claims more than its block or
+ * the file holds is skipped or ends the replay. testdata/oversized-caplen.pcapng has an
+ * enhanced packet block whose captured length wraps 32-bit arithmetic, followed by one
+ * good frame; --replay=testdata/oversized-caplen.pcapng replays just that frame.
+ */
+
+struct CaptureRecord {
+    const uint8_t *data;
+    uint32_t capturedLength;
+    uint32_t originalLength;
+    uint64_t nanoseconds;
+    uint32_t linkType;
+};
+
+class CaptureFile {
+    public:
+        CaptureFile();
+        ~CaptureFile();
+
+        void Open(std::string fileName);
+        //false at the end of the file, or at the first truncated or malformed record
+        bool Next(CaptureRecord &record);
+        uint64_t GetSize(void) const;
+    private:
+        struct Interface {
+            uint32_t linkType;
+            uint8_t resolution;
+        };
+
+        static constexpr uint32_t PCAPNG_SECTION = 0x0A0D0D0A;
+        static constexpr uint32_t PCAPNG_INTERFACE = 1;
+        static constexpr uint32_t PCAPNG_ENHANCED_PACKET = 6;
+        //Consumed pages are dropped in steps of this many bytes
+        static constexpr uint64_t RELEASE_STEP = 64 << 20;
+
+        uint16_t Read16(uint64_t offset) const;
+        uint32_t Read32(uint64_t offset) const;
+        bool NextPcap(CaptureRecord &record);
+        bool NextPcapng(CaptureRecord &record);
+        bool ReadSection(void);
+        bool ReadInterface(uint64_t body, uint64_t end);
+        void Release(void);
+
+        int m_fd = -1;
+        const uint8_t *m_data = nullptr;
+        uint64_t m_size = 0;
+        uint64_t m_offset = 0;
+        uint64_t m_released = 0;
+        bool m_pcapng = false;
+        bool m_swapped = false;
+        bool m_nanosecondPcap = false;
+        uint32_t m_linkType = 0;
+        std::vector<Interface> m_interfaces;
+};
+
+CaptureFile::CaptureFile() {}
+
+CaptureFile::~CaptureFile() {
+    if (m_data) {
+        munmap(const_cast<uint8_t *>(m_data), m_size);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+void CaptureFile::Open(std::string fileName) {
+    m_fd = open(fileName.c_str(), O_RDONLY);
+    NS_ABORT_MSG_IF(m_fd < 0, "Cannot open " << fileName);
+    struct stat status;
+    NS_ABORT_MSG_IF(fstat(m_fd, &status) != 0 || status.st_size < 24, fileName << " is not a capture");
+    m_size = status.st_size;
+    void *mapping = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+    NS_ABORT_MSG_IF(mapping == MAP_FAILED, "Cannot map " << fileName);
+    m_data = static_cast<const uint8_t *>(mapping);
+    madvise(mapping, m_size, MADV_SEQUENTIAL);
+
+    uint32_t magic;
+    std::memcpy(&magic, m_data, 4);
+    if (magic == PCAPNG_SECTION) {
+        m_pcapng = true;
+        NS_ABORT_MSG_IF(!ReadSection(), fileName << " has a broken pcapng section header");
+        return;
+    }
+    m_swapped = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    m_nanosecondPcap = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+    NS_ABORT_MSG_IF(!m_swapped && !m_nanosecondPcap && magic != 0xa1b2c3d4,
+                    fileName << " is neither pcap nor pcapng");
+    m_linkType = Read32(20) & 0xffff;
+    m_offset = 24;
+}
+
+uint64_t CaptureFile::GetSize(void) const {
+    return m_size;
+}
+
+uint16_t CaptureFile::Read16(uint64_t offset) const {
+    uint16_t value;
+    std::memcpy(&value, m_data + offset, 2);
+    return m_swapped ? __builtin_bswap16(value) : value;
+}
+
+uint32_t CaptureFile::Read32(uint64_t offset) const {
+    uint32_t value;
+    std::memcpy(&value, m_data + offset, 4);
+    return m_swapped ? __builtin_bswap32(value) : value;
+}
+
+//The previous record has been used up by the time the next one is asked for
+bool CaptureFile::Next(CaptureRecord &record) {
+    if (m_offset - m_released >= RELEASE_STEP) {
+        Release();
+    }
+    return m_pcapng ? NextPcapng(record) : NextPcap(record);
+}
+
+//Every page before the next record has been replayed and is never touched again
+void CaptureFile::Release(void) {
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t end = m_offset / page * page;
+    if (end > m_released) {
+        madvise(const_cast<uint8_t *>(m_data) + m_released, end - m_released, MADV_DONTNEED);
+        m_released = end;
+    }
+}
+
+bool CaptureFile::NextPcap(CaptureRecord &record) {
+    if (m_offset + 16 > m_size) {
+        return false;
+    }
+    uint64_t seconds = Read32(m_offset);
+    uint64_t fraction = Read32(m_offset + 4);
+    record.capturedLength = Read32(m_offset + 8);
+    record.originalLength = Read32(m_offset + 12);
+    if (m_offset + 16 + record.capturedLength > m_size) {
+        return false;
+    }
+    record.nanoseconds = seconds * 1000000000 + (m_nanosecondPcap ? fraction : fraction * 1000);
+    record.linkType = m_linkType;
+    record.data = m_data + m_offset + 16;
+    m_offset += 16 + record.capturedLength;
+    return true;
+}
+
+//The byte order of the section header applies to the whole section
+bool CaptureFile::ReadSection(void) {
+    if (m_offset + 28 > m_size) {
+        return false;
+    }
+    uint32_t byteOrder;
+    std::memcpy(&byteOrder, m_data + m_offset + 8, 4);
+    if (byteOrder != 0x1A2B3C4D && byteOrder != 0x4D3C2B1A) {
+        return false;
+    }
+    m_swapped = byteOrder == 0x4D3C2B1A;
+    m_interfaces.clear();
+    uint32_t length = Read32(m_offset + 4);
+    if (length < 28 || m_offset + length > m_size) {
+        return false;
+    }
+    m_offset += length;
+    return true;
+}
+
+//Only if_tsresol matters; without it timestamps are in microseconds. A power of ten
+//beyond 10^-19 does not fit 64 bits and makes the interface, and the file, unreadable
+bool CaptureFile::ReadInterface(uint64_t body, uint64_t end) {
+    Interface interface = {Read16(body), 6};
+    for (uint64_t option = body + 8; option + 4 <= end; ) {
+        uint16_t code = Read16(option);
+        uint16_t length = Read16(option + 2);
+        if (code == 0) {
+            break;
+        }
+        if (code == 9 && length >= 1 && option + 5 <= end) {
+            interface.resolution = m_data[option + 4];
+        }
+        option += 4 + ((length + 3) & ~3u);
+    }
+    if (!(interface.resolution & 0x80) && interface.resolution > 19) {
+        return false;
+    }
+    m_interfaces.push_back(interface);
+    return true;
+}
+
+bool CaptureFile::NextPcapng(CaptureRecord &record) {
+    while (m_offset + 12 <= m_size) {
+        uint32_t type = Read32(m_offset);
+        if (type == PCAPNG_SECTION) {
+            if (!ReadSection()) {
+                return false;
+            }
+            continue;
+        }
+        uint32_t length = Read32(m_offset + 4);
+        if (length < 12 || m_offset + length > m_size) {
+            return false;
+        }
+        uint64_t block = m_offset;
+        m_offset += length;
+        if (type == PCAPNG_INTERFACE && length >= 20) {
+            if (!ReadInterface(block + 8, block + length - 4)) {
+                return false;
+            }
+        } else if (type == PCAPNG_ENHANCED_PACKET && length >= 32) {
+            uint32_t interface = Read32(block + 8);
+            record.capturedLength = Read32(block + 20);
+            record.originalLength = Read32(block + 24);
+            if (interface >= m_interfaces.size() || uint64_t(28) + record.capturedLength > length - 4) {
+                continue;
+            }
+            uint64_t ticks = (uint64_t(Read32(block + 12)) << 32) | Read32(block + 16);
+            uint8_t resolution = m_interfaces[interface].resolution;
+            if (resolution & 0x80) {
+                record.nanoseconds = static_cast<uint64_t>(
+                    static_cast<unsigned __int128>(ticks) * 1000000000 >> (resolution & 0x7f));
+            } else {
+                //At most 10^10, and ticks in seconds times 10^9 saturate instead of wrapping
+                uint64_t scale = 1;
+                for (uint32_t i = 0; i < uint32_t(std::abs(9 - resolution)); i++) {
+                    scale *= 10;
+                }
+                unsigned __int128 nanoseconds = resolution <= 9 ? static_cast<unsigned __int128>(ticks) * scale
+                                                                : ticks / scale;
+                record.nanoseconds = static_cast<uint64_t>(std::min<unsigned __int128>(nanoseconds, UINT64_MAX));
+            }
+            record.linkType = m_interfaces[interface].linkType;
+            record.data = m_data + block + 28;
+            return true;
+        }
+        //Simple packet blocks carry no timestamp and cannot be replayed in time
+    }
+    return false;
+}
+
+class CaptureReplay {
+    public:
+        //Packets to and from unknown addresses go between hosts1 and hosts2
+        CaptureReplay(std::string fileName, NodeContainer hosts1, NodeContainer hosts2, double speedup);
+
+        void Start(Time at);
+        void PrintStats(std::ostream &os) const;
+    private:
+        struct Endpoint {
+            Ptr<Node> node;
+            Ipv4Address address;
+            Ptr<Socket> socket;
+        };
+
+        static constexpr uint16_t PORT = 9000;
+
+        //Finds the next IPv4 packet in the capture, false at the end
+        bool ReadNext(void);
+        uint32_t MapAddress(uint32_t address, uint32_t peer);
+        void SendNext(void);
+        void Receive(Ptr<Socket> socket);
+
+        CaptureFile m_capture;
+        std::vector<Endpoint> m_endpoints;
+        uint32_t m_lan1Hosts;
+        std::map<uint32_t, uint32_t> m_hosts;
+        uint32_t m_nextHost[2] = {0, 0};
+        double m_speedup;
+        uint64_t m_firstNanoseconds = 0;
+        Time m_start;
+
+        //The packet waiting for its time
+        uint32_t m_source = 0;
+        uint32_t m_destination = 0;
+        const uint8_t *m_payload = nullptr;
+        uint32_t m_payloadCaptured = 0;
+        uint32_t m_payloadSize = 0;
+        uint64_t m_nanoseconds = 0;
+
+        uint64_t m_records = 0;
+        uint64_t m_skipped = 0;
+        uint64_t m_packetsSent = 0;
+        uint64_t m_bytesSent = 0;
+        uint64_t m_packetsReceived = 0;
+        uint64_t m_bytesReceived = 0;
+        double m_milliseconds = 0;
+};
+
+CaptureReplay::CaptureReplay(std::string fileName, NodeContainer hosts1, NodeContainer hosts2, double speedup)
+    : m_lan1Hosts(hosts1.GetN()), m_speedup(speedup) {
+    m_capture.Open(fileName);
+    for (NodeContainer hosts : {hosts1, hosts2}) {
+        for (uint32_t i = 0; i < hosts.GetN(); i++) {
+            Ptr<Node> node = hosts.Get(i);
+            m_endpoints.push_back({node, node->GetObject<Ipv4>()->GetAddress(1, 0).GetLocal(), Ptr<Socket>()});
+        }
+    }
+}
+
+void CaptureReplay::Start(Time at) {
+    for (Endpoint &endpoint : m_endpoints) {
+        endpoint.socket = Socket::CreateSocket(endpoint.node, TypeId::LookupByName("ns3::UdpSocketFactory"));
+        endpoint.socket->Bind(InetSocketAddress(Ipv4Address::GetAny(), PORT));
+        endpoint.socket->SetRecvCallback(MakeCallback(&CaptureReplay::Receive, this));
+    }
+    m_start = at;
+    if (ReadNext()) {
+        m_firstNanoseconds = m_nanoseconds;
+        Simulator::Schedule(at, &CaptureReplay::SendNext, this);
+    }
+}
+
+//A new address goes to the LAN its peer is not on, round robin within the LAN
+uint32_t CaptureReplay::MapAddress(uint32_t address, uint32_t peer) {
+    auto known = m_hosts.find(address);
+    if (known != m_hosts.end()) {
+        return known->second;
+    }
+    auto peerHost = m_hosts.find(peer);
+    uint32_t lan = peerHost != m_hosts.end() && peerHost->second < m_lan1Hosts ? 1 : 0;
+    uint32_t hosts = lan == 0 ? m_lan1Hosts : m_endpoints.size() - m_lan1Hosts;
+    uint32_t host = (lan == 0 ? 0 : m_lan1Hosts) + m_nextHost[lan]++ % hosts;
+    m_hosts[address] = host;
+    return host;
+}
+
+bool CaptureReplay::ReadNext(void) {
+    auto start = std::chrono::steady_clock::now();
+    CaptureRecord record;
+    bool found = false;
+    while (!found && m_capture.Next(record)) {
+        m_records++;
+        //Link layer header in front of IPv4: Ethernet (with VLAN tags), raw IP, Linux
+        //cooked capture, BSD loopback
+        const uint8_t *ip = record.data;
+        uint32_t left = record.capturedLength;
+        uint32_t skip = 0;
+        bool ipv4 = false;
+        if (record.linkType == 1 && left >= 14) {
+            skip = 12;
+            while (skip + 2 <= left && ((ip[skip] << 8) | ip[skip + 1]) == 0x8100) {
+                skip += 4;
+            }
+            ipv4 = skip + 2 <= left && ((ip[skip] << 8) | ip[skip + 1]) == 0x0800;
+            skip += 2;
+        } else if (record.linkType == 101 || record.linkType == 228) {
+            ipv4 = left > 0 && ip[0] >> 4 == 4;
+        } else if (record.linkType == 113 && left >= 16) {
+            skip = 16;
+            ipv4 = ((ip[14] << 8) | ip[15]) == 0x0800;
+        } else if (record.linkType == 0 && left >= 4) {
+            skip = 4;
+            ipv4 = ip[0] == 2 || ip[3] == 2;
+        }
+        if (!ipv4 || left < skip + 20) {
+            m_skipped++;
+            continue;
+        }
+        ip += skip;
+        left -= skip;
+        uint32_t headerLength = (ip[0] & 0x0f) * 4;
+        uint32_t totalLength = (ip[2] << 8) | ip[3];
+        if (headerLength < 20 || totalLength < headerLength || left < headerLength) {
+            m_skipped++;
+            continue;
+        }
+        //The transport header is replaced by the simulated UDP one, the payload keeps its size
+        uint32_t transportLength = 0;
+        if (ip[9] == 17) {
+            transportLength = 8;
+        } else if (ip[9] == 6 && left >= headerLength + 13) {
+            transportLength = (ip[headerLength + 12] >> 4) * 4;
+        }
+        transportLength = std::min(transportLength, totalLength - headerLength);
+        uint32_t source = ReadBigEndian32(ip + 12);
+        uint32_t destination = ReadBigEndian32(ip + 16);
+        m_source = MapAddress(source, destination);
+        m_destination = MapAddress(destination, source);
+        if (m_source == m_destination) {
+            m_skipped++;
+            continue;
+        }
+        uint32_t payloadOffset = headerLength + transportLength;
+        m_payload = ip + std::min(payloadOffset, left);
+        m_payloadCaptured = left > payloadOffset ? left - payloadOffset : 0;
+        m_payloadSize = std::min(totalLength - payloadOffset, 65000u);
+        m_payloadCaptured = std::min(m_payloadCaptured, m_payloadSize);
+        m_nanoseconds = record.nanoseconds;
+        found = true;
+    }
+    m_milliseconds += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return found;
+}
+
+//The captured bytes are copied once, into the packet; what the capture cut off is padding
+void CaptureReplay::SendNext(void) {
+    Ptr<Packet> packet = Create<Packet>(m_payload, m_payloadCaptured);
+    packet->AddPaddingAtEnd(m_payloadSize - m_payloadCaptured);
+    m_endpoints[m_source].socket->SendTo(packet, 0, InetSocketAddress(m_endpoints[m_destination].address, PORT));
+    m_packetsSent++;
+    m_bytesSent += m_payloadSize;
+    if (ReadNext()) {
+        //Captures are not always in time order, late records go right away
+        double offset = m_nanoseconds > m_firstNanoseconds ? (m_nanoseconds - m_firstNanoseconds) / m_speedup : 0;
+        Time at = m_start + NanoSeconds(static_cast<int64_t>(offset));
+        Simulator::Schedule(std::max(at - Simulator::Now(), Time(0)), &CaptureReplay::SendNext, this);
+    }
+}
+
+void CaptureReplay::Receive(Ptr<Socket> socket) {
+    Ptr<Packet> packet;
+    while ((packet = socket->Recv())) {
+        m_packetsReceived++;
+        m_bytesReceived += packet->GetSize();
+    }
+}
+
+void CaptureReplay::PrintStats(std::ostream &os) const {
+    os << "  " << m_records << " records of " << m_capture.GetSize() / 1048576.0 << " MiB read in "
+       << m_milliseconds << " ms, " << m_skipped << " skipped, " << m_hosts.size()
+       << " addresses mapped onto " << m_endpoints.size() << " hosts" << std::endl;
+    os << "  sent " << m_packetsSent << " packets (" << m_bytesSent << " bytes), received "
+       << m_packetsReceived << " (" << m_bytesReceived << " bytes)" << std::endl;
+}
+
+/*
+ * SECTION 14:
+ * Leak detection on the transit routers. Nothing r1 forwards should show the contents
+ * of the packets inside the tunnel, so LeakDetector sniffs every device of the transit
+ * routers and scans every frame for plaintext markers, such as the fill of the echo
+ * packets. The scan is a Teddy multi-pattern matcher: the patterns are spread over
+ * eight buckets, and for each of the first (up to three) bytes of the patterns two
+ * 16-entry tables map the low and high nibble of a byte to the buckets whose patterns
+ * can have that byte there. With SSSE3 one PSHUFB per table and byte position checks
+ * 16 positions at once; the rare positions that survive all of them are compared
+ * against the patterns of their buckets. Without SSSE3 the same tables are used a byte
+ * at a time.
+ */
+
+class TeddyMatcher {
+    public:
+        void AddPattern(const std::string &pattern);
+        //After the last AddPattern, before the first Scan
+        void Compile(void);
+        uint32_t GetPatternCount(void) const;
+        const std::string &GetPattern(uint32_t pattern) const;
+        const char *GetKernelName(void) const;
+        //Calls found with the pattern and the offset of every match
+        void Scan(const uint8_t *data, uint32_t size,
+                  const std::function<void(uint32_t, uint32_t)> &found) const;
+    private:
+        static constexpr uint32_t BUCKETS = 8;
+        static constexpr uint32_t MAX_FINGERPRINT = 3;
+
+        uint8_t Candidates(const uint8_t *at) const;
+        void Verify(const uint8_t *data, uint32_t size, uint32_t position, uint8_t buckets,
+                    const std::function<void(uint32_t, uint32_t)> &found) const;
+        void ScanScalar(const uint8_t *data, uint32_t size, uint32_t start,
+                        const std::function<void(uint32_t, uint32_t)> &found) const;
+#ifdef VPN2_X86
+        //The fingerprint length is a template parameter so the tables stay in registers
+        template <uint32_t FINGERPRINT>
+        uint32_t ScanSsse3(const uint8_t *data, uint32_t size,
+                           const std::function<void(uint32_t, uint32_t)> &found) const;
+#endif
+
+        std::vector<std::string> m_patterns;
+        std::vector<uint32_t> m_buckets[BUCKETS];
+        uint32_t m_fingerprint = 0;
+        alignas(16) uint8_t m_low[MAX_FINGERPRINT][16] = {};
+        alignas(16) uint8_t m_high[MAX_FINGERPRINT][16] = {};
+};
+
+void TeddyMatcher::AddPattern(const std::string &pattern) {
+    NS_ABORT_MSG_IF(pattern.empty(), "Empty leak marker");
+    m_patterns.push_back(pattern);
+}
+
+void TeddyMatcher::Compile(void) {
+    m_fingerprint = MAX_FINGERPRINT;
+    for (const std::string &pattern : m_patterns) {
+        m_fingerprint = std::min<uint32_t>(m_fingerprint, pattern.size());
+    }
+    std::memset(m_low, 0, sizeof(m_low));
+    std::memset(m_high, 0, sizeof(m_high));
+    for (uint32_t bucket = 0; bucket < BUCKETS; bucket++) {
+        m_buckets[bucket].clear();
+    }
+    for (uint32_t i = 0; i < m_patterns.size(); i++) {
+        uint32_t bucket = i % BUCKETS;
+        m_buckets[bucket].push_back(i);
+        for (uint32_t j = 0; j < m_fingerprint; j++) {
+            uint8_t byte = m_patterns[i][j];
+            m_low[j][byte & 0x0f] |= 1 << bucket;
+            m_high[j][byte >> 4] |= 1 << bucket;
+        }
+    }
+}
+
+uint32_t TeddyMatcher::GetPatternCount(void) const {
+    return m_patterns.size();
+}
+
+const std::string &TeddyMatcher::GetPattern(uint32_t pattern) const {
+    return m_patterns[pattern];
+}
 
-        void EncryptData(uint128_t data, uint128_t key);
+const char *TeddyMatcher::GetKernelName(void) const {
+    return CpuFeatures::Get().ssse3 ? "SSSE3" : "scalar";
+}
+
+//The buckets with a pattern that can start at at
+uint8_t TeddyMatcher::Candidates(const uint8_t *at) const {
+    uint8_t buckets = 0xff;
+    for (uint32_t j = 0; j < m_fingerprint; j++) {
+        buckets &= m_low[j][at[j] & 0x0f] & m_high[j][at[j] >> 4];
+    }
+    return buckets;
+}
+
+void TeddyMatcher::Verify(const uint8_t *data, uint32_t size, uint32_t position, uint8_t buckets,
+                          const std::function<void(uint32_t, uint32_t)> &found) const {
+    for (uint32_t bucket = 0; bucket < BUCKETS; bucket++) {
+        if (!(buckets & (1 << bucket))) {
+            continue;
+        }
+        for (uint32_t pattern : m_buckets[bucket]) {
+            const std::string &bytes = m_patterns[pattern];
+            if (position + bytes.size() <= size && std::memcmp(data + position, bytes.data(), bytes.size()) == 0) {
+                found(pattern, position);
+            }
+        }
+    }
+}
+
+void TeddyMatcher::ScanScalar(const uint8_t *data, uint32_t size, uint32_t start,
+                              const std::function<void(uint32_t, uint32_t)> &found) const {
+    for (uint32_t position = start; position + m_fingerprint <= size; position++) {
+        uint8_t buckets = Candidates(data + position);
+        if (buckets) {
+            Verify(data, size, position, buckets, found);
+        }
+    }
+}
+
+#ifdef VPN2_X86
+//Returns the first position left to the scalar loop
+template <uint32_t FINGERPRINT>
+__attribute__((target("ssse3")))
+uint32_t TeddyMatcher::ScanSsse3(const uint8_t *data, uint32_t size,
+                                 const std::function<void(uint32_t, uint32_t)> &found) const {
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i low[FINGERPRINT], high[FINGERPRINT];
+    for (uint32_t j = 0; j < FINGERPRINT; j++) {
+        low[j] = _mm_load_si128(reinterpret_cast<const __m128i *>(m_low[j]));
+        high[j] = _mm_load_si128(reinterpret_cast<const __m128i *>(m_high[j]));
+    }
+    uint32_t position = 0;
+    for (; position + 15 + FINGERPRINT <= size; position += 16) {
+        __m128i buckets = _mm_set1_epi8(-1);
+        for (uint32_t j = 0; j < FINGERPRINT; j++) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + position + j));
+            __m128i lowBuckets = _mm_shuffle_epi8(low[j], _mm_and_si128(bytes, nibble));
+            __m128i highBuckets = _mm_shuffle_epi8(high[j], _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+            buckets = _mm_and_si128(buckets, _mm_and_si128(lowBuckets, highBuckets));
+        }
+        uint32_t candidates = ~_mm_movemask_epi8(_mm_cmpeq_epi8(buckets, zero)) & 0xffff;
+        if (candidates) {
+            alignas(16) uint8_t perPosition[16];
+            _mm_store_si128(reinterpret_cast<__m128i *>(perPosition), buckets);
+            while (candidates) {
+                uint32_t offset = __builtin_ctz(candidates);
+                Verify(data, size, position + offset, perPosition[offset], found);
+                candidates &= candidates - 1;
+            }
+        }
+    }
+    return position;
+}
+#endif
+
+void TeddyMatcher::Scan(const uint8_t *data, uint32_t size,
+                        const std::function<void(uint32_t, uint32_t)> &found) const {
+    uint32_t start = 0;
+#ifdef VPN2_X86
+    if (CpuFeatures::Get().ssse3) {
+        start = m_fingerprint == 1 ? ScanSsse3<1>(data, size, found)
+            : m_fingerprint == 2 ? ScanSsse3<2>(data, size, found) : ScanSsse3<3>(data, size, found);
+    }
+#endif
+    ScanScalar(data, size, start, found);
+}
+
+class LeakDetector {
+    public:
+        LeakDetector();
+
+        void AddMarker(const std::string &marker);
+        //Every device but the loopback; the markers have to be added before
+        void WatchNode(Ptr<Node> node);
+        uint64_t GetLeaks(void) const;
+        void PrintStats(std::ostream &os) const;
+    private:
+        void Sniff(std::string device, Ptr<const Packet> packet);
+
+        TeddyMatcher m_matcher;
+        std::vector<uint8_t> m_buffer;
+        std::vector<uint64_t> m_markerHits;
+        uint64_t m_packets = 0;
+        uint64_t m_bytes = 0;
+        uint64_t m_leaks = 0;
+        double m_scanNanoseconds = 0;
+        bool m_compiled = false;
+        std::string m_firstLeak;
+};
+
+LeakDetector::LeakDetector() : m_buffer(65536) {}
+
+void LeakDetector::AddMarker(const std::string &marker) {
+    NS_ABORT_MSG_IF(m_compiled, "Leak markers have to be added before the first device is watched");
+    m_matcher.AddPattern(marker);
+}
+
+void LeakDetector::WatchNode(Ptr<Node> node) {
+    if (!m_compiled) {
+        m_matcher.Compile();
+        m_markerHits.assign(m_matcher.GetPatternCount(), 0);
+        m_compiled = true;
+    }
+    for (uint32_t i = 0; i < node->GetNDevices(); i++) {
+        Ptr<NetDevice> device = node->GetDevice(i);
+        if (DynamicCast<LoopbackNetDevice>(device)) {
+            continue;
+        }
+        std::ostringstream name;
+        name << "n" << node->GetId() << "/" << i;
+        device->TraceConnect("PromiscSniffer", name.str(), MakeCallback(&LeakDetector::Sniff, this));
+    }
+}
+
+uint64_t LeakDetector::GetLeaks(void) const {
+    return m_leaks;
+}
+
+//Frames are copied into m_buffer, so the scan allocates nothing
+void LeakDetector::Sniff(std::string device, Ptr<const Packet> packet) {
+    uint32_t size = packet->GetSize();
+    if (size > m_buffer.size()) {
+        m_buffer.resize(size);
+    }
+    packet->CopyData(m_buffer.data(), size);
+    bool leaked = false;
+    auto start = std::chrono::steady_clock::now();
+    m_matcher.Scan(m_buffer.data(), size, [&](uint32_t marker, uint32_t offset) {
+        m_markerHits[marker]++;
+        if (!leaked && m_leaks == 0) {
+            std::ostringstream leak;
+            leak << "at " << Simulator::Now().GetSeconds() << " s on " << device << ", marker "
+                 << marker << " at byte " << offset << " of a " << size << " byte frame";
+            m_firstLeak = leak.str();
+        }
+        leaked = true;
+    });
+    m_scanNanoseconds += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    m_packets++;
+    m_bytes += size;
+    m_leaks += leaked;
+}
+
+void LeakDetector::PrintStats(std::ostream &os) const {
+    os << "  scanned " << m_packets << " frames (" << m_bytes << " bytes) for " << m_matcher.GetPatternCount()
+       << " markers with the " << m_matcher.GetKernelName() << " kernel";
+    if (m_packets > 0) {
+        os << ", " << m_scanNanoseconds / m_packets << " ns/frame, "
+           << m_bytes / std::max(m_scanNanoseconds, 1.0) << " GB/s";
+    }
+    os << std::endl;
+    if (m_leaks == 0) {
+        os << "  no plaintext leaked" << std::endl;
+        return;
+    }
+    os << "  LEAK: " << m_leaks << " frames carried plaintext, the first " << m_firstLeak << std::endl;
+    for (uint32_t marker = 0; marker < m_markerHits.size(); marker++) {
+        os << "    marker " << marker << " (" << m_matcher.GetPattern(marker).size() << " bytes): "
+           << m_markerHits[marker] << " hits" << std::endl;
+    }
+}
+
+/*
+ * SECTION 15:
+ * A full-size forwarding table on r1. If r1 stands for the Internet it should carry
+ * an Internet routing table of around a million prefixes, which Ipv4StaticRouting
+ * and Ipv4GlobalRouting would search one route at a time. Dir24Fib is a DIR-24-8
+ * table (Gupta, Lin and McKeown): one 16-bit entry per /24, indexed by the top 24
+ * bits of the destination, holds the next hop or, where the /24 is split by longer
+ * prefixes, the number of a 256-entry chunk indexed by the last byte. A lookup is one
+ * memory access, two for the few split /24s. The table is built once, from the
+ * prefixes sorted by length so that longer ones overwrite shorter ones, and sits in
+ * r1's Ipv4ListRouting ahead of the static and global routing. The prefixes of the
+ * simulated network itself are entered as DEFER, which hands the packet on to those
+ * protocols, so the routes TransitRouteManager rewrites after a failure keep working
+ * and a loaded prefix only wins where it is more specific. Loaded prefixes are spread
+ * over r1's neighbours by a hash of the prefix, as if learned from either side.
+ */
+
+class Dir24Fib : public Ipv4RoutingProtocol {
+    public:
         static TypeId GetTypeId (void);
+
+        //After the FIB is added to the node's Ipv4ListRouting
+        void LoadPrefixes(const std::string &fileName);
+        void AddLocalPrefixes(void);
+        //After the last prefix is added, before the first lookup
+        void Build(void);
+        uint16_t Lookup(uint32_t address) const;
+        //Times lookups outside the simulation, once after the run, for PrintStats
+        void MeasureLookup(void);
+        void PrintStats(std::ostream &os) const;
+
+        virtual Ptr<Ipv4Route> RouteOutput (Ptr<Packet> p, const Ipv4Header &header, Ptr<NetDevice> oif,
+                                            Socket::SocketErrno &sockerr);
+        virtual bool RouteInput (Ptr<const Packet> p, const Ipv4Header &header, Ptr<const NetDevice> idev,
+                                 UnicastForwardCallback ucb, MulticastForwardCallback mcb,
+                                 LocalDeliverCallback lcb, ErrorCallback ecb);
+        virtual void NotifyInterfaceUp (uint32_t interface);
+        virtual void NotifyInterfaceDown (uint32_t interface);
+        virtual void NotifyAddAddress (uint32_t interface, Ipv4InterfaceAddress address);
+        virtual void NotifyRemoveAddress (uint32_t interface, Ipv4InterfaceAddress address);
+        virtual void SetIpv4 (Ptr<Ipv4> ipv4);
+        virtual void PrintRoutingTable (Ptr<OutputStreamWrapper> stream, Time::Unit unit = Time::S) const;
+    protected:
+        virtual void DoDispose (void);
     private:
-        u_int16_t key = 123;
-        u_int16_t securePayload;
+        //Entries below FIRST_NEXT_HOP are not next hops; CHUNK marks a split /24
+        static constexpr uint16_t NO_ROUTE = 0;
+        static constexpr uint16_t DEFER = 1;
+        static constexpr uint16_t FIRST_NEXT_HOP = 2;
+        static constexpr uint16_t CHUNK = 0x8000;
 
+        struct NextHop {
+            uint32_t interface;
+            Ipv4Address gateway;
+        };
+        struct Prefix {
+            uint32_t network;
+            uint8_t length;
+            uint16_t entry;
+        };
+
+        void AddPrefix(uint32_t network, uint8_t length, uint16_t entry);
+        Ptr<Ipv4Route> Resolve(Ipv4Address destination);
+
+        Ptr<Ipv4> m_ipv4;
+        std::vector<NextHop> m_nextHops;
+        std::vector<Prefix> m_prefixes;
+        std::vector<uint16_t> m_table24;
+        std::vector<uint16_t> m_chunks;
+        uint64_t m_loaded = 0;
+        double m_loadSeconds = 0;
+        double m_buildSeconds = 0;
+        uint64_t m_forwarded = 0;
+        uint64_t m_deferred = 0;
+        bool m_built = false;
+        double m_tableNanoseconds = 0;
+        double m_linearNanoseconds = 0;
 };
 
-//Constructor and destructor
-Encrypt::Encrypt() {}
-Encrypt::~Encrypt() {}
+NS_OBJECT_ENSURE_REGISTERED (Dir24Fib);
 
-TypeId Encrypt::GetTypeId (void) {
-        static TypeId tid = TypeId ("ns3::Encrypt")
-        .SetParent<Header> ()
-        .AddConstructor<Encrypt> ()
+TypeId Dir24Fib::GetTypeId (void) {
+        static TypeId tid = TypeId ("ns3::Dir24Fib")
+        .SetParent<Ipv4RoutingProtocol> ()
+        .AddConstructor<Dir24Fib> ()
         ;
         return tid;
 }
 
-void Encrypt::EncryptData(uint16_t data, uint16_t key) {
-    securePayload = data + key;
+void Dir24Fib::DoDispose (void) {
+    m_ipv4 = 0;
+    Ipv4RoutingProtocol::DoDispose();
 }
 
-class Decrypt {
+void Dir24Fib::SetIpv4 (Ptr<Ipv4> ipv4) {
+    m_ipv4 = ipv4;
+}
+
+//On the same prefix the one added last wins
+void Dir24Fib::AddPrefix(uint32_t network, uint8_t length, uint16_t entry) {
+    uint32_t mask = length == 0 ? 0 : ~0u << (32 - length);
+    m_prefixes.push_back({network & mask, length, entry});
+}
+
+//Prefixes as a.b.c.d/len at the start of a line, so the first column of a table dump
+//works as it is; whatever follows on the line is ignored, as are lines starting with #
+void Dir24Fib::LoadPrefixes(const std::string &fileName) {
+    auto wallStart = std::chrono::steady_clock::now();
+    NS_ABORT_MSG_IF(!m_ipv4, "Dir24Fib has to be added to a node before it loads prefixes");
+
+    //Every point-to-point neighbour is a next hop for the loaded prefixes
+    std::vector<uint16_t> neighbours;
+    for (uint32_t i = 0; i < m_ipv4->GetNInterfaces(); i++) {
+        Ptr<NetDevice> device = m_ipv4->GetNetDevice(i);
+        Ptr<Channel> channel = device->GetChannel();
+        if (!channel || channel->GetNDevices() != 2) {
+            continue;
+        }
+        Ptr<NetDevice> peer = channel->GetDevice(channel->GetDevice(0) == device ? 1 : 0);
+        Ptr<Ipv4> peerIpv4 = peer->GetNode()->GetObject<Ipv4>();
+        int32_t peerInterface = peerIpv4 ? peerIpv4->GetInterfaceForDevice(peer) : -1;
+        if (peerInterface < 0 || peerIpv4->GetNAddresses(peerInterface) == 0) {
+            continue;
+        }
+        neighbours.push_back(FIRST_NEXT_HOP + m_nextHops.size());
+        m_nextHops.push_back({i, peerIpv4->GetAddress(peerInterface, 0).GetLocal()});
+    }
+    NS_ABORT_MSG_IF(neighbours.empty(), "Dir24Fib found no point-to-point neighbours to forward to");
+
+    std::ifstream file(fileName);
+    NS_ABORT_MSG_IF(!file, "Cannot open prefix file " << fileName);
+    auto number = [](const char *&at, uint32_t &value) {
+        const char *start = at;
+        value = 0;
+        while (*at >= '0' && *at <= '9' && at - start < 3) {
+            value = value * 10 + (*at++ - '0');
+        }
+        return at != start;
+    };
+    std::string line;
+    uint64_t lineNumber = 0;
+    while (std::getline(file, line)) {
+        lineNumber++;
+        const char *at = line.c_str();
+        while (*at == ' ' || *at == '\t') {
+            at++;
+        }
+        if (*at == '\0' || *at == '#' || *at == '\r') {
+            continue;
+        }
+        uint32_t network = 0, value = 0;
+        bool valid = true;
+        for (uint32_t i = 0; i < 4 && valid; i++) {
+            valid = number(at, value) && value < 256 && *at++ == (i < 3 ? '.' : '/');
+            network = network << 8 | value;
+        }
+        valid = valid && number(at, value) && value <= 32 && (*at == '\0' || *at == ' ' || *at == '\t' || *at == '\r');
+        NS_ABORT_MSG_IF(!valid, "Bad prefix on line " << lineNumber << " of " << fileName << ": " << line);
+        uint32_t hash = (network ^ value) * 2654435761u;
+        AddPrefix(network, value, neighbours[(hash >> 16) % neighbours.size()]);
+        m_loaded++;
+    }
+    m_loadSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+}
+
+//The attached subnets and every destination the other protocols on the node route to
+void Dir24Fib::AddLocalPrefixes(void) {
+    for (uint32_t i = 0; i < m_ipv4->GetNInterfaces(); i++) {
+        for (uint32_t a = 0; a < m_ipv4->GetNAddresses(i); a++) {
+            Ipv4InterfaceAddress address = m_ipv4->GetAddress(i, a);
+            AddPrefix(address.GetLocal().Get(), address.GetMask().GetPrefixLength(), DEFER);
+        }
+    }
+    Ptr<Ipv4ListRouting> list = DynamicCast<Ipv4ListRouting>(m_ipv4->GetRoutingProtocol());
+    NS_ABORT_MSG_IF(!list, "Dir24Fib needs an Ipv4ListRouting next to it");
+    for (uint32_t i = 0; i < list->GetNRoutingProtocols(); i++) {
+        int16_t priority;
+        Ptr<Ipv4RoutingProtocol> protocol = list->GetRoutingProtocol(i, priority);
+        if (Ptr<Ipv4StaticRouting> table = DynamicCast<Ipv4StaticRouting>(protocol)) {
+            for (uint32_t r = 0; r < table->GetNRoutes(); r++) {
+                Ipv4RoutingTableEntry route = table->GetRoute(r);
+                AddPrefix(route.GetDest().Get(), route.GetDestNetworkMask().GetPrefixLength(), DEFER);
+            }
+        } else if (Ptr<Ipv4GlobalRouting> global = DynamicCast<Ipv4GlobalRouting>(protocol)) {
+            for (uint32_t r = 0; r < global->GetNRoutes(); r++) {
+                Ipv4RoutingTableEntry *route = global->GetRoute(r);
+                AddPrefix(route->GetDest().Get(), route->GetDestNetworkMask().GetPrefixLength(), DEFER);
+            }
+        }
+    }
+}
+
+void Dir24Fib::Build(void) {
+    auto wallStart = std::chrono::steady_clock::now();
+    std::stable_sort(m_prefixes.begin(), m_prefixes.end(), [](const Prefix &a, const Prefix &b) {
+        return a.length < b.length;
+    });
+    m_table24.assign(1u << 24, NO_ROUTE);
+    m_chunks.clear();
+    for (const Prefix &prefix : m_prefixes) {
+        if (prefix.length <= 24) {
+            auto first = m_table24.begin() + (prefix.network >> 8);
+            std::fill(first, first + (1u << (24 - prefix.length)), prefix.entry);
+            continue;
+        }
+        //The chunk starts out with what the /24 held before it was split
+        uint16_t &entry = m_table24[prefix.network >> 8];
+        if (!(entry & CHUNK)) {
+            NS_ABORT_MSG_IF(m_chunks.size() >> 8 == CHUNK, "Dir24Fib ran out of chunks for prefixes longer than /24");
+            uint16_t chunk = m_chunks.size() >> 8;
+            m_chunks.resize(m_chunks.size() + 256, entry);
+            entry = CHUNK | chunk;
+        }
+        auto first = m_chunks.begin() + ((uint32_t(entry & ~CHUNK) << 8) | (prefix.network & 0xff));
+        std::fill(first, first + (1u << (32 - prefix.length)), prefix.entry);
+    }
+    m_chunks.shrink_to_fit();
+    m_built = true;
+    m_buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+}
+
+uint16_t Dir24Fib::Lookup(uint32_t address) const {
+    uint16_t entry = m_table24[address >> 8];
+    if (entry & CHUNK) {
+        entry = m_chunks[(uint32_t(entry & ~CHUNK) << 8) | (address & 0xff)];
+    }
+    return entry;
+}
+
+//Null where the other protocols have to decide
+Ptr<Ipv4Route> Dir24Fib::Resolve(Ipv4Address destination) {
+    NS_ASSERT_MSG(m_built, "Dir24Fib::Build has not been called");
+    uint16_t entry = Lookup(destination.Get());
+    if (entry < FIRST_NEXT_HOP) {
+        m_deferred++;
+        return 0;
+    }
+    const NextHop &nextHop = m_nextHops[entry - FIRST_NEXT_HOP];
+    if (!m_ipv4->IsUp(nextHop.interface)) {
+        m_deferred++;
+        return 0;
+    }
+    Ptr<Ipv4Route> route = Create<Ipv4Route>();
+    route->SetDestination(destination);
+    route->SetGateway(nextHop.gateway);
+    route->SetSource(m_ipv4->GetAddress(nextHop.interface, 0).GetLocal());
+    route->SetOutputDevice(m_ipv4->GetNetDevice(nextHop.interface));
+    m_forwarded++;
+    return route;
+}
+
+Ptr<Ipv4Route> Dir24Fib::RouteOutput (Ptr<Packet> p, const Ipv4Header &header, Ptr<NetDevice> oif,
+                                      Socket::SocketErrno &sockerr) {
+    Ipv4Address destination = header.GetDestination();
+    Ptr<Ipv4Route> route;
+    if (!destination.IsMulticast() && !destination.IsBroadcast()) {
+        route = Resolve(destination);
+    }
+    if (route && (!oif || oif == route->GetOutputDevice())) {
+        sockerr = Socket::ERROR_NOTERROR;
+        return route;
+    }
+    sockerr = Socket::ERROR_NOROUTETOHOST;
+    return 0;
+}
+
+//Ipv4ListRouting has already delivered what is addressed to the node itself
+bool Dir24Fib::RouteInput (Ptr<const Packet> p, const Ipv4Header &header, Ptr<const NetDevice> idev,
+                           UnicastForwardCallback ucb, MulticastForwardCallback mcb,
+                           LocalDeliverCallback lcb, ErrorCallback ecb) {
+    Ipv4Address destination = header.GetDestination();
+    if (destination.IsMulticast() || destination.IsBroadcast()) {
+        return false;
+    }
+    Ptr<Ipv4Route> route = Resolve(destination);
+    if (!route) {
+        return false;
+    }
+    ucb(route, p, header);
+    return true;
+}
+
+//The table does not change; next hops on interfaces that are down are skipped per lookup
+void Dir24Fib::NotifyInterfaceUp (uint32_t interface) {}
+void Dir24Fib::NotifyInterfaceDown (uint32_t interface) {}
+void Dir24Fib::NotifyAddAddress (uint32_t interface, Ipv4InterfaceAddress address) {}
+void Dir24Fib::NotifyRemoveAddress (uint32_t interface, Ipv4InterfaceAddress address) {}
+
+//A million routes are no use on a screen, only the summary is printed
+void Dir24Fib::PrintRoutingTable (Ptr<OutputStreamWrapper> stream, Time::Unit unit) const {
+    *stream->GetStream() << "Node: " << m_ipv4->GetObject<Node>()->GetId() << ", Time: "
+                         << Simulator::Now().As(unit) << ", Dir24Fib" << std::endl;
+    PrintStats(*stream->GetStream());
+}
+
+void Dir24Fib::PrintStats(std::ostream &os) const {
+    uint64_t split = m_chunks.size() >> 8;
+    os << "  " << m_prefixes.size() << " prefixes (" << m_loaded << " loaded in " << m_loadSeconds
+       << " s), built in " << m_buildSeconds << " s" << std::endl;
+    os << "  table " << (m_table24.capacity() + m_chunks.capacity()) * sizeof(uint16_t) / 1024
+       << " KiB: " << m_table24.capacity() * sizeof(uint16_t) / 1024 << " KiB for the /24s, "
+       << split << " split into chunks of 256 (" << m_chunks.capacity() * sizeof(uint16_t) / 1024
+       << " KiB); the prefix list takes another " << m_prefixes.capacity() * sizeof(Prefix) / 1024
+       << " KiB" << std::endl;
+    os << "  forwarded " << m_forwarded << " packets, left " << m_deferred
+       << " to the static and global routing" << std::endl;
+    if (m_tableNanoseconds > 0) {
+        os << "  lookup " << m_tableNanoseconds << " ns, against " << m_linearNanoseconds / 1000
+           << " us for a linear search of the prefixes" << std::endl;
+    }
+}
+
+//The lookup cost is measured here rather than in the simulation, on random addresses
+//inside the table's own prefixes, and against the linear search over the same
+//prefixes that Ipv4StaticRouting does
+void Dir24Fib::MeasureLookup(void) {
+    if (m_prefixes.empty()) {
+        return;
+    }
+
+    std::vector<uint32_t> addresses(1 << 20);
+    uint32_t state = 2463534242u;
+    for (uint32_t &address : addresses) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        const Prefix &prefix = m_prefixes[state % m_prefixes.size()];
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        address = prefix.network | (prefix.length == 0 ? state : state & ~(~0u << (32 - prefix.length)));
+    }
+    uint32_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t round = 0; round < 8; round++) {
+        for (uint32_t address : addresses) {
+            sum += Lookup(address);
+        }
+    }
+    m_tableNanoseconds = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count()
+        / (8.0 * addresses.size());
+
+    //Longest match over the whole list, stopped after a tenth of a second
+    uint32_t linearLookups = 0;
+    start = std::chrono::steady_clock::now();
+    double linearNanoseconds = 0;
+    while (linearLookups < addresses.size() && linearNanoseconds < 1e8) {
+        uint32_t address = addresses[linearLookups++];
+        int32_t longest = -1;
+        uint16_t entry = NO_ROUTE;
+        for (const Prefix &prefix : m_prefixes) {
+            uint32_t mask = prefix.length == 0 ? 0 : ~0u << (32 - prefix.length);
+            if ((address & mask) == prefix.network && prefix.length > longest) {
+                longest = prefix.length;
+                entry = prefix.entry;
+            }
+        }
+        sum += entry;
+        linearNanoseconds = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    }
+    volatile uint32_t keep = sum;
+    (void) keep;
+    m_linearNanoseconds = linearNanoseconds / linearLookups;
+}
+
+/*
+ * SECTION 16:
+ * Parallel execution over MPI. An optimistic (Time Warp) engine would need to roll back
+ * any node, queue, socket or TCP state to an earlier time, and no ns-3 model can save
+ * or restore its state, so the scenario runs conservatively instead, with ns-3's
+ * null-message engine. The cuts go through the transit links only: LAN #1 with r0 on
+ * the first rank, LAN #2 with r2 on the last one, and r1 (with r3) on a rank of its own
+ * when there are three. Every rank builds the whole scenario, but applications and
+ * chaff only run on the nodes the rank owns (replay is not split). The CSMA LANs, whose
+ * lookahead is poor, stay in one piece; the lookahead between the ranks is the delay of
+ * the transit links, 2 ms on the main path and 5 ms on the backup path.
+ */
+
+struct Partition {
+    uint32_t rank;
+    uint32_t ranks;
+    uint32_t lan1;      //LAN #1 and r0
+    uint32_t transit;   //r1 and r3
+    uint32_t lan2;      //LAN #2 and r2
+};
+
+//With mpi false everything is on rank 0 of 1 and nothing else changes
+static Partition StartParallel(bool mpi, int *argc, char ***argv) {
+    Partition partition = {0, 1, 0, 0, 0};
+    if (!mpi) {
+        return partition;
+    }
+#ifdef NS3_MPI
+    GlobalValue::Bind("SimulatorImplementationType", StringValue("ns3::NullMessageSimulatorImpl"));
+    MpiInterface::Enable(argc, argv);
+    partition.rank = MpiInterface::GetSystemId();
+    partition.ranks = MpiInterface::GetSize();
+#else
+    NS_FATAL_ERROR("--mpi needs an ns-3 configured with --enable-mpi");
+#endif
+    NS_ABORT_MSG_IF(partition.ranks > 3, "The scenario splits into at most 3 ranks, not " << partition.ranks);
+    partition.lan2 = partition.ranks - 1;
+    partition.transit = partition.ranks == 3 ? 1 : 0;
+    return partition;
+}
+
+static bool IsLocal(const Partition &partition, Ptr<Node> node) {
+    return node->GetSystemId() == partition.rank;
+}
+
+//Every rank prints its own report, in rank order, then rank 0 puts the slowest rank
+//against the sequential time
+static void PrintParallelStats(const Partition &partition, const std::string &report, uint64_t events,
+                               double wallSeconds, double sequentialSeconds, std::ostream &os) {
+#ifdef NS3_MPI
+    for (uint32_t rank = 0; rank < partition.ranks; rank++) {
+        if (rank == partition.rank) {
+            os << "Rank " << rank << " of " << partition.ranks << ":" << std::endl << report << std::flush;
+        }
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
+    uint64_t totalEvents = 0;
+    double slowest = 0;
+    MPI_Allreduce(&events, &totalEvents, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&wallSeconds, &slowest, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    if (partition.rank != 0) {
+        return;
+    }
+    os << "Parallel run on " << partition.ranks << " ranks: " << totalEvents << " events in " << slowest
+       << " s (" << totalEvents / std::max(slowest, 1e-9) << " events/s)";
+    if (sequentialSeconds > 0) {
+        os << ", speedup " << sequentialSeconds / std::max(slowest, 1e-9) << " over " << sequentialSeconds
+           << " s sequential";
+    }
+    os << std::endl;
+#endif
+}
+
+static void StopParallel(void) {
+#ifdef NS3_MPI
+    if (MpiInterface::IsEnabled()) {
+        MpiInterface::Disable();
+    }
+#endif
+}
+
+/*
+ * SECTION 17:
+ * Same-timestamp batching in the event queue. Much of this scenario happens at the same
+ * instant: a CSMA frame reaches every device of the LAN at once, CBR and train sources
+ * tick together, the samplers fire along with the traffic. BatchingScheduler takes all
+ * events of the next timestamp out of the map in one go and measures what running them
+ * grouped by node would change, so the handlers of one node (its devices, stack and
+ * applications) would run back to back and find its state still in the cache. Events
+ * of no node (scheduled from main, such as the samplers and the route manager) may look
+ * at any node, so the grouping never moves anything across them.
+ *
+ * The batch is still handed out in ns-3's order. The simulator takes an event of the
+ * current timestamp to be expired once an event with a higher uid has run, and checks
+ * that before it cancels or removes an event. Run out of uid order, an event that
+ * already ran would count as pending again, and removing it would release it twice;
+ * a pending one would count as run, and cancelling it would be ignored. The uids are
+ * given out when an event is scheduled, long before its batch is known, so there is no
+ * order to hand them out in that would keep that check right. --eventBatching thus
+ * reports how large the batches are and how many events grouping would move, which is
+ * what a scheduler with per-node queues could gain, without changing the run.
+ */
+
+struct BatchingCounters {
+    //Batches of 1, 2, 3-4, 5-8, ... events, the last class holds everything larger
+    static constexpr uint32_t SIZE_CLASSES = 17;
+
+    uint64_t batches;
+    uint64_t events;
+    uint64_t moved;
+    uint64_t largest;
+    uint64_t batchesOfSize[SIZE_CLASSES];
+    uint64_t eventsInSize[SIZE_CLASSES];
+};
+
+static BatchingCounters g_batching;
+
+//Takes the map of AccountedMapScheduler, so --memoryReport still charges it to events
+class BatchingScheduler : public AccountedMapScheduler {
     public:
-        Decrypt();
-        virtual ~Decrypt();
-        void DecryptData (uint128_t securePayload);
         static TypeId GetTypeId (void);
+        virtual bool IsEmpty (void) const;
+        virtual Scheduler::Event PeekNext (void) const;
+        virtual Scheduler::Event RemoveNext (void);
+        virtual void Remove (const Scheduler::Event &ev);
     private:
-        u_int16_t key = 123;
-        u_int16_t data;
-};
+        void TakeBatch(void);
 
-//Constructor and destructor
-Decrypt::Decrypt() {}
-Decrypt::~Decrypt() {}
+        std::vector<Scheduler::Event> m_batch;
+        std::size_t m_next = 0;
+        //(node, uid) of the batch, sorted into the grouped order for the counters
+        std::vector<std::pair<uint32_t, uint32_t>> m_grouped;
+};
 
-TypeId Decrypt::GetTypeId (void) {
-        static TypeId tid = TypeId ("ns3::Decrypt")
-        .SetParent<Header> ()
-        .AddConstructor<Decrypt> ()
+TypeId BatchingScheduler::GetTypeId (void) {
+        static TypeId tid = TypeId ("ns3::BatchingScheduler")
+        .SetParent<AccountedMapScheduler> ()
+        .AddConstructor<BatchingScheduler> ()
         ;
         return tid;
 }
 
-uint16_t Decrypt::DecryptData(void) const {
-    return securePayload - key;
+bool BatchingScheduler::IsEmpty (void) const {
+    return m_next == m_batch.size() && MapScheduler::IsEmpty();
+}
+
+//Between batches the head of the map is the first event of the next batch, the one
+//RemoveNext hands out next, since the batch keeps the order of the map
+Scheduler::Event BatchingScheduler::PeekNext (void) const {
+    if (m_next < m_batch.size()) {
+        return m_batch[m_next];
+    }
+    return MapScheduler::PeekNext();
+}
+
+Scheduler::Event BatchingScheduler::RemoveNext (void) {
+    if (m_next == m_batch.size()) {
+        TakeBatch();
+    }
+    return m_batch[m_next++];
+}
+
+//The simulator only removes events it takes to be pending, which in uid order are
+//exactly the ones not handed out yet
+void BatchingScheduler::Remove (const Scheduler::Event &ev) {
+    for (std::size_t i = 0; i < m_batch.size(); i++) {
+        if (m_batch[i].key.m_uid == ev.key.m_uid) {
+            NS_ABORT_MSG_IF(i < m_next, "BatchingScheduler: removing event " << ev.key.m_uid << " after it ran");
+            m_batch.erase(m_batch.begin() + i);
+            return;
+        }
+    }
+    MapScheduler::Remove(ev);
+}
+
+void BatchingScheduler::TakeBatch(void) {
+    m_batch.clear();
+    m_next = 0;
+    uint64_t timestamp = MapScheduler::PeekNext().key.m_ts;
+    while (!MapScheduler::IsEmpty() && MapScheduler::PeekNext().key.m_ts == timestamp) {
+        m_batch.push_back(MapScheduler::RemoveNext());
+    }
+
+    //Grouped by node between the events of no node, only to count what would move
+    m_grouped.clear();
+    for (const Scheduler::Event &event : m_batch) {
+        m_grouped.emplace_back(event.key.m_context, event.key.m_uid);
+    }
+    auto noNode = [](const std::pair<uint32_t, uint32_t> &event) { return event.first == Simulator::NO_CONTEXT; };
+    for (auto begin = m_grouped.begin(); begin != m_grouped.end(); ) {
+        auto end = std::find_if(begin, m_grouped.end(), noNode);
+        std::sort(begin, end);
+        begin = end == m_grouped.end() ? end : end + 1;
+    }
+
+    uint64_t size = m_batch.size();
+    uint32_t sizeClass = size == 1 ? 0 : 64 - __builtin_clzll(size - 1);
+    sizeClass = std::min(sizeClass, BatchingCounters::SIZE_CLASSES - 1);
+    g_batching.batches++;
+    g_batching.events += size;
+    g_batching.largest = std::max(g_batching.largest, size);
+    g_batching.batchesOfSize[sizeClass]++;
+    g_batching.eventsInSize[sizeClass] += size;
+    uint32_t highestUid = 0;
+    for (const std::pair<uint32_t, uint32_t> &event : m_grouped) {
+        g_batching.moved += event.second < highestUid;
+        highestUid = std::max(highestUid, event.second);
+    }
+}
+
+static void PrintBatchingStats(std::ostream &os) {
+    const BatchingCounters &counters = g_batching;
+    if (counters.batches == 0) {
+        return;
+    }
+    os << "  " << counters.events << " events in " << counters.batches << " batches, "
+       << double(counters.events) / counters.batches << " per batch, largest " << counters.largest
+       << "; grouped by node, " << counters.moved << " events would run ahead of an earlier one of another node"
+       << std::endl;
+    for (uint32_t sizeClass = 0; sizeClass < BatchingCounters::SIZE_CLASSES; sizeClass++) {
+        if (counters.batchesOfSize[sizeClass] == 0) {
+            continue;
+        }
+        uint64_t low = sizeClass < 2 ? sizeClass + 1 : (1ull << (sizeClass - 1)) + 1;
+        std::ostringstream sizes;
+        sizes << low;
+        if (sizeClass == BatchingCounters::SIZE_CLASSES - 1) {
+            sizes << "+";
+        } else if (sizeClass >= 2) {
+            sizes << "-" << (1ull << sizeClass);
+        }
+        os << "    " << std::setw(12) << sizes.str() << ": " << std::setw(10) << counters.batchesOfSize[sizeClass]
+           << " batches, " << 100.0 * counters.eventsInSize[sizeClass] / counters.events << "% of the events"
+           << std::endl;
+    }
+}
+
+/*
+ * SECTION 18:
+ * Build profile. In the debug and default build profiles ns-3 defines NS3_LOG_ENABLE and
+ * NS3_ASSERT_ENABLE, so every NS_LOG statement on the hot paths (CSMA, point-to-point,
+ * IPv4, UDP, the applications) is still a test of its component's level and every
+ * NS_LOG_FUNCTION a test as well, even with no logging enabled. The optimized profile
+ * already compiles both out of ns-3 and of this program, so there is no build profile
+ * of our own for logging.
+ *
+ * Unconnected trace sources are not compiled out. A source is connected by name while
+ * the program runs, and this program connects some (the sniffers of the ARP monitor and
+ * the leak detector, the echo probe, pcap and ascii tracing), so no compile-time switch
+ * can tell which ones to drop. An unconnected source costs the test of an empty callback
+ * list once it is inlined. The exception is the IPv4 Tx source, which copies the packet
+ * and serializes its header before it looks for sinks. patches/quiet-trace-sources.patch
+ * makes that copy only when a sink is connected. --tracing=0 is needed for either to
+ * matter, since pcap and ascii tracing connect a sink to most sources.
+ *
+ * No before/after figures come with this. To get them, from the ns-3 root:
+ *     ./ns3 configure --build-profile=default --disable-examples --disable-tests
+ *     ./ns3 run "vpn2 --tracing=0 --lanSize=32 --rpcClients=24 --cbrRate=40Mbps"
+ *     patch -p1 < quiet-trace-sources.patch
+ *     ./ns3 configure --build-profile=optimized --disable-examples --disable-tests
+ *     ./ns3 run "vpn2 --tracing=0 --lanSize=32 --rpcClients=24 --cbrRate=40Mbps"
+ * and compare the events/s lines. Each is followed by a "Build:" line saying what the
+ * program was built with, so runs from two builds can be told apart.
+ *
+ * scripts/pgo-lto-build.sh goes one step further: it profiles a scaled run of this
+ * program, rebuilds it and the ns-3 modules it uses statically with the profile and
+ * link-time optimization, so calls into the models can be inlined across modules, and
+ * prints the events/s of that build next to the plain optimized one.
+ */
+
+static void PrintBuildProfile(std::ostream &os) {
+    os << "Build: logging "
+#ifdef NS3_LOG_ENABLE
+       << "compiled in"
+#else
+       << "compiled out"
+#endif
+       << ", asserts "
+#ifdef NS3_ASSERT_ENABLE
+       << "compiled in"
+#else
+       << "compiled out"
+#endif
+#ifndef __OPTIMIZE__
+       << ", not optimized"
+#endif
+#ifdef VPN2_SMALL_OBJECT_POOL
+       << ", small object pool"
+#endif
+#ifdef VPN2_MEMORY_ACCOUNTING
+       << ", memory accounting"
+#endif
+       << std::endl;
 }
 
 int main (int argc, char *argv[]) {
 
+    //Bulk TCP transfer from n1 to n4 (off by default), optionally using super-packets
+    uint64_t bulkBytes = 0;
+    bool gso = false;
+    uint32_t gsoSize = 60000;
+    bool groToLan = false;
+
+    //Constant bit rate load from r0 to r2 (off by default), optionally sent as packet trains
+    std::string cbrRate = "";
+    bool trains = false;
+    uint16_t trainLength = 16;
+    bool tracing = true;
+
+    //Fluid cross traffic on r1's outgoing links (off by default)
+    double crossLoad = 0;
+    Time crossOnTime = MilliSeconds(100);
+    Time crossOffTime = MilliSeconds(100);
+
+    //Second, slower path r0-r3-r2 and scheduled failures in the transit path
+    bool backupPath = false;
+    std::string failures = "";
+    Time detectDelay = MilliSeconds(50);
+
+    //Errors on the transit links (off by default): none, rate, gilbert or trace
+    std::string errorModel = "none";
+    double errorRate = 0.001;
+    double geGoodToBad = 0.01;
+    double geBadToGood = 0.3;
+    double geGoodLoss = 0;
+    double geBadLoss = 0.5;
+    std::string errorTrace = "";
+    bool corrupt = true;
+
+    //Replications forked after setup (off by default), RngRun picks the first seed
+    uint32_t forkRuns = 0;
+    uint32_t forkJobs = std::max<long>(1, sysconf(_SC_NPROCESSORS_ONLN));
+
+    //Hosts per LAN, and snapshots of the built topology (see SECTION 9)
+    uint32_t lanSize = 3;
+    std::string saveSnapshot = "";
+    std::string loadSnapshot = "";
+
+    //Permanent ARP entries written at build time (see SECTION 10)
+    bool staticArp = false;
+    bool noArp = false;
+    bool switchedLan = false;
+    bool csmaFilter = false;
+
+    //Protection of the tunnel: esp, esp-null or ah, and fnv, hmac-sha256 or gmac
+    //(empty picks fnv for esp and hmac-sha256 otherwise)
+    std::string ipsecMode = "esp";
+    std::string integrity = "";
+    bool ipsecBench = false;
+    //Per-packet protection and policy cost in the gateway report (off by default, see SECTION 4)
+    bool gatewayTiming = false;
+
+    //Memory per subsystem (see SECTION 11), at the end and at the listed times in seconds
+    bool memoryReport = false;
+    std::string memoryReportAt = "";
+
+    //RPC load through the tunnel instead of the single echo (off by default, see SECTION 6)
+    uint32_t rpcClients = 0;
+    uint32_t rpcConcurrency = 1;
+    double rpcRate = 0;
+    std::string rpcRequestSize = "ns3::ConstantRandomVariable[Constant=200]";
+    std::string rpcResponseSize = "ns3::ExponentialRandomVariable[Mean=1000|Bound=60000]";
+
+    //Padding and chaff against traffic analysis (off by default, see SECTION 4). A full
+    //transit frame is always the largest bucket
+    bool padding = false;
+    std::string padBuckets = "256,768";
+    std::string chaffRate = "";
+
+    //Security policies on the gateways ahead of the catch-all, and the flow cache in
+    //front of them (off by default, see SECTION 4)
+    uint32_t spdPolicies = 0;
+    uint32_t flowCache = 0;
+
+    //Captured traffic replayed between the LAN hosts (off by default, see SECTION 13)
+    std::string replay = "";
+    double replaySpeed = 1;
+    Time replayStart = Seconds(2);
+
+    //Scan everything the transit routers forward for plaintext (off by default, see SECTION 14)
+    bool leakCheck = false;
+    std::string leakMarkers = "";
+
+    //Prefixes r1 forwards with a DIR-24-8 table, e.g. a full Internet table (off by
+    //default, see SECTION 15)
+    std::string fibPrefixes = "";
+
+    //Conservative parallel run over up to 3 MPI ranks (off by default, see SECTION 16),
+    //and the wall time of the same scenario run sequentially to compare against
+    bool mpi = false;
+    double sequentialSeconds = 0;
+
+    //Take the events of one timestamp as a batch and measure grouping them by node (off by default, see SECTION 17)
+    bool eventBatching = false;
+
+    //Time series of the queues and links (off by default, see SECTION 12)
+    Time sampleInterval = Seconds(0);
+    uint32_t sampleCapacity = 4096;
+    std::string sampleFile = "samples.csv";
+
+    CommandLine cmd (__FILE__);
+    cmd.AddValue("bulkBytes", "Bytes n1 sends to n4 over TCP (0 disables the bulk flow)", bulkBytes);
+    cmd.AddValue("gso", "Hand super-packets to r0 and segment them only on the transit links", gso);
+    cmd.AddValue("gsoSize", "Size of a super-packet in bytes", gsoSize);
+    cmd.AddValue("groToLan", "Keep super-packets coalesced from r2 into LAN #2", groToLan);
+    cmd.AddValue("cbrRate", "Rate of the CBR load from r0 to r2, e.g. 40Mbps (empty disables it)", cbrRate);
+    cmd.AddValue("trains", "Send the CBR load as packet trains", trains);
+    cmd.AddValue("trainLength", "Packets per train", trainLength);
+    cmd.AddValue("tracing", "Write vpn.tr and the pcap files (forces trains to expand)", tracing);
+    cmd.AddValue("crossLoad", "Mean load of the cross traffic on r1 as a fraction of the link rate", crossLoad);
+    cmd.AddValue("crossOnTime", "Mean length of a cross traffic burst", crossOnTime);
+    cmd.AddValue("crossOffTime", "Mean pause between cross traffic bursts", crossOffTime);
+    cmd.AddValue("backupPath", "Add a second path between the LANs through r3", backupPath);
+    cmd.AddValue("failures", "Failures as name:down:up in seconds, e.g. link2:5:8,r1:12:14 "
+                 "(links: link1, link2, backup1, backup2; routers: r0-r3)", failures);
+    cmd.AddValue("detectDelay", "Time until routes react to a failure or repair", detectDelay);
+    cmd.AddValue("errorModel", "Errors on the transit links: none, rate, gilbert or trace", errorModel);
+    cmd.AddValue("errorRate", "Per-packet error probability of the rate model", errorRate);
+    cmd.AddValue("geGoodToBad", "Gilbert-Elliott probability of entering the bad state", geGoodToBad);
+    cmd.AddValue("geBadToGood", "Gilbert-Elliott probability of leaving the bad state", geBadToGood);
+    cmd.AddValue("geGoodLoss", "Gilbert-Elliott error probability in the good state", geGoodLoss);
+    cmd.AddValue("geBadLoss", "Gilbert-Elliott error probability in the bad state", geBadLoss);
+    cmd.AddValue("errorTrace", "File of 0/1 per packet for the trace model", errorTrace);
+    cmd.AddValue("corrupt", "Deliver errored frames with a flipped byte instead of dropping them", corrupt);
+    cmd.AddValue("forkRuns", "Build the scenario once and fork this many runs with different seeds "
+                 "(turns tracing off)", forkRuns);
+    cmd.AddValue("forkJobs", "Forked runs executing at the same time", forkJobs);
+    cmd.AddValue("lanSize", "Hosts in each LAN besides the router (at least 3)", lanSize);
+    cmd.AddValue("saveSnapshot", "Write the addresses, routes and SAs of the built topology to this file", saveSnapshot);
+    cmd.AddValue("loadSnapshot", "Take addresses, routes and SAs from this file instead of computing them", loadSnapshot);
+    cmd.AddValue("staticArp", "Pre-populate the ARP caches between every LAN router and its hosts", staticArp);
+    cmd.AddValue("noArp", "Pre-populate the ARP caches between all LAN members, so no ARP is sent at all", noArp);
+    cmd.AddValue("switchedLan", "Connect the LAN members through a learning switch instead of one shared channel",
+                 switchedLan);
+    cmd.AddValue("csmaFilter", "Let the LAN channels deliver unicast frames only to their destination "
+                 "(needs patches/csma-unicast-filter.patch)", csmaFilter);
+    cmd.AddValue("ipsecMode", "Tunnel protection: esp, esp-null (integrity only) or ah", ipsecMode);
+    cmd.AddValue("integrity", "ICV algorithm: fnv, hmac-sha256 or gmac", integrity);
+    cmd.AddValue("ipsecBench", "Print the per-packet cost of every protection mode and exit", ipsecBench);
+    cmd.AddValue("gatewayTiming", "Time protection, verification and policy lookups of every tunnelled packet "
+                 "on the wall clock", gatewayTiming);
+    cmd.AddValue("memoryReport", "Print the memory used by each subsystem around Simulator::Destroy", memoryReport);
+    cmd.AddValue("memoryReportAt", "Also print it at these simulation times in seconds, e.g. 2,5,10", memoryReportAt);
+    cmd.AddValue("rpcClients", "RPC clients spread over the hosts of LAN #2, replacing the echo (0 keeps it)", rpcClients);
+    cmd.AddValue("rpcConcurrency", "Outstanding requests per RPC client in closed loop", rpcConcurrency);
+    cmd.AddValue("rpcRate", "Poisson requests per second per RPC client (0 runs closed loop)", rpcRate);
+    cmd.AddValue("rpcRequestSize", "Random variable for the request sizes in bytes", rpcRequestSize);
+    cmd.AddValue("rpcResponseSize", "Random variable for the response sizes in bytes", rpcResponseSize);
+    cmd.AddValue("padding", "Pad the tunnelled packets up to the next size bucket", padding);
+    cmd.AddValue("padBuckets", "Padding buckets in bytes below the tunnel MTU, e.g. 256,768", padBuckets);
+    cmd.AddValue("chaffRate", "Send one full-size packet at this constant rate, real or chaff "
+                 "(implies --padding)", chaffRate);
+    cmd.AddValue("spdPolicies", "Per-service security policies on each gateway ahead of the catch-all", spdPolicies);
+    cmd.AddValue("flowCache", "Entries of the flow cache in front of the security policies (0 disables it)",
+                 flowCache);
+    cmd.AddValue("replay", "pcap or pcapng file whose IPv4 packets are replayed between the LAN hosts", replay);
+    cmd.AddValue("replaySpeed", "Speed-up of the replay over the recorded timestamps", replaySpeed);
+    cmd.AddValue("replayStart", "Time the first replayed packet is sent", replayStart);
+    cmd.AddValue("leakCheck", "Scan every frame on r1 (and r3) for plaintext markers", leakCheck);
+    cmd.AddValue("leakMarkers", "Comma-separated markers to scan for besides the echo fill", leakMarkers);
+    cmd.AddValue("fibPrefixes", "File of a.b.c.d/len prefixes r1 forwards with a DIR-24-8 table", fibPrefixes);
+    cmd.AddValue("mpi", "Split the scenario over the MPI ranks at the transit links (mpirun -np 2 or 3)", mpi);
+    cmd.AddValue("sequentialSeconds", "Wall seconds of the same run without --mpi, for the speedup", sequentialSeconds);
+    cmd.AddValue("eventBatching", "Take the events of a timestamp as one batch and count what grouping them "
+                 "by node would move", eventBatching);
+    cmd.AddValue("sampleInterval", "Sample the queues and links this often, e.g. 10ms (0 disables it)", sampleInterval);
+    cmd.AddValue("sampleCapacity", "Samples kept, the oldest are overwritten beyond that", sampleCapacity);
+    cmd.AddValue("sampleFile", "CSV file the samples are written to after the run", sampleFile);
+    cmd.Parse(argc, argv);
+    NS_ABORT_MSG_IF(lanSize < 3, "--lanSize must be at least 3");
+    if (ipsecBench) {
+        BenchmarkProtection(std::cout);
+        return 0;
+    }
+    //Before anything creates the simulator, which is a different one in --mpi mode
+    Partition partition = StartParallel(mpi, &argc, &argv);
+    if (mpi) {
+        NS_ABORT_MSG_IF(forkRuns > 0, "--mpi and --forkRuns cannot be combined");
+        NS_ABORT_MSG_IF(!replay.empty(), "--replay sends from both LANs and cannot run with --mpi");
+        //Every rank would write the same trace files
+        tracing = false;
+    }
+    NS_ABORT_MSG_IF(ipsecMode != "esp" && ipsecMode != "esp-null" && ipsecMode != "ah",
+                    "Unknown --ipsecMode " << ipsecMode);
+    IpsecMode mode = ipsecMode == "ah" ? IPSEC_AH : ipsecMode == "esp-null" ? IPSEC_ESP_NULL : IPSEC_ESP;
+    if (integrity.empty()) {
+        integrity = mode == IPSEC_ESP ? "fnv" : "hmac-sha256";
+    }
+    NS_ABORT_MSG_IF(integrity != "fnv" && integrity != "hmac-sha256" && integrity != "gmac",
+                    "Unknown --integrity " << integrity);
+    IntegrityAlgorithm integrityAlgorithm = integrity == "gmac" ? INTEGRITY_GMAC
+        : integrity == "hmac-sha256" ? INTEGRITY_HMAC_SHA256 : INTEGRITY_FNV;
+    uint16_t tunnelOverhead = TunnelOverhead(mode, integrityAlgorithm);
+    Config::SetDefault("ns3::OffloadPointToPointNetDevice::SegmentOverhead", UintegerValue(tunnelOverhead));
+    if (memoryReport || !memoryReportAt.empty() || eventBatching) {
+        ObjectFactory scheduler;
+        scheduler.SetTypeId(eventBatching ? BatchingScheduler::GetTypeId() : AccountedMapScheduler::GetTypeId());
+        Simulator::SetScheduler(scheduler);
+    }
+    auto setupStart = std::chrono::steady_clock::now();
+    if (forkRuns > 0) {
+        //The children would all write the same trace files
+        tracing = false;
+        forkJobs = std::max<uint32_t>(forkJobs, 1);
+    }
+    NS_ABORT_MSG_IF(gso && gsoSize + tunnelOverhead > 65535, "--gsoSize does not fit in an IPv4 packet");
+
+    //The transit links never put more than 1500 bytes on the wire, but in --gso mode
+    //everything in front of them has to accept whole super-packets
+    uint16_t transitMtu = 1500;
+    uint16_t superMtu = gso ? gsoSize + tunnelOverhead : transitMtu;
+    if (gso) {
+        Config::SetDefault("ns3::TcpSocket::SegmentSize", UintegerValue(gsoSize - 60));
+    }
+
     /*
      * SECTION 1:
      * Creating the two networks and the routers connecting them
      * structurally to one another, governing which connect to which
      */
 
+    SetMemoryTag(MEM_NODES);
     NodeContainer network1, network2, routers;
 
-    //Initialize each of the 3 "networks" as having 3 nodes (see above diagram)
-    network1.Create(3);
-    network2.Create(3);
-    routers.Create(3);
+    //Initialize each of the 3 "networks" as having 3 nodes (see above diagram),
+    //or --lanSize hosts per LAN
+    network1.Create(lanSize, partition.lan1);
+    network2.Create(lanSize, partition.lan2);
+    routers.Create(1, partition.lan1);
+    routers.Create(1, partition.transit);
+    routers.Create(1, partition.lan2);
+    SetMemoryTag(MEM_DEVICES);
 
     //Using a Carrier-sense multiple access (CSMA) protocol for the subnets 1 & 2
     CsmaHelper lanCSMA;
@@ -147,6 +6279,29 @@ int main (int argc, char *argv[]) {
     lanCSMA.SetChannelAttribute("DataRate", StringValue("100Mbps"));
     lanCSMA.SetChannelAttribute("Delay", TimeValue (MilliSeconds (2)));
 
+    //A stock CsmaChannel schedules a receive event on every device for every frame. The
+    //patched one (patches/csma-unicast-filter.patch) can skip the devices a unicast frame
+    //is not addressed to; without the patch the attribute does not exist
+    if (csmaFilter) {
+        TypeId::AttributeInformation unicastFilter;
+        if (CsmaChannel::GetTypeId().LookupAttributeByName("UnicastFilter", &unicastFilter)) {
+            lanCSMA.SetChannelAttribute("UnicastFilter", BooleanValue(true));
+        } else {
+            std::cerr << "--csmaFilter: this ns-3 has no CsmaChannel::UnicastFilter, "
+                      << "apply patches/csma-unicast-filter.patch; delivering every frame to every device" << std::endl;
+        }
+    }
+
+    //A switched LAN has two links between any two members, each with half the delay
+    NodeContainer switches;
+    NetDeviceContainer switchPorts;
+    if (switchedLan) {
+        MemoryScope nodes(MEM_NODES);
+        switches.Create(1, partition.lan1);
+        switches.Create(1, partition.lan2);
+        lanCSMA.SetChannelAttribute("Delay", TimeValue (MilliSeconds (1)));
+    }
+
     //Adding the routers on each end into their respective LANs
     network1.Add(routers.Get(0));
     network2.Add(routers.Get(2));
@@ -156,23 +6311,113 @@ int main (int argc, char *argv[]) {
 
     //From the Network Topology above:
     //lan1 is comprised of the set {n0, n1, n2, r0}
-    lan1 = lanCSMA.Install(network1);
+    if (gso) {
+        lanCSMA.SetDeviceAttribute("Mtu", UintegerValue(gsoSize));
+    }
+    lan1 = switchedLan ? InstallSwitchedLan(lanCSMA, network1, switches.Get(0), switchPorts)
+                       : lanCSMA.Install(network1);
     //lan2 is comprised of the set {n3, n4, n5, r2}
-    lan2 = lanCSMA.Install(network2);
+    if (gso && !groToLan) {
+        //r2 then fragments the super-packets back into 1500 byte datagrams
+        lanCSMA.SetDeviceAttribute("Mtu", UintegerValue(1500));
+    }
+    lan2 = switchedLan ? InstallSwitchedLan(lanCSMA, network2, switches.Get(1), switchPorts)
+                       : lanCSMA.Install(network2);
 
-    //Using Point-to-Point for the routers that are linking the two subnets
+    //Using Point-to-Point for the routers that are linking the two subnets.
+    //The devices are OffloadPointToPointNetDevices (see SECTION 5), which behave
+    //exactly like the stock ones unless they are handed super-packets
     PointToPointHelper pointToPoint;
-
-    pointToPoint.SetDeviceAttribute("DataRate", StringValue("30Mbps"));
-    pointToPoint.SetChannelAttribute("Delay", TimeValue(MilliSeconds(2)));
+    std::string transitRate = "30Mbps";
+    Time transitDelay = MilliSeconds(2);
     
     //Installing the LANs with their data transmission stats
     NetDeviceContainer link1, link2;
 
+    //Trains are queued whole, so the queues count bytes to account for every packet
+    //of a train (100 full frames, same as the default 100 packets)
+    QueueSize transitQueue = trains ? QueueSize("150000B") : QueueSize("100p");
+
     //link1 is comprised of the router from LAN1 and the "linking router", {r0, r1}
-    link1 = pointToPoint.Install(routers.Get(0), routers.Get(1));
+    link1 = InstallTransitLink(routers.Get(0), routers.Get(1), transitRate, transitDelay, superMtu, transitQueue);
     //link2 is comprised of the router from LAN2 and the "linking router", {r1, r2}
-    link2 = pointToPoint.Install(routers.Get(1), routers.Get(2));
+    link2 = InstallTransitLink(routers.Get(1), routers.Get(2), transitRate, transitDelay, superMtu, transitQueue);
+
+    //The optional backup path {r0, r3, r2} is slower, and its links get a higher
+    //metric below so that it only carries traffic once the main path fails
+    NodeContainer backupRouter;
+    NetDeviceContainer backupLink1, backupLink2;
+    if (backupPath) {
+        SetMemoryTag(MEM_NODES);
+        backupRouter.Create(1, partition.transit);
+        SetMemoryTag(MEM_DEVICES);
+        backupLink1 = InstallTransitLink(routers.Get(0), backupRouter.Get(0), transitRate, MilliSeconds(5),
+                                         superMtu, transitQueue);
+        backupLink2 = InstallTransitLink(backupRouter.Get(0), routers.Get(2), transitRate, MilliSeconds(5),
+                                         superMtu, transitQueue);
+    }
+
+    if (tracing) {
+        Config::Set("/NodeList/*/DeviceList/*/$ns3::OffloadPointToPointNetDevice/ExpandTrains", BooleanValue(true));
+    }
+
+    //Everything that owns random variables registers here, so that the streams can be
+    //assigned again in every forked run (see SECTION 8)
+    std::vector<std::function<int64_t(int64_t)> > streamUsers;
+
+    //Every transit device gets its own error model, so both directions see errors
+    NS_ABORT_MSG_IF(errorModel != "none" && errorModel != "rate" && errorModel != "gilbert" && errorModel != "trace",
+                    "Unknown --errorModel " << errorModel);
+    NS_ABORT_MSG_IF(errorModel == "trace" && errorTrace.empty(), "--errorModel=trace needs --errorTrace");
+    if (errorModel != "none") {
+        for (NetDeviceContainer link : {link1, link2, backupLink1, backupLink2}) {
+            for (uint32_t i = 0; i < link.GetN(); i++) {
+                Ptr<ErrorModel> model;
+                if (errorModel == "rate") {
+                    Ptr<RateErrorModel> rate = CreateObject<RateErrorModel>();
+                    rate->SetUnit(RateErrorModel::ERROR_UNIT_PACKET);
+                    rate->SetRate(errorRate);
+                    streamUsers.push_back([rate](int64_t stream) { return rate->AssignStreams(stream); });
+                    model = rate;
+                } else if (errorModel == "gilbert") {
+                    Ptr<GilbertElliottErrorModel> gilbert = CreateObject<GilbertElliottErrorModel>();
+                    gilbert->SetAttribute("GoodToBad", DoubleValue(geGoodToBad));
+                    gilbert->SetAttribute("BadToGood", DoubleValue(geBadToGood));
+                    gilbert->SetAttribute("GoodLoss", DoubleValue(geGoodLoss));
+                    gilbert->SetAttribute("BadLoss", DoubleValue(geBadLoss));
+                    streamUsers.push_back([gilbert](int64_t stream) { return gilbert->AssignStreams(stream); });
+                    model = gilbert;
+                } else {
+                    Ptr<TraceErrorModel> trace = CreateObject<TraceErrorModel>();
+                    trace->LoadTrace(errorTrace);
+                    model = trace;
+                }
+
+                Ptr<OffloadPointToPointNetDevice> device = DynamicCast<OffloadPointToPointNetDevice>(link.Get(i));
+                if (corrupt) {
+                    device->SetCorruptionModel(model);
+                    streamUsers.push_back([device](int64_t stream) { return device->AssignStreams(stream); });
+                } else {
+                    device->SetAttribute("ReceiveErrorModel", PointerValue(model));
+                }
+            }
+        }
+    }
+
+    //r1 stands for the Internet, so its outgoing queues (towards r0 and towards r2)
+    //are shared with everybody else's traffic
+    if (crossLoad > 0) {
+        double dutyCycle = crossOnTime.GetSeconds() / (crossOnTime + crossOffTime).GetSeconds();
+        DataRate onRate(static_cast<uint64_t>(DataRate(transitRate).GetBitRate() * crossLoad / dutyCycle));
+        for (Ptr<NetDevice> device : {link1.Get(1), link2.Get(0)}) {
+            Ptr<FluidCrossTraffic> crossTraffic = CreateObject<FluidCrossTraffic>();
+            crossTraffic->SetAttribute("OnRate", DataRateValue(onRate));
+            crossTraffic->SetAttribute("MeanOnTime", TimeValue(crossOnTime));
+            crossTraffic->SetAttribute("MeanOffTime", TimeValue(crossOffTime));
+            DynamicCast<OffloadPointToPointNetDevice>(device)->SetCrossTraffic(crossTraffic);
+            streamUsers.push_back([crossTraffic](int64_t stream) { return crossTraffic->AssignStreams(stream); });
+        }
+    }
 
     /*
      * SECTION 2:
@@ -180,32 +6425,142 @@ int main (int argc, char *argv[]) {
      * functionality. Also add sockets for sending and receiving UDP packets
      */
     
+    SetMemoryTag(MEM_STACKS);
     InternetStackHelper iStackHelp;
 
     iStackHelp.Install(network1);
     iStackHelp.Install(network2);
     iStackHelp.Install(routers.Get(1));
+    iStackHelp.Install(backupRouter);
+    streamUsers.push_back([&iStackHelp](int64_t stream) {
+        return iStackHelp.AssignStreams(NodeContainer::GetGlobal(), stream);
+    });
+    streamUsers.push_back([&lanCSMA, lan1, lan2, switchPorts](int64_t stream) {
+        int64_t used = lanCSMA.AssignStreams(lan1, stream);
+        used += lanCSMA.AssignStreams(lan2, stream + used);
+        return used + lanCSMA.AssignStreams(switchPorts, stream + used);
+    });
 
+    SetMemoryTag(MEM_ROUTING);
     Ipv4AddressHelper ipv4;
     Ipv4InterfaceContainer lan1Subnet, lan2Subnet, link1Subnet, link2Subnet;
-    
-    //Setting up the IP addresses for the two LAN subnets
-    ipv4.SetBase("10.1.1.0", "255.255.255.0");
-    lan1Subnet = ipv4.Assign(lan1);
 
-    ipv4.SetBase("10.1.2.0", "255.255.255.0");
-    lan2Subnet = ipv4.Assign(lan2);
+    //LANs that do not fit a /24 move to 10.16.0.0 and 10.32.0.0 with a shorter prefix
+    Ipv4Address lan1Network("10.1.1.0");
+    Ipv4Address lan2Network("10.1.2.0");
+    Ipv4Mask lanMask("255.255.255.0");
+    if (lanSize + 1 > 254) {
+        uint32_t prefix = 24;
+        while ((1u << (32 - prefix)) < lanSize + 3) {
+            prefix--;
+        }
+        NS_ABORT_MSG_IF(prefix < 12, "--lanSize does not fit in a /12");
+        lan1Network = Ipv4Address("10.16.0.0");
+        lan2Network = Ipv4Address("10.32.0.0");
+        lanMask = Ipv4Mask(~0u << (32 - prefix));
+    }
+
+    //The tunnel runs between two addresses that do not belong to any one link
+    //(added to the loopback interface and announced to global routing), so it
+    //survives a link failure as long as some path is left
+    Ipv4Address endpoint1("10.1.255.1");
+    Ipv4Address endpoint2("10.1.255.2");
+    Ipv4Mask hostMask("255.255.255.255");
+
+    std::ostringstream scenario;
+    scenario << "lanSize=" << lanSize << " backupPath=" << backupPath << " switchedLan=" << switchedLan;
+    TopologySnapshot snapshot(scenario.str());
+    auto interfacesOf = [](NetDeviceContainer devices) {
+        Ipv4InterfaceContainer interfaces;
+        for (uint32_t i = 0; i < devices.GetN(); i++) {
+            Ptr<Ipv4> node = devices.Get(i)->GetNode()->GetObject<Ipv4>();
+            interfaces.Add(node, node->GetInterfaceForDevice(devices.Get(i)));
+        }
+        return interfaces;
+    };
+
+    if (!loadSnapshot.empty()) {
+        snapshot.Load(loadSnapshot);
+        snapshot.Apply();
+        lan1Subnet = interfacesOf(lan1);
+        lan2Subnet = interfacesOf(lan2);
+        link1Subnet = interfacesOf(link1);
+        link2Subnet = interfacesOf(link2);
+    } else {
+        //Setting up the IP addresses for the two LAN subnets
+        ipv4.SetBase(lan1Network, lanMask);
+        lan1Subnet = ipv4.Assign(lan1);
 
-    //Setting up the IP addresses for the two router link subnets
-    //Note these subnets have less specific IP address prefixes
-    ipv4.SetBase("10.1.100.0", "255.255.255.0");
-    link1Subnet = ipv4.Assign(link1);
+        ipv4.SetBase(lan2Network, lanMask);
+        lan2Subnet = ipv4.Assign(lan2);
 
-    ipv4.SetBase("10.1.200.0", "255.255.255.0");
-    link2Subnet = ipv4.Assign(link2);
+        //Setting up the IP addresses for the two router link subnets
+        //Note these subnets have less specific IP address prefixes
+        ipv4.SetBase("10.1.100.0", "255.255.255.0");
+        link1Subnet = ipv4.Assign(link1);
 
-    //Create routing tables for all of the nodes in the network
-    Ipv4GlobalRoutingHelper :: PopulateRoutingTables();
+        ipv4.SetBase("10.1.200.0", "255.255.255.0");
+        link2Subnet = ipv4.Assign(link2);
+
+        if (backupPath) {
+            ipv4.SetBase("10.1.150.0", "255.255.255.0");
+            Ipv4InterfaceContainer backup1Subnet = ipv4.Assign(backupLink1);
+            ipv4.SetBase("10.1.250.0", "255.255.255.0");
+            Ipv4InterfaceContainer backup2Subnet = ipv4.Assign(backupLink2);
+            for (Ipv4InterfaceContainer subnet : {backup1Subnet, backup2Subnet}) {
+                for (uint32_t i = 0; i < subnet.GetN(); i++) {
+                    subnet.Get(i).first->SetMetric(subnet.Get(i).second, 3);
+                }
+            }
+        }
+
+        routers.Get(0)->GetObject<Ipv4>()->AddAddress(0, Ipv4InterfaceAddress(endpoint1, hostMask));
+        routers.Get(0)->GetObject<GlobalRouter>()->InjectRoute(endpoint1, hostMask);
+        routers.Get(2)->GetObject<Ipv4>()->AddAddress(0, Ipv4InterfaceAddress(endpoint2, hostMask));
+        routers.Get(2)->GetObject<GlobalRouter>()->InjectRoute(endpoint2, hostMask);
+
+        //Create routing tables for all of the nodes in the network
+        Ipv4GlobalRoutingHelper :: PopulateRoutingTables();
+    }
+
+    //The table goes in front of r1's static and global routing, which keep the
+    //routes of the simulated network (see SECTION 15)
+    Ptr<Dir24Fib> fib;
+    if (!fibPrefixes.empty()) {
+        fib = CreateObject<Dir24Fib>();
+        Ptr<Ipv4ListRouting> list = DynamicCast<Ipv4ListRouting>(routers.Get(1)->GetObject<Ipv4>()->GetRoutingProtocol());
+        NS_ABORT_MSG_IF(!list, "--fibPrefixes needs the Ipv4ListRouting of the InternetStackHelper on r1");
+        list->AddRoutingProtocol(fib, 10);
+        fib->LoadPrefixes(fibPrefixes);
+        fib->AddLocalPrefixes();
+        fib->Build();
+    }
+
+    //With the caches filled nobody has to ask: --staticArp covers the traffic through the
+    //routers, --noArp also covers traffic between two hosts of the same LAN. The
+    //routers were added to the LANs last, so their devices are the last ones
+    SetMemoryTag(MEM_STACKS);
+    uint64_t arpEntries = 0;
+    if (staticArp || noArp) {
+        arpEntries += PopulateArpCaches(lan1, lan1.Get(lan1.GetN() - 1), noArp);
+        arpEntries += PopulateArpCaches(lan2, lan2.Get(lan2.GetN() - 1), noArp);
+    }
+    ArpMonitor arpMonitor;
+    arpMonitor.Watch(lan1.Get(lan1.GetN() - 1));
+    arpMonitor.Watch(lan2.Get(lan2.GetN() - 1));
+
+    //A queue disc in front of the transit devices would hold trains as single
+    //packets, so in --trains mode the device queue is the only queue
+    if (trains) {
+        TrafficControlHelper trafficControl;
+        trafficControl.Uninstall(link1);
+        trafficControl.Uninstall(link2);
+        //Trains move to the backup path after a failover
+        if (backupPath) {
+            trafficControl.Uninstall(backupLink1);
+            trafficControl.Uninstall(backupLink2);
+        }
+    }
 
     /*
      * Because Ipv4AddressHelper simply increments the address numbers, 
@@ -219,44 +6574,439 @@ int main (int argc, char *argv[]) {
      * n4: 10.1.2.2
      * n5: 10.1.2.3
      *  
-     * r0: 10.1.1.4,     10.1.100.1
+     * r0: 10.1.1.4,     10.1.100.1,   11.0.0.1 (tunnel),   10.1.255.1 (tunnel endpoint)
      * r1: 10.1.100.2,   10.1.200.1
-     * r2: 10.1.2.4,     10.1.200.2
+     * r2: 10.1.2.4,     10.1.200.2,   11.0.0.2 (tunnel),   10.1.255.2 (tunnel endpoint)
+     * r3: 10.1.150.2,   10.1.250.1    (only with --backupPath)
+     */
+
+    /*
+     * SECTION 3 (continued):
+     * Setting up the two gateways. Each one encrypts what it sends with its outbound SA
+     * and decrypts what it receives with its inbound SA, so the SAs are mirrored. The
+     * tunnel interfaces get 11.0.0.1 (r0) and 11.0.0.2 (r2).
      */
+    SetMemoryTag(MEM_VPN);
+    SecurityAssociation sa1to2 = {0x1001, 123, 0};
+    SecurityAssociation sa2to1 = {0x2001, 321, 0};
+    if (!loadSnapshot.empty()) {
+        NS_ABORT_MSG_IF(snapshot.GetSecurityAssociations().size() != 2, "Snapshot does not hold two SAs");
+        sa1to2 = snapshot.GetSecurityAssociations()[0];
+        sa2to1 = snapshot.GetSecurityAssociations()[1];
+    } else if (!saveSnapshot.empty()) {
+        snapshot.Capture();
+        snapshot.AddSecurityAssociation(sa1to2);
+        snapshot.AddSecurityAssociation(sa2to1);
+        snapshot.Save(saveSnapshot);
+    }
+    uint16_t tunnelMtu = superMtu - tunnelOverhead;
+
+    VpnGateway gateway1(routers.Get(0), endpoint2, Ipv4Address("11.0.0.1"),
+                        sa1to2, sa2to1, tunnelMtu);
+    gateway1.SetProtection(mode, integrityAlgorithm);
+    gateway1.SetTiming(gatewayTiming);
+    gateway1.AddRemoteNetwork(lan2Network, lanMask, Ipv4Address("11.0.0.2"));
+
+    VpnGateway gateway2(routers.Get(2), endpoint1, Ipv4Address("11.0.0.2"),
+                        sa2to1, sa1to2, tunnelMtu);
+    gateway2.SetProtection(mode, integrityAlgorithm);
+    gateway2.SetTiming(gatewayTiming);
+    gateway2.AddRemoteNetwork(lan1Network, lanMask, Ipv4Address("11.0.0.1"));
+
+    //TCP policies for ports from 10000 up, which none of the workloads use, so every
+    //packet searches all of them before the catch-all protects it
+    if (spdPolicies > 0 || flowCache > 0) {
+        for (uint32_t i = 0; i < spdPolicies; i++) {
+            uint16_t port = 10000 + i % 39000;
+            gateway1.AddPolicy({lan1Network, lanMask, lan2Network, lanMask, 6, port, port, POLICY_PROTECT});
+            gateway2.AddPolicy({lan2Network, lanMask, lan1Network, lanMask, 6, port, port, POLICY_PROTECT});
+        }
+        SecurityPolicy any = {Ipv4Address::GetAny(), Ipv4Mask::GetZero(), Ipv4Address::GetAny(),
+                              Ipv4Mask::GetZero(), 0, 0, UINT16_MAX, POLICY_PROTECT};
+        gateway1.AddPolicy(any);
+        gateway2.AddPolicy(any);
+        gateway1.SetFlowCache(flowCache);
+        gateway2.SetFlowCache(flowCache);
+    }
+
+    if (padding || !chaffRate.empty()) {
+        NS_ABORT_MSG_IF(gso && !chaffRate.empty(), "--chaffRate cannot carry --gso super-packets");
+        //What fits in one transit frame, also in --gso mode where the tunnel MTU is larger
+        uint32_t largestBucket = transitMtu - tunnelOverhead;
+        std::vector<uint32_t> buckets;
+        std::istringstream sizes(padBuckets);
+        std::string size;
+        while (std::getline(sizes, size, ',')) {
+            if (std::stoul(size) < largestBucket) {
+                buckets.push_back(std::stoul(size));
+            }
+        }
+        buckets.push_back(largestBucket);
+        //Chaff is sent by the rank that owns the gateway
+        DataRate rate(chaffRate.empty() ? "0bps" : chaffRate);
+        if (IsLocal(partition, routers.Get(0))) {
+            gateway1.SetShaping(buckets, rate, DataRate(transitRate));
+        }
+        if (IsLocal(partition, routers.Get(2))) {
+            gateway2.SetShaping(buckets, rate, DataRate(transitRate));
+        }
+    }
 
     //We will set up n0 from LAN #1 to be a server for UDP datagrams
+    SetMemoryTag(MEM_APPLICATIONS);
+    std::string echoFill = "Óàççê›ÒêíçÞ{";
     Address serverAddress = Address(lan1Subnet.GetAddress(0));
     uint16_t serverListenerPort = 9;  // Echo port number from RFC 863
+    ApplicationContainer apps;
+    RoundTripProbe echoProbe;
+    Ptr<RpcServer> rpcServer;
+    std::vector<Ptr<RpcClient> > rpcApps;
 
-    UdpEchoServerHelper server(serverListenerPort);
-    ApplicationContainer apps = server.Install(network1.Get(0));
-    
-    apps.Start(Seconds(1.0));
-    apps.Stop(Seconds(10.0));
-
-    //We will set up n5 from LAN #2 to be a client sending UDP datagrams
-    uint32_t packetSize = 1024;
-    uint32_t maxPacketCount = 1;
-    Time interPacketInterval = Seconds(1.);
-
-    UdpEchoClientHelper client(serverAddress, serverListenerPort);
-    client.SetAttribute ("MaxPackets", UintegerValue (maxPacketCount));
-    client.SetAttribute ("Interval", TimeValue (interPacketInterval));
-    client.SetAttribute ("PacketSize", UintegerValue (packetSize));
-    apps = client.Install(network2.Get(2));
-    apps.Start(Seconds(2.0));
-    apps.Stop(Seconds(10.0));
-    client.SetFill(apps.Get(0), "Óàççê›ÒêíçÞ{");
+    //In --mpi mode an application only goes on a node of this rank (see SECTION 16)
+    auto local = [&partition](Ptr<Node> node) { return IsLocal(partition, node); };
+
+    if (rpcClients == 0 && local(network1.Get(0))) {
+        UdpEchoServerHelper server(serverListenerPort);
+        apps = server.Install(network1.Get(0));
+
+        apps.Start(Seconds(1.0));
+        apps.Stop(Seconds(10.0));
+    }
+    if (rpcClients == 0 && local(network2.Get(2))) {
+        //We will set up n5 from LAN #2 to be a client sending UDP datagrams
+        uint32_t packetSize = 1024;
+        uint32_t maxPacketCount = 1;
+        Time interPacketInterval = Seconds(1.);
+
+        UdpEchoClientHelper client(serverAddress, serverListenerPort);
+        client.SetAttribute ("MaxPackets", UintegerValue (maxPacketCount));
+        client.SetAttribute ("Interval", TimeValue (interPacketInterval));
+        client.SetAttribute ("PacketSize", UintegerValue (packetSize));
+        apps = client.Install(network2.Get(2));
+        apps.Start(Seconds(2.0));
+        apps.Stop(Seconds(10.0));
+        client.SetFill(apps.Get(0), echoFill);
+        echoProbe.Watch(apps.Get(0));
+    }
+    if (rpcClients > 0) {
+        //--rpcClients replaces the echo with RPC load from the hosts of LAN #2 to n0
+        if (local(network1.Get(0))) {
+            rpcServer = CreateObject<RpcServer>();
+            network1.Get(0)->AddApplication(rpcServer);
+            rpcServer->SetStartTime(Seconds(1.0));
+        }
+        //The clients of other ranks are created all the same, so that every rank
+        //assigns the same streams
+        for (uint32_t i = 0; i < rpcClients; i++) {
+            Ptr<RpcClient> rpc = CreateObject<RpcClient>();
+            rpc->SetAttribute("Remote", AddressValue(InetSocketAddress(lan1Subnet.GetAddress(0), 7000)));
+            rpc->SetAttribute("Concurrency", UintegerValue(rpcConcurrency));
+            rpc->SetAttribute("Rate", DoubleValue(rpcRate));
+            rpc->SetAttribute("RequestSize", StringValue(rpcRequestSize));
+            rpc->SetAttribute("ResponseSize", StringValue(rpcResponseSize));
+            streamUsers.push_back([rpc](int64_t stream) { return rpc->AssignStreams(stream); });
+            if (!local(network2.Get(i % lanSize))) {
+                continue;
+            }
+            network2.Get(i % lanSize)->AddApplication(rpc);
+            rpc->SetStartTime(Seconds(2.0));
+            rpc->SetStopTime(Seconds(10.0));
+            rpcApps.push_back(rpc);
+        }
+    }
+
+    //Bulk TCP transfer from n1 to n4 through the tunnel
+    uint16_t bulkPort = 5000;
+    Ptr<PacketSink> bulkSink;
+    if (bulkBytes > 0 && local(network1.Get(1))) {
+        BulkSendHelper bulk("ns3::TcpSocketFactory", InetSocketAddress(lan2Subnet.GetAddress(1), bulkPort));
+        bulk.SetAttribute("MaxBytes", UintegerValue(bulkBytes));
+        if (gso) {
+            bulk.SetAttribute("SendSize", UintegerValue(gsoSize - 60));
+        }
+        apps = bulk.Install(network1.Get(1));
+        apps.Start(Seconds(2.0));
+        apps.Stop(Seconds(20.0));
+    }
+    if (bulkBytes > 0 && local(network2.Get(1))) {
+        PacketSinkHelper sink("ns3::TcpSocketFactory", InetSocketAddress(Ipv4Address::GetAny(), bulkPort));
+        apps = sink.Install(network2.Get(1));
+        apps.Start(Seconds(1.0));
+        bulkSink = DynamicCast<PacketSink>(apps.Get(0));
+    }
+
+    //The routers were added to the LANs last, everything before them is a host
+    std::unique_ptr<CaptureReplay> captureReplay;
+    if (!replay.empty()) {
+        NS_ABORT_MSG_IF(replaySpeed <= 0, "--replaySpeed must be positive");
+        NodeContainer hosts1, hosts2;
+        for (uint32_t i = 0; i < lanSize; i++) {
+            hosts1.Add(network1.Get(i));
+            hosts2.Add(network2.Get(i));
+        }
+        captureReplay.reset(new CaptureReplay(replay, hosts1, hosts2, replaySpeed));
+        captureReplay->Start(replayStart);
+    }
+
+    //CBR load from r0 to r2 across both transit links
+    Ptr<TrainSource> cbrSource;
+    Ptr<TrainSink> cbrSink;
+    if (!cbrRate.empty() && local(routers.Get(2))) {
+        cbrSink = CreateObject<TrainSink>();
+        routers.Get(2)->AddApplication(cbrSink);
+        cbrSink->SetStartTime(Seconds(1.0));
+    }
+    if (!cbrRate.empty() && local(routers.Get(0))) {
+        cbrSource = CreateObject<TrainSource>();
+        cbrSource->SetAttribute("Remote", AddressValue(InetSocketAddress(link2Subnet.GetAddress(1), 6000)));
+        cbrSource->SetAttribute("DataRate", DataRateValue(DataRate(cbrRate)));
+        cbrSource->SetAttribute("TrainLength", UintegerValue(trains ? trainLength : 1));
+        routers.Get(0)->AddApplication(cbrSource);
+        cbrSource->SetStartTime(Seconds(2.0));
+        cbrSource->SetStopTime(Seconds(10.0));
+    }
     
 
+    /*
+     * SECTION 7 (continued):
+     * Once failures are scheduled, TransitRouteManager takes over routing between the
+     * transit routers and TunnelMonitor watches the tunnel throughput around each failure.
+     */
+    SetMemoryTag(MEM_ROUTING);
+    TransitRouteManager routeManager(detectDelay);
+    TunnelMonitor tunnelMonitor({&gateway1, &gateway2}, MilliSeconds(10));
+    if (!failures.empty()) {
+        std::map<std::string, uint32_t> linkIds, routerIds;
+        for (uint32_t i = 0; i < routers.GetN(); i++) {
+            routerIds["r" + std::to_string(i)] = routeManager.AddRouter(routers.Get(i));
+        }
+        if (backupPath) {
+            routerIds["r3"] = routeManager.AddRouter(backupRouter.Get(0));
+        }
+        linkIds["link1"] = routeManager.AddLink(link1);
+        linkIds["link2"] = routeManager.AddLink(link2);
+        if (backupPath) {
+            linkIds["backup1"] = routeManager.AddLink(backupLink1);
+            linkIds["backup2"] = routeManager.AddLink(backupLink2);
+        }
+        routeManager.AddDestination(routerIds["r0"], endpoint1, hostMask);
+        routeManager.AddDestination(routerIds["r2"], endpoint2, hostMask);
+        routeManager.Start();
+
+        std::istringstream specs(failures);
+        std::string spec;
+        while (std::getline(specs, spec, ',')) {
+            std::istringstream fields(spec);
+            std::string name;
+            double down = 0, up = 0;
+            char colon;
+            std::getline(fields, name, ':');
+            fields >> down >> colon >> up;
+            if (linkIds.count(name)) {
+                routeManager.ScheduleLinkFailure(linkIds[name], Seconds(down), Seconds(up));
+            } else if (routerIds.count(name)) {
+                routeManager.ScheduleRouterFailure(routerIds[name], Seconds(down), Seconds(up));
+            } else {
+                NS_FATAL_ERROR("Unknown link or router in --failures: " << name);
+            }
+            tunnelMonitor.AddEvent(name + " down", Seconds(down));
+        }
+        tunnelMonitor.Start(Seconds(1.0));
+    }
+
     //Add tracing to this program so that the packets can be seen in Wireshark
-    AsciiTraceHelper ascii;
-    pointToPoint.EnableAsciiAll(ascii.CreateFileStream("vpn.tr"));
-    pointToPoint.EnablePcapAll("vpn");
+    SetMemoryTag(MEM_OTHER);
+    if (tracing) {
+        AsciiTraceHelper ascii;
+        pointToPoint.EnableAsciiAll(ascii.CreateFileStream("vpn.tr"));
+        pointToPoint.EnablePcapAll("vpn");
+    }
 
+    auto assignStreams = [&streamUsers]() {
+        int64_t stream = 1000;
+        for (auto &assign : streamUsers) {
+            stream += assign(stream);
+        }
+    };
+    assignStreams();
+
+    if (!saveSnapshot.empty() || !loadSnapshot.empty()) {
+        double setupSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - setupStart).count();
+        std::cout << "Topology snapshot " << (loadSnapshot.empty() ? "saved" : "loaded")
+                  << ", setup took " << setupSeconds << " s:" << std::endl;
+        snapshot.PrintStats(std::cout);
+    }
+
+    std::istringstream reportTimes(memoryReportAt);
+    std::string reportTime;
+    while (std::getline(reportTimes, reportTime, ',')) {
+        Simulator::Schedule(Seconds(std::stod(reportTime)), &PrintMemoryReportNow);
+    }
+
+    //The echo fill must never be readable on the transit routers
+    LeakDetector leakDetector;
+    if (leakCheck) {
+        leakDetector.AddMarker(echoFill);
+        std::istringstream markers(leakMarkers);
+        std::string marker;
+        while (std::getline(markers, marker, ',')) {
+            leakDetector.AddMarker(marker);
+        }
+        leakDetector.WatchNode(routers.Get(1));
+        if (backupPath) {
+            leakDetector.WatchNode(backupRouter.Get(0));
+        }
+    }
+
+    //Every transit and LAN device, including the switch ports; not in forked or MPI
+    //runs, which would all write the same file
+    std::unique_ptr<TimeSeriesSampler> sampler;
+    if (sampleInterval.IsStrictlyPositive() && forkRuns == 0 && !mpi) {
+        sampler.reset(new TimeSeriesSampler(sampleInterval, sampleCapacity));
+        for (NetDeviceContainer devices : {link1, link2, backupLink1, backupLink2, lan1, lan2, switchPorts}) {
+            for (uint32_t i = 0; i < devices.GetN(); i++) {
+                Ptr<NetDevice> device = devices.Get(i);
+                std::ostringstream name;
+                name << "n" << device->GetNode()->GetId() << "/" << device->GetIfIndex();
+                sampler->AddDevice(name.str(), device);
+            }
+        }
+        sampler->AddGateway("r0", &gateway1);
+        sampler->AddGateway("r2", &gateway2);
+        sampler->Start(sampleInterval);
+    }
+
+    //From here on whatever is not charged to the event queue is charged to the packets
+    SetMemoryTag(MEM_PACKETS);
     Simulator::Stop(Seconds(20));
+    if (forkRuns > 0) {
+        double setupSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - setupStart).count();
+        std::cout << "Setup took " << setupSeconds << " s, shared by " << forkRuns << " runs:" << std::endl;
+        RunReplications(forkRuns, forkJobs, assignStreams, [&]() {
+            ReplicationResult result = {};
+            result.events = Simulator::GetEventCount();
+            result.bulkBytes = bulkSink ? bulkSink->GetTotalRx() : 0;
+            result.cbrSent = cbrSource ? cbrSource->GetPacketsSent() : 0;
+            result.cbrReceived = cbrSink ? cbrSink->GetPacketsReceived() : 0;
+            for (const VpnGateway *gateway : {&gateway1, &gateway2}) {
+                result.tunnelPackets += gateway->GetPacketsReceived();
+                result.tunnelBytes += gateway->GetBytesDecrypted();
+                result.icvFailures += gateway->GetIcvFailures();
+            }
+            result.roundTrip = echoProbe.GetHistogram();
+            for (Ptr<RpcClient> rpc : rpcApps) {
+                result.roundTrip.Merge(rpc->GetLatency());
+            }
+            if (cbrSink) {
+                result.oneWay = cbrSink->GetLatency();
+            }
+            return result;
+        }, std::cout);
+        Simulator::Destroy();
+        return 0;
+    }
+
+    auto wallStart = std::chrono::steady_clock::now();
     Simulator::Run();
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+    //In --mpi mode every rank reports what it simulated, in rank order (see SECTION 16)
+    uint64_t events = Simulator::GetEventCount();
+    std::ostringstream rankReport;
+    std::ostream &report = mpi ? rankReport : std::cout;
+    report << "Executed " << events << " events in " << wallSeconds << " s ("
+           << events / std::max(wallSeconds, 1e-9) << " events/s)" << std::endl;
+    PrintBuildProfile(report);
+    if (eventBatching) {
+        report << "Event batches:" << std::endl;
+        PrintBatchingStats(report);
+    }
+    if (bulkSink) {
+        report << "Bulk flow: " << bulkSink->GetTotalRx() << " of " << bulkBytes
+               << " bytes delivered" << std::endl;
+    }
+    if (cbrSource && cbrSink) {
+        report << "CBR load: " << cbrSink->GetPacketsReceived() << " of " << cbrSource->GetPacketsSent()
+               << " packets delivered" << std::endl;
+    } else if (cbrSource) {
+        report << "CBR load: " << cbrSource->GetPacketsSent() << " packets sent" << std::endl;
+    } else if (cbrSink) {
+        report << "CBR load: " << cbrSink->GetPacketsReceived() << " packets received" << std::endl;
+    }
+    if (cbrSink) {
+        report << "CBR one-way latency: ";
+        cbrSink->GetLatency().Print(report);
+    }
+    if (rpcClients == 0) {
+        report << "Echo round trip: ";
+        echoProbe.GetHistogram().Print(report);
+    } else {
+        uint64_t sent = 0, received = 0, lost = 0;
+        LatencyHistogram rpcLatency;
+        for (Ptr<RpcClient> rpc : rpcApps) {
+            sent += rpc->GetRequestsSent();
+            received += rpc->GetResponsesReceived();
+            lost += rpc->GetRequestsLost();
+            rpcLatency.Merge(rpc->GetLatency());
+        }
+        report << "RPC load: " << received << " of " << sent << " requests answered, " << lost
+               << " lost, " << (rpcServer ? rpcServer->GetRequests() : 0) << " served" << std::endl;
+        report << "RPC round trip: ";
+        rpcLatency.Print(report);
+    }
+    if (leakCheck) {
+        report << "Leak check on the transit routers:" << std::endl;
+        leakDetector.PrintStats(report);
+    }
+    if (captureReplay) {
+        report << "Replay of " << replay << ":" << std::endl;
+        captureReplay->PrintStats(report);
+    }
+    if (!failures.empty()) {
+        report << "Route updates:" << std::endl;
+        routeManager.PrintStats(report);
+        report << "Tunnel around failures:" << std::endl;
+        tunnelMonitor.Report(report);
+    }
+    if (fib) {
+        report << "Forwarding table on r1:" << std::endl;
+        fib->MeasureLookup();
+        fib->PrintStats(report);
+    }
+    report << "ARP frames on the LANs: " << arpMonitor.GetFrames();
+    if (arpEntries > 0) {
+        report << " (" << arpEntries << " static entries)";
+    }
+    report << std::endl;
+    if (sampler) {
+        sampler->Write(sampleFile);
+        report << "Time series in " << sampleFile << ":" << std::endl;
+        sampler->PrintStats(report);
+    }
+    report << "Gateway r0:" << std::endl;
+    gateway1.PrintStats(report);
+    report << "Gateway r2:" << std::endl;
+    gateway2.PrintStats(report);
+    if (gso || trains || crossLoad > 0 || errorModel != "none") {
+        for (NetDeviceContainer link : {link1, link2}) {
+            for (uint32_t i = 0; i < link.GetN(); i++) {
+                report << "Transit device on node " << link.Get(i)->GetNode()->GetId() << ":" << std::endl;
+                DynamicCast<OffloadPointToPointNetDevice>(link.Get(i))->PrintStats(report);
+            }
+        }
+    }
+
+    if (mpi) {
+        PrintParallelStats(partition, rankReport.str(), events, wallSeconds, sequentialSeconds, std::cout);
+    }
 
+    if (memoryReport) {
+        PrintMemoryReport(std::cout, "before Simulator::Destroy");
+    }
     Simulator::Destroy();
+    if (memoryReport) {
+        PrintMemoryReport(std::cout, "after Simulator::Destroy");
+    }
+    StopParallel();
     return 0;
 }
\ No newline at end of file